@@ -0,0 +1,468 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "archive.h"
+#include "codec.h"
+#include "tar.h"
+#include "threads.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#define ERR(msg...) ERR2("crate archive", msg)
+
+namespace Archive {
+
+//
+// helpers
+//
+
+static const uint8_t magic[8]        = {0x89, 'C', 'R', 'A', 'T', 'E', '\r', '\n'};
+static const uint8_t magicTrailer[8] = {'C', 'R', 'A', 'T', 'E', 'I', 'D', 'X'};
+static const uint32_t version        = 2;
+static const size_t headerSize       = 16;
+static const size_t trailerSize      = 24;
+static const uint8_t FlagChunked     = 0x01; // blocks have content-defined boundaries
+
+// little-endian serialization
+static void put(std::vector<uint8_t> &buf, uint64_t val, unsigned bytes) {
+  for (unsigned i = 0; i < bytes; i++)
+    buf.push_back((val >> 8*i) & 0xff);
+}
+static void put(std::vector<uint8_t> &buf, const uint8_t *data, size_t size) {
+  buf.insert(buf.end(), data, data + size);
+}
+
+class Parser {
+  const uint8_t *data;
+  size_t         size;
+  size_t         pos = 0;
+public:
+  Parser(const uint8_t *newData, size_t newSize) : data(newData), size(newSize) { }
+  uint64_t get(unsigned bytes) {
+    need(bytes);
+    uint64_t val = 0;
+    for (unsigned i = 0; i < bytes; i++)
+      val |= uint64_t(data[pos++]) << 8*i;
+    return val;
+  }
+  bool atEnd() const {
+    return pos == size;
+  }
+  const uint8_t* get(size_t bytes, bool) {
+    need(bytes);
+    pos += bytes;
+    return data + pos - bytes;
+  }
+private:
+  void need(size_t bytes) {
+    if (pos + bytes > size)
+      ERR("the index is truncated")
+  }
+};
+
+// gear hash table for content-defined block boundaries, it has to stay the same for blocks to match across crates
+static const std::vector<uint64_t> gearTable = []() {
+  std::vector<uint64_t> table(256);
+  uint64_t x = 0x6372617465636463; // splitmix64
+  for (auto &t : table) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    t = z ^ (z >> 31);
+  }
+  return table;
+}();
+
+static void writeAll(int fd, const uint8_t *data, size_t size, const std::string &file) {
+  while (size > 0) {
+    auto res = ::write(fd, data, size);
+    if (res == -1)
+      ERR("failed to write the file '" << file << "': " << strerror(errno))
+    data += res;
+    size -= res;
+  }
+}
+
+//
+// Writer
+//
+
+class Writer::Impl : public Tar::Reader::Handler {
+public:
+  std::string                       file;
+  Codec::Type                       codec;
+  int                               level;
+  uint32_t                          blockSize;
+  bool                              chunked;
+  uint64_t                          gear = 0;         // rolling hash of the current block's tail, when chunked
+  uint64_t                          gearMask;         // a boundary is where the high bits of the hash are zero: blockSize on average
+  int                               fd = -1;
+  uint64_t                          fileOffset = 0;
+  std::vector<std::vector<uint8_t>> pending;  // full blocks waiting to be compressed in one parallel batch
+  std::vector<uint8_t>              current;  // the block being filled
+  std::vector<Block>                blocks;
+  std::map<std::string, Block>      written;  // blocks by their hash, when chunked: identical blocks are stored once
+  std::vector<Entry>                entries;
+  Tar::Reader                       reader;
+  ThreadPool                        pool;
+
+  Impl(const std::string &newFile, Codec::Type newCodec, int newLevel, uint32_t newBlockSize, bool newChunked)
+  : file(newFile), codec(newCodec), level(newLevel), blockSize(newBlockSize), chunked(newChunked), reader(*this)
+  {
+    unsigned bits = 0;
+    while ((2u << bits) <= blockSize)
+      bits++;
+    gearMask = bits == 0 ? 0 : ~uint64_t(0) << (64 - bits);
+    fd = ::open(file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1)
+      ERR("failed to create the file '" << file << "': " << strerror(errno))
+    std::vector<uint8_t> header;
+    put(header, magic, sizeof(magic));
+    put(header, version, 4);
+    put(header, blockSize, 4);
+    writeAll(fd, header.data(), header.size(), file);
+    fileOffset = header.size();
+  }
+  ~Impl() {
+    if (fd != -1)
+      (void)::close(fd);
+  }
+
+  // Tar::Reader::Handler
+  void onEntry(const Tar::Entry &entry) override {
+    entries.push_back({entry.path, entry.type, reader.entryOffset(), entry.size});
+  }
+  void onData(const uint8_t *data, size_t size) override { }
+  void onEntryEnd() override { }
+
+  void write(const uint8_t *data, size_t size) {
+    reader.feed(data, size);
+    while (size > 0) {
+      size_t n;
+      bool full;
+      if (chunked) { // content-defined boundaries (gear hash), between 1/4 and 4 times blockSize
+        size_t minSize = blockSize/4, maxSize = 4*(size_t)blockSize;
+        n = 0;
+        full = false;
+        if (current.size() + 64 < minSize) // the hash only depends on the last 64 bytes
+          n = std::min(size, minSize - 64 - current.size());
+        while (n < size && !full) {
+          gear = (gear << 1) + gearTable[data[n++]];
+          auto len = current.size() + n;
+          full = (len >= minSize && (gear & gearMask) == 0) || len == maxSize;
+        }
+      } else {
+        n = std::min(size, blockSize - current.size());
+        full = current.size() + n == blockSize;
+      }
+      current.insert(current.end(), data, data + n);
+      data += n;
+      size -= n;
+      if (full) {
+        pending.push_back(std::move(current));
+        current.clear();
+        gear = 0;
+        if (pending.size() >= 2*pool.size())
+          flush();
+      }
+    }
+  }
+  void flush() { // compress pending blocks in parallel, and write them in order
+    std::vector<Block> newBlocks(pending.size());
+    for (unsigned b = 0; b < pending.size(); b++)
+      pool.add([this,b,&newBlocks]() {
+        Util::sha256(pending[b].data(), pending[b].size(), newBlocks[b].hash);
+      });
+    pool.wait();
+
+    // blocks that are already in the file are referenced again instead of being written
+    std::vector<bool> isDup(pending.size(), false);
+    if (chunked) {
+      std::set<std::string> batch;
+      for (unsigned b = 0; b < pending.size(); b++) {
+        auto key = std::string((const char*)newBlocks[b].hash, sizeof(newBlocks[b].hash));
+        isDup[b] = written.find(key) != written.end() || !batch.insert(key).second;
+      }
+    }
+
+    std::vector<std::vector<uint8_t>> compressed(pending.size());
+    for (unsigned b = 0; b < pending.size(); b++)
+      if (!isDup[b])
+        pool.add([this,b,&compressed]() {
+          Codec::compressBuffer(codec, level, pending[b].data(), pending[b].size(), compressed[b]);
+        });
+    pool.wait();
+    for (unsigned b = 0; b < pending.size(); b++) {
+      auto key = std::string((const char*)newBlocks[b].hash, sizeof(newBlocks[b].hash));
+      if (isDup[b]) {
+        blocks.push_back(written[key]);
+        continue;
+      }
+      newBlocks[b].offset = fileOffset;
+      newBlocks[b].size = compressed[b].size();
+      newBlocks[b].uncompressedSize = pending[b].size();
+      newBlocks[b].codec = codec;
+      writeAll(fd, compressed[b].data(), compressed[b].size(), file);
+      fileOffset += compressed[b].size();
+      blocks.push_back(newBlocks[b]);
+      if (chunked)
+        written[key] = newBlocks[b];
+    }
+    pending.clear();
+  }
+  void finish() {
+    reader.finish();
+    if (!current.empty())
+      pending.push_back(std::move(current));
+    flush();
+
+    // index
+    std::vector<uint8_t> index;
+    put(index, blocks.size(), 4);
+    for (auto &b : blocks) {
+      put(index, b.offset, 8);
+      put(index, b.size, 8);
+      put(index, b.uncompressedSize, 8);
+      put(index, b.codec, 1);
+      put(index, b.hash, sizeof(b.hash));
+    }
+    put(index, entries.size(), 4);
+    for (auto &e : entries) {
+      put(index, e.path.size(), 4);
+      put(index, (const uint8_t*)e.path.c_str(), e.path.size());
+      put(index, (uint8_t)e.type, 1);
+      put(index, e.offset, 8);
+      put(index, e.size, 8);
+    }
+    put(index, codec, 1); // compression parameters, for tools that need to reproduce the crate
+    put(index, (uint8_t)level, 1);
+    put(index, chunked ? FlagChunked : 0, 1);
+    std::vector<uint8_t> indexCompressed;
+    Codec::compressBuffer(Codec::TypeXz, Codec::LevelDefault, index.data(), index.size(), indexCompressed);
+
+    // trailer: index location, uncompressed index size, magic
+    std::vector<uint8_t> trailer;
+    put(trailer, fileOffset, 8);
+    put(trailer, indexCompressed.size(), 4);
+    put(trailer, index.size(), 4);
+    put(trailer, magicTrailer, sizeof(magicTrailer));
+    writeAll(fd, indexCompressed.data(), indexCompressed.size(), file);
+    writeAll(fd, trailer.data(), trailer.size(), file);
+
+    if (::close(fd) == -1) {
+      fd = -1;
+      ERR("failed to close the file '" << file << "': " << strerror(errno))
+    }
+    fd = -1;
+  }
+};
+
+Writer::Writer(const std::string &newFile, Codec::Type newCodec, int newLevel, uint32_t newBlockSize, bool newChunked)
+: impl(new Impl(newFile, newCodec, newLevel, newBlockSize, newChunked))
+{ }
+
+Writer::~Writer() {
+}
+
+void Writer::write(const uint8_t *data, size_t size) {
+  impl->write(data, size);
+}
+
+void Writer::finish() {
+  impl->finish();
+}
+
+//
+// Reader
+//
+
+Reader::Reader(const std::string &file)
+: mf(file)
+{
+  if (mf.size < headerSize + trailerSize || ::memcmp(mf.data, magic, sizeof(magic)) != 0)
+    ERR("'" << file << "' isn't a crate archive")
+
+  // header
+  Parser header(mf.data + sizeof(magic), headerSize - sizeof(magic));
+  auto ver = header.get(4);
+  if (ver != version)
+    ERR("unsupported crate archive version " << ver << " in '" << file << "'")
+  blkSize = header.get(4);
+
+  // trailer
+  auto trailerData = mf.data + mf.size - trailerSize;
+  if (::memcmp(trailerData + 16, magicTrailer, sizeof(magicTrailer)) != 0)
+    ERR("the crate archive '" << file << "' is truncated")
+  Parser trailer(trailerData, 16);
+  auto indexOffset = trailer.get(8);
+  auto indexSize = trailer.get(4);
+  auto indexUncompressedSize = trailer.get(4);
+  if (indexOffset < headerSize || indexOffset + indexSize != mf.size - trailerSize)
+    ERR("the crate archive '" << file << "' has an invalid trailer")
+
+  // index
+  Codec::decompressBuffer(Codec::TypeXz, mf.data + indexOffset, indexSize, indexUncompressedSize, indexData);
+  Parser index(indexData.data(), indexData.size());
+  uint64_t uoffset = 0;
+  for (auto n = index.get(4); n > 0; n--) {
+    Block b;
+    b.offset = index.get(8);
+    b.size = index.get(8);
+    b.uncompressedSize = index.get(8);
+    b.codec = (Codec::Type)index.get(1);
+    ::memcpy(b.hash, index.get(sizeof(b.hash), true), sizeof(b.hash));
+    if (b.offset < headerSize || b.offset + b.size > indexOffset)
+      ERR("the crate archive '" << file << "' has an invalid block")
+    blks.push_back(b);
+    blkOffsets.push_back(uoffset);
+    uoffset += b.uncompressedSize;
+  }
+  for (auto n = index.get(4); n > 0; n--) {
+    Entry e;
+    auto len = index.get(4);
+    e.path = std::string((const char*)index.get(len, true), len);
+    e.type = (char)index.get(1);
+    e.offset = index.get(8);
+    e.size = index.get(8);
+    ents[e.path] = e;
+  }
+  if (!index.atEnd()) { // absent in crates written before compression became configurable
+    cdc = (Codec::Type)index.get(1);
+    lvl = (int8_t)index.get(1);
+  }
+  if (!index.atEnd())
+    flags = index.get(1);
+}
+
+std::string Reader::contentHash() const {
+  std::vector<uint8_t> buf;
+  for (auto &b : blks) {
+    put(buf, b.uncompressedSize, 8);
+    put(buf, b.hash, sizeof(b.hash));
+  }
+  uint8_t hash[32];
+  Util::sha256(buf.data(), buf.size(), hash);
+  return Util::toHex(hash, sizeof(hash));
+}
+
+void Reader::readAll(const Codec::FnData &fnData) const {
+  runOrdered(blks.size(), [this](unsigned b, std::vector<uint8_t> &out) {
+    decompressBlock(b, out);
+  }, [&fnData](unsigned b, std::vector<uint8_t> &out) {
+    fnData(out.data(), out.size());
+  });
+}
+
+void Reader::readRange(uint64_t offset, const Codec::FnData &fnData, const std::function<bool()> &fnDone) const {
+  auto it = std::upper_bound(blkOffsets.begin(), blkOffsets.end(), offset);
+  if (it == blkOffsets.begin())
+    ERR("invalid offset " << offset)
+  std::vector<uint8_t> out;
+  for (unsigned b = it - blkOffsets.begin() - 1; b < blks.size() && !fnDone(); b++) {
+    {
+      std::unique_lock<std::mutex> lock(cacheMutex);
+      if (b == cacheBlock)
+        out = cacheData;
+    }
+    if (out.empty()) {
+      decompressBlock(b, out);
+      std::unique_lock<std::mutex> lock(cacheMutex);
+      cacheBlock = b;
+      cacheData = out;
+    }
+    auto skip = offset > blkOffsets[b] ? offset - blkOffsets[b] : 0;
+    if (skip < out.size())
+      fnData(out.data() + skip, out.size() - skip);
+    out.clear();
+  }
+}
+
+bool Reader::readFile(const std::string &path, const Codec::FnData &fnData) const {
+  auto it = ents.find(Tar::normalizePath(path));
+  if (it == ents.end())
+    return false;
+
+  // parse the member from its first header, and stop when it ends
+  class Handler : public Tar::Reader::Handler {
+  public:
+    const Codec::FnData &fnData;
+    bool done = false;
+    Handler(const Codec::FnData &newFnData) : fnData(newFnData) { }
+    void onEntry(const Tar::Entry &entry) override { }
+    void onData(const uint8_t *data, size_t size) override {
+      if (!done)
+        fnData(data, size);
+    }
+    void onEntryEnd() override {
+      done = true;
+    }
+  } handler(fnData);
+  Tar::Reader reader(handler);
+  readRange(it->second.offset, [&reader,&handler](const uint8_t *data, size_t size) {
+    // feed in pieces so that the member's end is noticed early
+    while (size > 0 && !handler.done) {
+      auto n = std::min(size, (size_t)0x10000);
+      reader.feed(data, n);
+      data += n;
+      size -= n;
+    }
+  }, [&handler]() {return handler.done;});
+  if (!handler.done)
+    ERR("the member '" << path << "' is truncated in the crate archive")
+  return true;
+}
+
+void Reader::setBlockSource(const FnBlockSource &newBlockSource) {
+  blockSource = newBlockSource;
+}
+
+void Reader::readBlock(unsigned b, std::vector<uint8_t> &out) const {
+  auto &blk = blks[b];
+  Codec::decompressBuffer(blk.codec, mf.data + blk.offset, blk.size, blk.uncompressedSize, out);
+  uint8_t hash[32];
+  Util::sha256(out.data(), out.size(), hash);
+  if (::memcmp(hash, blk.hash, sizeof(hash)) != 0)
+    ERR("checksum mismatch in the block #" << b)
+}
+
+void Reader::decompressBlock(unsigned b, std::vector<uint8_t> &out) const {
+  auto &blk = blks[b];
+  if (!blockSource || !blockSource(blk, out)) {
+    readBlock(b, out);
+    return;
+  }
+  if (out.size() != blk.uncompressedSize)
+    ERR("the block #" << b << " from the block source has a wrong size")
+  uint8_t hash[32];
+  Util::sha256(out.data(), out.size(), hash);
+  if (::memcmp(hash, blk.hash, sizeof(hash)) != 0)
+    ERR("checksum mismatch in the block #" << b)
+}
+
+//
+// interface
+//
+
+bool isCrateArchive(const char *file) {
+  int fd = ::open(file, O_RDONLY);
+  if (fd == -1)
+    return false; // can't open: can't be a crate archive
+  uint8_t signature[sizeof(magic)];
+  auto res = ::read(fd, signature, sizeof(signature));
+  (void)::close(fd);
+  return res == sizeof(signature) && ::memcmp(signature, magic, sizeof(magic)) == 0;
+}
+
+}
@@ -0,0 +1,103 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Archive: the seekable crate format (version 2)
+//
+// The tar stream of the crate is cut into blocks of a fixed uncompressed size that are compressed independently.
+// The trailing index maps every archive member to its offset in the uncompressed stream, so that a single
+// file can be read by decompressing only the blocks that contain it, and all blocks can be decompressed in parallel.
+//
+// Layout: header (magic, version, block size), compressed blocks, compressed index, trailer (index offset, index size, magic).
+// Blocks are compressed with xz, zstd or not at all; the codec is recorded for every block, so the reader picks the decoder per block.
+// Chunked crates cut blocks at content-defined boundaries instead, so that the same files in different crates produce the same
+// blocks, which are then shared through the chunk store (see store.h).
+//
+
+#include "codec.h"
+#include "tar.h"
+#include "util.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <stdint.h>
+
+namespace Archive {
+
+class Block {
+public:
+  uint64_t    offset;           // compressed offset in the file
+  uint64_t    size;             // compressed size
+  uint64_t    uncompressedSize;
+  Codec::Type codec;
+  uint8_t     hash[32];         // SHA256 of the uncompressed block
+};
+
+class Entry {
+public:
+  std::string path;             // as in Tar::Entry::path
+  char        type;             // as in Tar::Entry::type
+  uint64_t    offset;           // offset of the member's first header in the uncompressed stream
+  uint64_t    size;             // size of the member's data
+};
+
+typedef std::function<bool(const Block &block, std::vector<uint8_t> &data)> FnBlockSource; // supplies uncompressed blocks, returns false when it doesn't have the block
+
+class Writer {
+public:
+  Writer(const std::string &newFile, Codec::Type newCodec = Codec::TypeXz, int newLevel = Codec::LevelDefault, uint32_t newBlockSize = 0x800000,
+         bool newChunked = false); // chunked: content-defined boundaries of blockSize on average, identical blocks are stored once
+  ~Writer();
+
+  void write(const uint8_t *data, size_t size); // the uncompressed tar stream
+  void finish();
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+class Reader {
+public:
+  Reader(const std::string &file);
+
+  const std::vector<Block>& blocks() const {return blks;}
+  const std::map<std::string, Entry>& entries() const {return ents;}
+  uint32_t blockSize() const {return blkSize;}
+  Codec::Type codec() const {return cdc;}  // compression that the crate was created with, blocks record their own codec
+  int level() const {return lvl;}
+  bool chunked() const {return flags & 0x01;}     // blocks have content-defined boundaries, see Writer
+  std::string contentHash() const; // hash of the index: identifies the crate content
+
+  void setBlockSource(const FnBlockSource &newBlockSource); // blocks are taken from there when it has them, instead of being decompressed
+  void readBlock(unsigned b, std::vector<uint8_t> &out) const; // decompresses the block, regardless of the block source
+  void readAll(const Codec::FnData &fnData) const;                           // whole tar stream, blocks are decompressed in parallel
+  void readRange(uint64_t offset, const Codec::FnData &fnData, const std::function<bool()> &fnDone) const; // the uncompressed stream from offset, block by block, until fnDone() is true
+  bool readFile(const std::string &path, const Codec::FnData &fnData) const; // data of one member, returns false when it isn't in the archive
+
+private:
+  MappedFile                   mf;
+  uint32_t                     blkSize;
+  Codec::Type                  cdc = Codec::TypeXz;
+  int                          lvl = Codec::LevelDefault;
+  uint8_t                      flags = 0;
+  FnBlockSource                blockSource;
+  std::vector<Block>           blks;
+  std::vector<uint64_t>        blkOffsets; // uncompressed offsets of blocks
+  std::map<std::string, Entry> ents;
+  std::vector<uint8_t>         indexData;
+  mutable std::mutex           cacheMutex;      // readRange() keeps the last block because nearby members are often read one after another
+  mutable unsigned             cacheBlock = -1;
+  mutable std::vector<uint8_t> cacheData;
+
+  void decompressBlock(unsigned b, std::vector<uint8_t> &out) const;
+};
+
+bool isCrateArchive(const char *file); // the crate file is in the seekable format
+
+}
@@ -3,6 +3,8 @@
 #include "args.h"
 #include "util.h"
 #include "err.h"
+#include "archive.h"
+#include "codec.h"
 
 #include <rang.hpp>
 
@@ -33,23 +35,97 @@ static void usage() {
   std::cout << "Commands:" << std::endl;
   std::cout << "  create                     creates a container (run 'crate create -h' for details)" << std::endl;
   std::cout << "  run                        runs the containerzed application (run 'crate run -h' for details)" << std::endl;
+  std::cout << "  cat                        prints a file stored in the crate (run 'crate cat -h' for details)" << std::endl;
+  std::cout << "  store                      manages the chunk store of thin crates (run 'crate store -h' for details)" << std::endl;
+  std::cout << "  delta                      computes the difference between two versions of a crate (run 'crate delta -h' for details)" << std::endl;
+  std::cout << "  patch                      applies the difference to the old version of a crate (run 'crate patch -h' for details)" << std::endl;
+  std::cout << "  bench-compress             measures compression settings on a crate or a jail directory (run 'crate bench-compress -h' for details)" << std::endl;
   std::cout << "" << std::endl;
 }
 
 static void usageCreate() {
   std::cout << "usage: crate create [-s <spec-file>|--spec <spec-file>] [-o <output-create-file>|--output <output-create-file>]" << std::endl;
+  std::cout << "                    [-c <method>|--compression <method>] [-l <level>|--level <level>] [-b <size>|--block-size <size>] [-t|--thin]" << std::endl;
+  std::cout << "                    [-a|--additive] [-T <trace-file>|--access-trace <trace-file>] [-n|--no-cache] [-L|--link-cache]" << std::endl;
   std::cout << "" << std::endl;
   std::cout << "Options:" << std::endl;
   std::cout << "  -s, --spec <spec-file>             crate specification (required)" << std::endl;
   std::cout << "  -o, --output <output-create-file>  output crate file" << std::endl;
+  std::cout << "  -c, --compression <method>         compression method: xz (default), zstd or none" << std::endl;
+  std::cout << "  -l, --level <level>                compression level: 0..9 for xz (default 6), 1..19 for zstd (default 19)" << std::endl;
+  std::cout << "  -b, --block-size <size>            size of independently compressed blocks, with the K or M suffix (default 8M, 256K when thin)" << std::endl;
+  std::cout << "  -t, --thin                         content-defined blocks, shared with other thin crates through the chunk store" << std::endl;
+  std::cout << "  -a, --additive                     link the kept files into a fresh tree instead of removing everything else" << std::endl;
+  std::cout << "  -n, --no-cache                     install the packages even when the cache has the tree with them installed" << std::endl;
+  std::cout << "  -L, --link-cache                   hardlink the files from the cache even when scripts or packages are installed: faster," << std::endl;
+  std::cout << "                                     but a script writing to such a file in place alters the cache" << std::endl;
+  std::cout << "  -T, --access-trace <trace-file>    keep what the trace (kdump, truss or a list of paths) has accessed, prune the rest of /usr/local" << std::endl;
   std::cout << "  -h, --help                         show this help screen" << std::endl;
   std::cout << "" << std::endl;
 }
 
 static void usageRun() {
-  std::cout << "usage: crate run [-h|--help] <create-file>" << std::endl;
+  std::cout << "usage: crate run [-h|--help] [-x|--extract-in-process] [-C|--cache] <create-file>" << std::endl;
   std::cout << "" << std::endl;
   std::cout << "Options:" << std::endl;
+  std::cout << "  -x, --extract-in-process           extract the crate in-process, decoding xz blocks in parallel" << std::endl;
+  std::cout << "  -C, --cache                        clone the crate from the extraction cache, hardlinking the files outside of the" << std::endl;
+  std::cout << "                                     writable paths: faster, but a service writing to such a file in place alters the cache" << std::endl;
+  std::cout << "  -h, --help                         show this help screen" << std::endl;
+  std::cout << "" << std::endl;
+}
+
+static void usageCat() {
+  std::cout << "usage: crate cat [-h|--help] <crate-file> <path>" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -h, --help                         show this help screen" << std::endl;
+  std::cout << "" << std::endl;
+}
+
+static void usageStore() {
+  std::cout << "usage: crate store [-h|--help] stats|import <crate-file>|remove <crate-file>" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Subcommands:" << std::endl;
+  std::cout << "  stats                              prints the dedupe ratio, bytes saved, hit rate and extra disk used by the chunk store" << std::endl;
+  std::cout << "  import <crate-file>                adds chunks of the thin crate to the store" << std::endl;
+  std::cout << "  remove <crate-file>                drops references of the crate, and chunks that no other crate references" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -h, --help                         show this help screen" << std::endl;
+  std::cout << "" << std::endl;
+}
+
+static void usageDelta() {
+  std::cout << "usage: crate delta [-h|--help] <old-crate-file> <new-crate-file> -o <delta-file>|--output <delta-file>" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -o, --output <delta-file>          output delta file (required)" << std::endl;
+  std::cout << "  -h, --help                         show this help screen" << std::endl;
+  std::cout << "" << std::endl;
+}
+
+static void usagePatch() {
+  std::cout << "usage: crate patch [-h|--help] <old-crate-file> <delta-file> -o <new-crate-file>|--output <new-crate-file>" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -o, --output <new-crate-file>      output crate file, byte-identical to the crate that the delta was made for (required)" << std::endl;
+  std::cout << "  -h, --help                         show this help screen" << std::endl;
+  std::cout << "" << std::endl;
+}
+
+static void usageBenchCompress() {
+  std::cout << "usage: crate bench-compress [-h|--help] [-c <methods>|--compression <methods>] [-l <levels>|--level <levels>]" << std::endl;
+  std::cout << "                            [-b <sizes>|--block-size <sizes>] [-j <numbers>|--threads <numbers>] <crate-file>|<jail-directory>" << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Every combination is measured: compressed size, compression and decompression time, and peak RSS of both." << std::endl;
+  std::cout << "" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -c, --compression <methods>        comma-separated compression methods: xz, zstd or none (default xz,zstd)" << std::endl;
+  std::cout << "  -l, --level <levels>               comma-separated compression levels, skipped for methods that don't have them" << std::endl;
+  std::cout << "                                     (default 0,3,6,9 for xz, 1,3,9,19 for zstd)" << std::endl;
+  std::cout << "  -b, --block-size <sizes>           comma-separated sizes of independently compressed blocks (default 256K,1M,8M)" << std::endl;
+  std::cout << "  -j, --threads <numbers>            comma-separated numbers of threads (default 1 and the number of CPUs)" << std::endl;
   std::cout << "  -h, --help                         show this help screen" << std::endl;
   std::cout << "" << std::endl;
 }
@@ -79,7 +155,7 @@ static const char isShort(const char* arg) {
 static const char* isLong(const char* arg) {
   if (arg[0] == '-' && arg[1] == '-') {
     for (int i = 2; arg[i]; i++)
-      if (!islower(arg[i]) || !isdigit(arg[i]))
+      if (!islower(arg[i]) && !isdigit(arg[i]) && arg[i] != '-')
         return nullptr;
     return arg + 2;
   }
@@ -92,6 +168,16 @@ static Command isCommand(const char* arg) {
     return CmdCreate;
   if (strEq(arg, "run"))
     return CmdRun;
+  if (strEq(arg, "cat"))
+    return CmdCat;
+  if (strEq(arg, "store"))
+    return CmdStore;
+  if (strEq(arg, "delta"))
+    return CmdDelta;
+  if (strEq(arg, "patch"))
+    return CmdPatch;
+  if (strEq(arg, "bench-compress"))
+    return CmdBenchCompress;
 
   return CmdNone;
 }
@@ -104,6 +190,56 @@ static const char* getArgParam(int aidx, int argc, char** argv) {
   return argv[aidx];
 }
 
+static int parseLevel(const char *param) {
+  char *end = nullptr;
+  auto level = ::strtol(param, &end, 10);
+  if (*end != 0 || level < 0 || level > 100)
+    err("the compression level should be a small non-negative number, found '%s'", param);
+  return level;
+}
+
+static unsigned parseSize(const char *param) {
+  char *end = nullptr;
+  auto size = ::strtoul(param, &end, 10);
+  if (strEq(end, "K") || strEq(end, "k"))
+    size <<= 10;
+  else if (strEq(end, "M") || strEq(end, "m"))
+    size <<= 20;
+  else if (*end != 0)
+    err("the size should be a number with an optional K or M suffix, found '%s'", param);
+  if (size < 0x1000 || size > 0x10000000)
+    err("the size should be between 4K and 256M, found '%s'", param);
+  return size;
+}
+
+static unsigned parseNumThreads(const char *param) {
+  char *end = nullptr;
+  auto num = ::strtoul(param, &end, 10);
+  if (*end != 0 || num < 1 || num > 1024)
+    err("the number of threads should be between 1 and 1024, found '%s'", param);
+  return num;
+}
+
+static int getArgLevel(int aidx, int argc, char** argv) {
+  return parseLevel(getArgParam(aidx, argc, argv));
+}
+
+static unsigned getArgSize(int aidx, int argc, char** argv) {
+  return parseSize(getArgParam(aidx, argc, argv));
+}
+
+template<typename T>
+static std::vector<T> getArgList(int aidx, int argc, char** argv, T (*parse)(const char*)) { // comma-separated values
+  std::vector<T> values;
+  for (auto &s : Util::splitString(getArgParam(aidx, argc, argv), ","))
+    values.push_back(parse(s.c_str()));
+  return values;
+}
+
+static std::string parseString(const char *param) {
+  return param;
+}
+
 //
 // interface
 //
@@ -113,6 +249,15 @@ void Args::validate() {
   case CmdCreate:
     if (createSpec.empty())
       ERR("the 'create' command requires the crate spec file as an argument (-s, --spec)")
+    {
+      Codec::Type type;
+      if (!Codec::typeFromName(createCompression, type))
+        ERR("unknown compression method '" << createCompression << "', expected xz, zstd or none")
+      if (!Codec::isValidLevel(type, createCompressionLevel))
+        ERR("compression level " << createCompressionLevel << " isn't valid for " << createCompression)
+    }
+    if (!createAccessTrace.empty() && !std::ifstream(createAccessTrace).good())
+      ERR("the access trace file can't be opened: " << createAccessTrace)
     break;
   case CmdRun:
     if (runCrateFile.empty())
@@ -120,6 +265,67 @@ void Args::validate() {
     if (!std::ifstream(runCrateFile).good())
       ERR("the file passed to the 'run' command can't be opened: " << runCrateFile)
     break;
+  case CmdCat:
+    if (catCrateFile.empty() || catFilePath.empty())
+      ERR("the 'cat' command requires the crate file and the path as arguments")
+    if (!std::ifstream(catCrateFile).good())
+      ERR("the file passed to the 'cat' command can't be opened: " << catCrateFile)
+    break;
+  case CmdStore:
+    if (storeSubcommand == "stats") {
+      if (!storeCrateFile.empty())
+        ERR("the 'store stats' command doesn't take arguments")
+    } else if (storeSubcommand == "import" || storeSubcommand == "remove") {
+      if (storeCrateFile.empty())
+        ERR("the 'store " << storeSubcommand << "' command requires the crate file as an argument")
+      if (!Archive::isCrateArchive(storeCrateFile.c_str()))
+        ERR("the file passed to the 'store " << storeSubcommand << "' command isn't a seekable crate: " << storeCrateFile)
+    } else {
+      ERR("the 'store' command requires a subcommand: stats, import or remove")
+    }
+    break;
+  case CmdDelta:
+    if (deltaOldCrateFile.empty() || deltaNewCrateFile.empty())
+      ERR("the 'delta' command requires the old and the new crate files as arguments")
+    if (deltaOutput.empty())
+      ERR("the 'delta' command requires the output file (-o, --output)")
+    for (auto &file : {deltaOldCrateFile, deltaNewCrateFile})
+      if (!std::ifstream(file).good())
+        ERR("the file passed to the 'delta' command can't be opened: " << file)
+    if (!Archive::isCrateArchive(deltaNewCrateFile.c_str()))
+      ERR("the new crate passed to the 'delta' command isn't a seekable crate: " << deltaNewCrateFile)
+    break;
+  case CmdPatch:
+    if (patchOldCrateFile.empty() || patchDeltaFile.empty())
+      ERR("the 'patch' command requires the old crate file and the delta file as arguments")
+    if (patchOutput.empty())
+      ERR("the 'patch' command requires the output file (-o, --output)")
+    for (auto &file : {patchOldCrateFile, patchDeltaFile})
+      if (!std::ifstream(file).good())
+        ERR("the file passed to the 'patch' command can't be opened: " << file)
+    break;
+  case CmdBenchCompress:
+    if (benchInput.empty())
+      ERR("the 'bench-compress' command requires the crate file or the jail directory as an argument")
+    if (!Util::Fs::dirExists(benchInput)) {
+      if (!std::ifstream(benchInput).good())
+        ERR("the file passed to the 'bench-compress' command can't be opened: " << benchInput)
+      if (Codec::sniffFile(benchInput.c_str()) == Codec::TypeNone && !Archive::isCrateArchive(benchInput.c_str()))
+        ERR("the file passed to the 'bench-compress' command isn't a crate: " << benchInput)
+    }
+    for (auto &codec : benchCodecs) {
+      Codec::Type type;
+      if (!Codec::typeFromName(codec, type))
+        ERR("unknown compression method '" << codec << "', expected xz, zstd or none")
+    }
+    for (auto level : benchLevels) {
+      bool valid = false;
+      for (auto type : {Codec::TypeXz, Codec::TypeZstd})
+        valid = valid || Codec::isValidLevel(type, level);
+      if (!valid)
+        ERR("compression level " << level << " isn't valid for any compression method")
+    }
+    break;
   default:
     err("no command was given");
   }
@@ -135,7 +341,7 @@ Args parseArguments(int argc, char** argv, unsigned &processed) {
       args.createSpec = argv[1];
       processed = 2;
       return args;
-    } else if (Util::Fs::hasExtension(argv[1], ".crate") && Util::Fs::isXzArchive(argv[1])) {
+    } else if (Util::Fs::hasExtension(argv[1], ".crate") && (Codec::sniffFile(argv[1]) != Codec::TypeNone || Archive::isCrateArchive(argv[1]))) {
       args.cmd = CmdRun;
       args.runCrateFile = argv[1];
       processed = 2;
@@ -196,6 +402,30 @@ Args parseArguments(int argc, char** argv, unsigned &processed) {
           case 'o':
             args.createOutput = getArgParam(++a, argc, argv);
             break;
+          case 'c':
+            args.createCompression = getArgParam(++a, argc, argv);
+            break;
+          case 'l':
+            args.createCompressionLevel = getArgLevel(++a, argc, argv);
+            break;
+          case 'b':
+            args.createBlockSize = getArgSize(++a, argc, argv);
+            break;
+          case 't':
+            args.createThin = true;
+            break;
+          case 'a':
+            args.createAdditive = true;
+            break;
+          case 'T':
+            args.createAccessTrace = getArgParam(++a, argc, argv);
+            break;
+          case 'n':
+            args.createNoCache = true;
+            break;
+          case 'L':
+            args.createLinkCache = true;
+            break;
           default:
             err("unsupported short option '%s'", argv[a]);
           }
@@ -209,6 +439,30 @@ Args parseArguments(int argc, char** argv, unsigned &processed) {
           } else if (strEq(argLong, "output")) {
             args.createOutput = getArgParam(++a, argc, argv);
             break;
+          } else if (strEq(argLong, "compression")) {
+            args.createCompression = getArgParam(++a, argc, argv);
+            break;
+          } else if (strEq(argLong, "level")) {
+            args.createCompressionLevel = getArgLevel(++a, argc, argv);
+            break;
+          } else if (strEq(argLong, "block-size")) {
+            args.createBlockSize = getArgSize(++a, argc, argv);
+            break;
+          } else if (strEq(argLong, "thin")) {
+            args.createThin = true;
+            break;
+          } else if (strEq(argLong, "additive")) {
+            args.createAdditive = true;
+            break;
+          } else if (strEq(argLong, "access-trace")) {
+            args.createAccessTrace = getArgParam(++a, argc, argv);
+            break;
+          } else if (strEq(argLong, "no-cache")) {
+            args.createNoCache = true;
+            break;
+          } else if (strEq(argLong, "link-cache")) {
+            args.createLinkCache = true;
+            break;
           } else {
             err("unsupported long option '%s'", argv[a]);
           }
@@ -228,6 +482,12 @@ Args parseArguments(int argc, char** argv, unsigned &processed) {
           case 'f':
             args.runCrateFile = getArgParam(++a, argc, argv);
             break;
+          case 'x':
+            args.runExtractInProcess = true;
+            break;
+          case 'C':
+            args.runCache = true;
+            break;
           default:
             err("unsupported short option '%s'", argv[a]);
           }
@@ -237,9 +497,161 @@ Args parseArguments(int argc, char** argv, unsigned &processed) {
             exit(0);
           } else if (strEq(argLong, "file")) {
             args.runCrateFile = getArgParam(++a, argc, argv);
+          } else if (strEq(argLong, "extract-in-process")) {
+            args.runExtractInProcess = true;
+          } else if (strEq(argLong, "cache")) {
+            args.runCache = true;
+          } else {
+            err("unsupported long option '%s'", argv[a]);
+          }
+        } else {
+          err("unknown argument '%s'", argv[a]);
+        }
+        break;
+      case CmdCat:
+        if (auto argShort = isShort(argv[a])) {
+          switch (argShort) {
+          case 'h':
+            usageCat();
+            exit(0);
+          default:
+            err("unsupported short option '%s'", argv[a]);
+          }
+        } else if (auto argLong = isLong(argv[a])) {
+          if (strEq(argLong, "help")) {
+            usageCat();
+            exit(0);
+          } else {
+            err("unsupported long option '%s'", argv[a]);
+          }
+        } else if (args.catCrateFile.empty()) {
+          args.catCrateFile = argv[a];
+        } else if (args.catFilePath.empty()) {
+          args.catFilePath = argv[a];
+        } else {
+          err("unknown argument '%s'", argv[a]);
+        }
+        break;
+      case CmdStore:
+        if (auto argShort = isShort(argv[a])) {
+          switch (argShort) {
+          case 'h':
+            usageStore();
+            exit(0);
+          default:
+            err("unsupported short option '%s'", argv[a]);
+          }
+        } else if (auto argLong = isLong(argv[a])) {
+          if (strEq(argLong, "help")) {
+            usageStore();
+            exit(0);
+          } else {
+            err("unsupported long option '%s'", argv[a]);
+          }
+        } else if (args.storeSubcommand.empty()) {
+          args.storeSubcommand = argv[a];
+        } else if (args.storeCrateFile.empty()) {
+          args.storeCrateFile = argv[a];
+        } else {
+          err("unknown argument '%s'", argv[a]);
+        }
+        break;
+      case CmdDelta:
+        if (auto argShort = isShort(argv[a])) {
+          switch (argShort) {
+          case 'h':
+            usageDelta();
+            exit(0);
+          case 'o':
+            args.deltaOutput = getArgParam(++a, argc, argv);
+            break;
+          default:
+            err("unsupported short option '%s'", argv[a]);
+          }
+        } else if (auto argLong = isLong(argv[a])) {
+          if (strEq(argLong, "help")) {
+            usageDelta();
+            exit(0);
+          } else if (strEq(argLong, "output")) {
+            args.deltaOutput = getArgParam(++a, argc, argv);
+          } else {
+            err("unsupported long option '%s'", argv[a]);
+          }
+        } else if (args.deltaOldCrateFile.empty()) {
+          args.deltaOldCrateFile = argv[a];
+        } else if (args.deltaNewCrateFile.empty()) {
+          args.deltaNewCrateFile = argv[a];
+        } else {
+          err("unknown argument '%s'", argv[a]);
+        }
+        break;
+      case CmdPatch:
+        if (auto argShort = isShort(argv[a])) {
+          switch (argShort) {
+          case 'h':
+            usagePatch();
+            exit(0);
+          case 'o':
+            args.patchOutput = getArgParam(++a, argc, argv);
+            break;
+          default:
+            err("unsupported short option '%s'", argv[a]);
+          }
+        } else if (auto argLong = isLong(argv[a])) {
+          if (strEq(argLong, "help")) {
+            usagePatch();
+            exit(0);
+          } else if (strEq(argLong, "output")) {
+            args.patchOutput = getArgParam(++a, argc, argv);
+          } else {
+            err("unsupported long option '%s'", argv[a]);
+          }
+        } else if (args.patchOldCrateFile.empty()) {
+          args.patchOldCrateFile = argv[a];
+        } else if (args.patchDeltaFile.empty()) {
+          args.patchDeltaFile = argv[a];
+        } else {
+          err("unknown argument '%s'", argv[a]);
+        }
+        break;
+      case CmdBenchCompress:
+        if (auto argShort = isShort(argv[a])) {
+          switch (argShort) {
+          case 'h':
+            usageBenchCompress();
+            exit(0);
+          case 'c':
+            args.benchCodecs = getArgList(++a, argc, argv, parseString);
+            break;
+          case 'l':
+            args.benchLevels = getArgList(++a, argc, argv, parseLevel);
+            break;
+          case 'b':
+            args.benchBlockSizes = getArgList(++a, argc, argv, parseSize);
+            break;
+          case 'j':
+            args.benchThreads = getArgList(++a, argc, argv, parseNumThreads);
+            break;
+          default:
+            err("unsupported short option '%s'", argv[a]);
+          }
+        } else if (auto argLong = isLong(argv[a])) {
+          if (strEq(argLong, "help")) {
+            usageBenchCompress();
+            exit(0);
+          } else if (strEq(argLong, "compression")) {
+            args.benchCodecs = getArgList(++a, argc, argv, parseString);
+          } else if (strEq(argLong, "level")) {
+            args.benchLevels = getArgList(++a, argc, argv, parseLevel);
+          } else if (strEq(argLong, "block-size")) {
+            args.benchBlockSizes = getArgList(++a, argc, argv, parseSize);
+          } else if (strEq(argLong, "threads")) {
+            args.benchThreads = getArgList(++a, argc, argv, parseNumThreads);
           } else {
             err("unsupported long option '%s'", argv[a]);
           }
+        } else if (args.benchInput.empty()) {
+          args.benchInput = argv[a];
         } else {
           err("unknown argument '%s'", argv[a]);
         }
@@ -3,12 +3,13 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
-enum Command {CmdNone, CmdCreate, CmdRun};
+enum Command {CmdNone, CmdCreate, CmdRun, CmdCat, CmdStore, CmdDelta, CmdPatch, CmdBenchCompress};
 
 class Args {
 public:
-  Args() : logProgress (false) { }
+  Args() : cmd(CmdNone), logProgress(false), createCompression("xz"), createCompressionLevel(-1), createThin(false), createBlockSize(0), createAdditive(false), createNoCache(false), createLinkCache(false), runExtractInProcess(false), runCache(false) { }
 
   Command cmd;
 
@@ -18,9 +19,44 @@ public:
   // create parameters
   std::string createSpec;
   std::string createOutput;
+  std::string createCompression;      // xz, zstd or none
+  int         createCompressionLevel; // -1 for the default level of the codec
+  bool        createThin;             // content-defined blocks that are shared with other crates through the chunk store
+  unsigned    createBlockSize;        // uncompressed size of independently compressed blocks (average size when thin), 0 for the default
+  bool        createAdditive;         // link the kept files into a fresh tree instead of removing the rest from the jail
+  bool        createNoCache;          // always install the packages, don't use or update the cached tree with them installed
+  bool        createLinkCache;        // hardlink the files of the cached trees outside of the writable paths even when scripts run in the jail
+  std::string createAccessTrace;      // paths that the crate's programs access, they replace the guessed keep lists
 
   // run parameters
   std::string runCrateFile;
+  bool runExtractInProcess; // extract with the built-in parallel extractor instead of the xz|tar pipeline
+  bool runCache;            // clone the tree of the crate from the extraction cache: files outside of the writable paths are hardlinked
+
+  // cat parameters
+  std::string catCrateFile;
+  std::string catFilePath;
+
+  // store parameters
+  std::string storeSubcommand;        // stats, import or remove
+  std::string storeCrateFile;
+
+  // delta parameters
+  std::string deltaOldCrateFile;
+  std::string deltaNewCrateFile;
+  std::string deltaOutput;
+
+  // patch parameters
+  std::string patchOldCrateFile;
+  std::string patchDeltaFile;
+  std::string patchOutput;
+
+  // bench-compress parameters
+  std::string              benchInput;      // crate file or jail directory
+  std::vector<std::string> benchCodecs;     // empty for xz and zstd
+  std::vector<int>         benchLevels;     // empty for a spread of levels of every codec
+  std::vector<unsigned>    benchBlockSizes; // empty for 256K, 1M and 8M
+  std::vector<unsigned>    benchThreads;    // empty for 1 and hw.ncpu
 
   void validate();
 };
@@ -0,0 +1,298 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "args.h"
+#include "archive.h"
+#include "pack.h"
+#include "codec.h"
+#include "threads.h"
+#include "util.h"
+#include "err.h"
+#include "commands.h"
+
+#include <rang.hpp>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <sstream>
+
+#define ERR(msg...) ERR2("benchmarking compression", msg)
+
+#define LOG(msg...) \
+  { \
+    if (args.logProgress) \
+      std::cerr << rang::fg::gray << Util::tmSecMs() << ": " << msg << rang::style::reset << std::endl; \
+  }
+
+//
+// helpers
+//
+
+// The tar stream is kept in a file, and every combination is compressed in a forked process, and then decompressed
+// in another one, so that the peak RSS of each side is measured alone, without what the parent process holds.
+
+class Measured { // what a measuring process sends back, it crosses the pipe as is
+public:
+  uint64_t compressedSize;
+  double   seconds;
+  long     maxRssKb;
+};
+
+class Result {
+public:
+  uint64_t compressedSize;
+  double   compressSeconds;
+  long     compressMaxRssKb;
+  double   decompressSeconds;
+  long     decompressMaxRssKb;
+};
+
+static long maxRssKb() { // of this process alone
+  struct rusage ru;
+  if (::getrusage(RUSAGE_SELF, &ru) == -1)
+    ERR("getrusage failed: " << strerror(errno))
+  return ru.ru_maxrss;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point tmStart) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+}
+
+static void writeAll(int fd, const uint8_t *data, size_t size, const std::string &file) {
+  while (size > 0) {
+    auto res = ::write(fd, data, size);
+    if (res == -1)
+      ERR("failed to write the file '" << file << "': " << strerror(errno))
+    data += res;
+    size -= res;
+  }
+}
+
+static void writeFile(const std::string &file, const std::string &data) { // replaces the file
+  int fd = ::open(file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd == -1)
+    ERR("failed to create the file '" << file << "': " << strerror(errno))
+  RunAtEnd closeFd([fd]() {
+    (void)::close(fd);
+  });
+  writeAll(fd, (const uint8_t*)data.data(), data.size(), file);
+}
+
+static Measured inChild(const std::function<Measured()> &fn) { // runs fn in a forked process, returns its result
+  int fds[2];
+  if (::pipe(fds) == -1)
+    ERR("failed to create a pipe: " << strerror(errno))
+  auto pid = ::fork();
+  if (pid == -1)
+    ERR("failed to fork: " << strerror(errno))
+  if (pid == 0) {
+    (void)::close(fds[0]);
+    try {
+      auto res = fn();
+      _exit(::write(fds[1], &res, sizeof(res)) == sizeof(res) ? 0 : 1);
+    } catch (const std::exception &e) {
+      std::cerr << rang::fg::red << e.what() << rang::style::reset << std::endl;
+    }
+    _exit(1);
+  }
+
+  (void)::close(fds[1]);
+  Measured res;
+  auto got = ::read(fds[0], &res, sizeof(res));
+  (void)::close(fds[0]);
+  int status;
+  if (::waitpid(pid, &status, 0) == -1)
+    ERR("failed to wait for the measuring process: " << strerror(errno))
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || got != sizeof(res))
+    ERR("the measuring process has failed")
+  return res;
+}
+
+static uint64_t writeInput(const std::string &input, const std::string &file) { // the tar stream of a crate of either format, or of a directory
+  int fd = ::open(file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd == -1)
+    ERR("failed to create the file '" << file << "': " << strerror(errno))
+  RunAtEnd closeFd([fd]() {
+    (void)::close(fd);
+  });
+  uint64_t size = 0;
+  auto write = [fd,&file,&size](const uint8_t *data, size_t sz) {
+    writeAll(fd, data, sz, file);
+    size += sz;
+  };
+  if (Util::Fs::dirExists(input))
+    (void)Pack::directory(input, true/*withManifest*/, write);
+  else if (Archive::isCrateArchive(input.c_str()))
+    Archive::Reader(input).readAll(write);
+  else
+    Codec::decompressFile(input, write);
+  return size;
+}
+
+static Result measure(const std::string &dir, Codec::Type codec, int level, unsigned blockSize, unsigned numThreads) {
+  auto streamFile = STR(dir << "/stream.tar");
+  auto blocksFile = STR(dir << "/blocks");
+  auto sizesFile = STR(dir << "/sizes");
+
+  // compress blocks independently, as Archive::Writer does
+  auto compressed = inChild([&]() {
+    MappedFile in(streamFile);
+    unsigned numBlocks = (in.size + blockSize - 1)/blockSize;
+    std::vector<std::vector<uint8_t>> blocks(numBlocks);
+    auto tmStart = std::chrono::steady_clock::now();
+    ThreadPool pool(numThreads);
+    for (unsigned b = 0; b < numBlocks; b++)
+      pool.add([&,b]() {
+        Codec::compressBuffer(codec, level, in.data + (size_t)b*blockSize, std::min((size_t)blockSize, in.size - (size_t)b*blockSize), blocks[b]);
+      });
+    pool.wait();
+    Measured res = {0, secondsSince(tmStart), maxRssKb()};
+
+    // the decompressing process reads them from files
+    int fd = ::open(blocksFile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd == -1)
+      ERR("failed to create the file '" << blocksFile << "': " << strerror(errno))
+    RunAtEnd closeFd([fd]() {
+      (void)::close(fd);
+    });
+    std::ostringstream sizes;
+    for (unsigned b = 0; b < numBlocks; b++) {
+      writeAll(fd, blocks[b].data(), blocks[b].size(), blocksFile);
+      sizes << blocks[b].size() << " " << std::min((size_t)blockSize, in.size - (size_t)b*blockSize) << std::endl;
+      res.compressedSize += blocks[b].size();
+    }
+    writeFile(sizesFile, sizes.str());
+    return res;
+  });
+
+  // decompress them in parallel, as Archive::Reader::readAll does, and then once more to verify the output
+  auto decompressed = inChild([&]() {
+    MappedFile blocks(blocksFile);
+    std::vector<uint64_t> offsets = {0}, uncompressedSizes;
+    int fd = ::open(sizesFile.c_str(), O_RDONLY);
+    if (fd == -1)
+      ERR("failed to open the file '" << sizesFile << "': " << strerror(errno))
+    RunAtEnd closeFd([fd]() {
+      (void)::close(fd);
+    });
+    for (auto &line : Util::Fs::readFileLines(fd)) {
+      unsigned long long size, uncompressedSize;
+      if (::sscanf(line.c_str(), "%llu %llu", &size, &uncompressedSize) != 2)
+        ERR("the file '" << sizesFile << "' is corrupt")
+      offsets.push_back(offsets.back() + size);
+      uncompressedSizes.push_back(uncompressedSize);
+    }
+    auto decompress = [&](const std::function<void(unsigned b, const std::vector<uint8_t> &out)> &fnBlock) {
+      ThreadPool pool(numThreads);
+      for (unsigned b = 0; b + 1 < offsets.size(); b++)
+        pool.add([&,b]() {
+          std::vector<uint8_t> out;
+          Codec::decompressBuffer(codec, blocks.data + offsets[b], offsets[b + 1] - offsets[b], uncompressedSizes[b], out);
+          fnBlock(b, out);
+        });
+      pool.wait();
+    };
+    auto tmStart = std::chrono::steady_clock::now();
+    decompress([](unsigned, const std::vector<uint8_t>&) { });
+    Measured res = {compressed.compressedSize, secondsSince(tmStart), maxRssKb()};
+    MappedFile in(streamFile);
+    decompress([&in,blockSize](unsigned b, const std::vector<uint8_t> &out) {
+      if (out.size() != std::min((size_t)blockSize, in.size - (size_t)b*blockSize) || ::memcmp(out.data(), in.data + (size_t)b*blockSize, out.size()) != 0)
+        ERR("block #" << b << " has been decompressed into different data")
+    });
+    return res;
+  });
+
+  return Result{compressed.compressedSize, compressed.seconds, compressed.maxRssKb, decompressed.seconds, decompressed.maxRssKb};
+}
+
+static std::vector<int> levelsToTry(const Args &args, Codec::Type codec) {
+  if (args.benchLevels.empty())
+    switch (codec) {
+    case Codec::TypeNone: return {Codec::LevelDefault};
+    case Codec::TypeXz:   return {0, 3, 6, 9};
+    case Codec::TypeZstd: return {1, 3, 9, 19};
+    }
+  std::vector<int> levels;
+  for (auto level : args.benchLevels)
+    if (Codec::isValidLevel(codec, level)) // levels of other codecs are skipped
+      levels.push_back(level);
+  return levels;
+}
+
+//
+// interface
+//
+
+bool benchCompress(const Args &args) {
+  LOG("'bench-compress' command is invoked")
+
+  // runs as the user, so the stream is kept in the user's temporary directory
+  auto *tmpDir = ::getenv("TMPDIR");
+  auto dir = STR((tmpDir != nullptr && *tmpDir != 0 ? tmpDir : "/tmp") << "/crate-bench-compress.XXXXXX");
+  if (::mkdtemp(&dir[0]) == nullptr)
+    ERR("failed to create a temporary directory '" << dir << "': " << strerror(errno))
+  RunAtEnd removeDir([&dir]() {
+    Util::Fs::rmdirHier(dir);
+  });
+  auto streamSize = writeInput(args.benchInput, STR(dir << "/stream.tar"));
+  LOG("the tar stream of " << args.benchInput << " is " << streamSize << " bytes")
+  if (streamSize == 0)
+    ERR("the tar stream of '" << args.benchInput << "' is empty")
+
+  auto codecs = !args.benchCodecs.empty() ? args.benchCodecs : std::vector<std::string>{"xz", "zstd"};
+  auto blockSizes = !args.benchBlockSizes.empty() ? args.benchBlockSizes : std::vector<unsigned>{0x40000, 0x100000, 0x800000};
+  auto threads = args.benchThreads;
+  if (threads.empty()) {
+    threads.push_back(1);
+    if (Util::getSysctlInt("hw.ncpu") > 1)
+      threads.push_back(Util::getSysctlInt("hw.ncpu"));
+  }
+
+  std::cout << "tar stream: " << std::fixed << std::setprecision(1) << streamSize/1e6 << " MB, the compression RSS includes it" << std::endl;
+  std::cout << std::left
+            << std::setw(6) << "codec" << std::setw(7) << "level" << std::setw(8) << "block" << std::setw(9) << "threads"
+            << std::setw(12) << "size, MB" << std::setw(8) << "ratio"
+            << std::setw(13) << "compress, s" << std::setw(15) << "decompress, s" << std::setw(15) << "decomp, MB/s"
+            << std::setw(14) << "RSS comp, MB" << "RSS decomp, MB" << std::endl;
+  for (auto &codecName : codecs) {
+    Codec::Type codec;
+    (void)Codec::typeFromName(codecName, codec); // validated by Args::validate()
+    for (auto level : levelsToTry(args, codec))
+      for (auto blockSize : blockSizes)
+        for (auto numThreads : threads) {
+          LOG("measuring " << codecName << " level " << level << ", " << blockSize << " byte blocks, " << numThreads << " thread(s)")
+          auto res = measure(dir, codec, level, blockSize, numThreads);
+          std::cout << std::left << std::fixed
+                    << std::setw(6) << codecName
+                    << std::setw(7) << (level == Codec::LevelDefault ? std::string("-") : std::to_string(level))
+                    << std::setw(8) << (blockSize % 0x100000 == 0 ? STR(blockSize/0x100000 << "M") : STR(blockSize/0x400 << "K"))
+                    << std::setw(9) << numThreads
+                    << std::setprecision(1) << std::setw(12) << res.compressedSize/1e6
+                    << std::setprecision(3) << std::setw(8) << (double)streamSize/res.compressedSize
+                    << std::setw(13) << res.compressSeconds
+                    << std::setw(15) << res.decompressSeconds
+                    << std::setprecision(1) << std::setw(15) << streamSize/1e6/std::max(res.decompressSeconds, 1e-6)
+                    << std::setw(14) << res.compressMaxRssKb/1024.
+                    << res.decompressMaxRssKb/1024. << std::endl;
+        }
+  }
+
+  LOG("'bench-compress' command has succeeded")
+  return true;
+}
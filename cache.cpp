@@ -0,0 +1,649 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "cache.h"
+#include "extract.h"
+#include "archive.h"
+#include "tar.h"
+#include "threads.h"
+#include "locs.h"
+#include "misc.h"
+#include "download.h"
+#include "codec.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+#define ERR(msg...) ERR2("extraction cache", msg)
+
+static const unsigned packagesKeyBasePrefix = 16;       // the package trees of a base begin with the prefix of its key
+static const time_t packagesExpirySeconds = 30*24*3600; // package trees that haven't been cloned for this long are removed
+
+namespace Cache {
+
+const std::vector<std::string> allWritable = {"/"};
+
+//
+// helpers
+//
+
+class TreeCloner {
+  class Dir {
+  public:
+    std::string path;
+    struct stat sb;
+  };
+
+  int                                        srcTop;
+  int                                        dstTop;
+  std::vector<std::string>                   writable;       // relative paths
+  bool                                       copyAll;        // hardlinks can't cross filesystems
+  ThreadPool                                 pool;
+  std::mutex                                 mutex;
+  std::vector<Dir>                           dirs;           // attributes are applied at the end, after their content is written
+  std::map<std::pair<dev_t, ino_t>, std::string> copiedInodes; // hardlinks between copied files are preserved
+
+public:
+  Extract::Stats stats;
+
+  TreeCloner(const std::string &srcDir, const std::string &dstDir, const std::vector<std::string> &newWritable) {
+    srcTop = ::open(srcDir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (srcTop == -1)
+      ERR("failed to open the directory '" << srcDir << "': " << strerror(errno))
+    dstTop = ::open(dstDir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (dstTop == -1) {
+      (void)::close(srcTop);
+      ERR("failed to open the directory '" << dstDir << "': " << strerror(errno))
+    }
+    for (auto &w : newWritable)
+      writable.push_back(Tar::normalizePath(w));
+    struct stat sbSrc, sbDst;
+    (void)::fstat(srcTop, &sbSrc);
+    (void)::fstat(dstTop, &sbDst);
+    copyAll = sbSrc.st_dev != sbDst.st_dev;
+  }
+  ~TreeCloner() {
+    try {
+      pool.wait(); // tasks reference the top directory fds
+    } catch (...) {
+      // the error is already being reported
+    }
+    (void)::close(srcTop);
+    (void)::close(dstTop);
+  }
+
+  void run() {
+    struct stat sb;
+    if (::fstat(srcTop, &sb) == -1)
+      ERR("failed to stat the top directory: " << strerror(errno))
+    dirs.push_back({"", sb});
+    cloneDir("", isWritable(""));
+    pool.wait();
+    applyDirAttributes();
+  }
+
+private:
+  bool isWritable(const std::string &path) const {
+    for (auto &w : writable)
+      if (w.empty() || path == w || (path.size() > w.size() && path.compare(0, w.size(), w) == 0 && path[w.size()] == '/'))
+        return true;
+    return false;
+  }
+  static std::string join(const std::string &dir, const char *name) {
+    return dir.empty() ? std::string(name) : STR(dir << "/" << name);
+  }
+  int openDir(int top, const std::string &path) {
+    int fd = ::openat(top, path.empty() ? "." : path.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    if (fd == -1)
+      ERR("failed to open the directory '" << path << "': " << strerror(errno))
+    return fd;
+  }
+  void cloneDir(const std::string &path, bool inWritable) {
+    int srcFd = openDir(srcTop, path);
+    DIR *d = ::fdopendir(srcFd);
+    if (d == nullptr) {
+      (void)::close(srcFd);
+      ERR("failed to read the directory '" << path << "': " << strerror(errno))
+    }
+    RunAtEnd closeSrc([d]() {
+      (void)::closedir(d);
+    });
+    int dstFd = openDir(dstTop, path);
+    RunAtEnd closeDst([dstFd]() {
+      (void)::close(dstFd);
+    });
+
+    unsigned numFiles = 0;
+    uint64_t numBytes = 0;
+    while (auto *de = ::readdir(d)) {
+      if (::strcmp(de->d_name, ".") == 0 || ::strcmp(de->d_name, "..") == 0)
+        continue;
+      auto subPath = join(path, de->d_name);
+      struct stat sb;
+      if (::fstatat(srcFd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+        ERR("failed to stat '" << subPath << "': " << strerror(errno))
+      bool subWritable = inWritable || isWritable(subPath);
+      switch (sb.st_mode & S_IFMT) {
+      case S_IFDIR:
+        if (::mkdirat(dstFd, de->d_name, 0700) == -1)
+          ERR("failed to create the directory '" << subPath << "': " << strerror(errno))
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          dirs.push_back({subPath, sb});
+        }
+        pool.add([this,subPath,subWritable]() {
+          cloneDir(subPath, subWritable);
+        });
+        break;
+      case S_IFREG:
+        if (subWritable || copyAll)
+          numBytes += copyFile(srcFd, dstFd, de->d_name, subPath, sb);
+        else if (::linkat(srcFd, de->d_name, dstFd, de->d_name, 0) == -1)
+          ERR("failed to link '" << subPath << "': " << strerror(errno))
+        break;
+      case S_IFLNK: {
+        char target[PATH_MAX+1];
+        auto len = ::readlinkat(srcFd, de->d_name, target, sizeof(target) - 1);
+        if (len == -1)
+          ERR("failed to read the symbolic link '" << subPath << "': " << strerror(errno))
+        target[len] = 0;
+        if (::symlinkat(target, dstFd, de->d_name) == -1)
+          ERR("failed to create the symbolic link '" << subPath << "': " << strerror(errno))
+        setAttributes(dstFd, de->d_name, sb, AT_SYMLINK_NOFOLLOW);
+        break;
+      } default: // fifos and devices
+        if (::mknodat(dstFd, de->d_name, sb.st_mode, sb.st_rdev) == -1)
+          ERR("failed to create the special file '" << subPath << "': " << strerror(errno))
+        setAttributes(dstFd, de->d_name, sb, AT_SYMLINK_NOFOLLOW);
+      }
+      numFiles++;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    stats.numFiles += numFiles;
+    stats.numBytes += numBytes;
+  }
+  uint64_t copyFile(int srcDirFd, int dstDirFd, const char *name, const std::string &path, const struct stat &sb) {
+    // the first copy of a hardlinked inode is created under the lock, so that its other names can be linked to it right away
+    int fdOut;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (sb.st_nlink > 1) {
+        auto it = copiedInodes.find({sb.st_dev, sb.st_ino});
+        if (it != copiedInodes.end()) {
+          if (::linkat(dstTop, it->second.c_str(), dstDirFd, name, 0) == -1)
+            ERR("failed to link '" << path << "' to '" << it->second << "': " << strerror(errno))
+          return 0;
+        }
+        copiedInodes[{sb.st_dev, sb.st_ino}] = path;
+      }
+      fdOut = ::openat(dstDirFd, name, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+      if (fdOut == -1)
+        ERR("failed to create the file '" << path << "': " << strerror(errno))
+    }
+    RunAtEnd closeOut([fdOut]() {
+      (void)::close(fdOut);
+    });
+    int fdIn = ::openat(srcDirFd, name, O_RDONLY|O_NOFOLLOW);
+    if (fdIn == -1)
+      ERR("failed to open the file '" << path << "': " << strerror(errno))
+    RunAtEnd closeIn([fdIn]() {
+      (void)::close(fdIn);
+    });
+
+    // only data segments are copied, so that holes of sparse files stay holes
+    uint8_t buf[0x10000];
+    uint64_t total = 0;
+    for (auto &seg : Util::Fs::getDataSegments(fdIn, sb))
+      for (uint64_t pos = seg.first, end = seg.first + seg.second; pos < end;) {
+        auto res = ::pread(fdIn, buf, std::min((uint64_t)sizeof(buf), end - pos), pos);
+        if (res == -1)
+          ERR("failed to read the file '" << path << "': " << strerror(errno))
+        if (res == 0)
+          ERR("the file '" << path << "' has shrunk while being copied")
+        for (ssize_t off = 0; off < res;) {
+          auto resw = ::pwrite(fdOut, buf + off, res - off, pos + off);
+          if (resw == -1)
+            ERR("failed to write the file '" << path << "': " << strerror(errno))
+          off += resw;
+        }
+        pos += res;
+        total += res;
+      }
+    if (::ftruncate(fdOut, sb.st_size) == -1)
+      ERR("failed to write the file '" << path << "': " << strerror(errno))
+    if (::fchown(fdOut, sb.st_uid, sb.st_gid) == -1 || ::fchmod(fdOut, sb.st_mode & 07777) == -1)
+      ERR("failed to set attributes of '" << path << "': " << strerror(errno))
+    struct timespec times[2] = {sb.st_atim, sb.st_mtim};
+    if (::futimens(fdOut, times) == -1)
+      ERR("failed to set times of '" << path << "': " << strerror(errno))
+    return total;
+  }
+  static void setAttributes(int dirFd, const char *name, const struct stat &sb, int flags) {
+    if (::fchownat(dirFd, name, sb.st_uid, sb.st_gid, flags) == -1)
+      ERR("failed to change the owner of '" << name << "': " << strerror(errno))
+    if ((sb.st_mode & S_IFMT) != S_IFLNK && ::fchmodat(dirFd, name, sb.st_mode & 07777, flags) == -1)
+      ERR("failed to change the mode of '" << name << "': " << strerror(errno))
+    struct timespec times[2] = {sb.st_atim, sb.st_mtim};
+    if (::utimensat(dirFd, name, times, flags) == -1)
+      ERR("failed to set times of '" << name << "': " << strerror(errno))
+  }
+  void applyDirAttributes() {
+    std::sort(dirs.begin(), dirs.end(), [](const Dir &d1, const Dir &d2) {return d1.path > d2.path;}); // children first
+    for (auto &dir : dirs)
+      setAttributes(dstTop, dir.path.empty() ? "." : dir.path.c_str(), dir.sb, 0);
+  }
+};
+
+static bool publish(const std::string &path, const std::function<bool()> &fnExists, const std::function<void(const std::string &tmpPath)> &fnFill) {
+  // only one process fills the entry, others wait for it on the lock
+  int fdLock = ::open(CSTR(path << ".lock"), O_RDWR|O_CREAT|O_EXLOCK, 0600);
+  if (fdLock == -1)
+    ERR("failed to lock the cache entry '" << path << "': " << strerror(errno))
+  RunAtEnd unlock([fdLock]() {
+    (void)::close(fdLock);
+  });
+  if (fnExists())
+    return false; // another process has filled it while we were waiting
+
+  // fill a temporary directory, and publish it by renaming
+  auto tmpPath = STR(path << ".tmp");
+  if (Util::Fs::dirExists(tmpPath))
+    Util::Fs::rmdirHier(tmpPath); // left behind by a failed extraction
+  Util::Fs::mkdir(tmpPath, 0700);
+  bool published = false;
+  RunAtEnd removeTmp([&tmpPath,&published]() {
+    if (!published)
+      Util::Fs::rmdirHier(tmpPath);
+  });
+  fnFill(tmpPath);
+  if (::rename(tmpPath.c_str(), path.c_str()) == -1)
+    ERR("failed to publish the cache entry '" << path << "': " << strerror(errno))
+  published = true;
+
+  return true;
+}
+
+static void removeUnlessLocked(const std::string &path) {
+  // trees that are being cloned are locked, they are removed next time
+  int fdLock = ::open(CSTR(path << ".lock"), O_RDWR|O_CREAT|O_EXLOCK|O_NONBLOCK, 0600);
+  if (fdLock == -1)
+    return;
+  RunAtEnd unlock([fdLock]() {
+    (void)::close(fdLock);
+  });
+  Util::Fs::rmdirHier(path);
+  (void)::unlink(CSTR(path << ".lock"));
+}
+
+static void removeStaleBases(const std::string &key) {
+  auto dir = STR(Locations::cacheDirectoryPath << "/base");
+  DIR *d = ::opendir(dir.c_str());
+  if (d == nullptr)
+    ERR("failed to read the directory '" << dir << "': " << strerror(errno))
+  RunAtEnd closeDir([d]() {
+    (void)::closedir(d);
+  });
+  while (auto *de = ::readdir(d)) {
+    std::string name = de->d_name;
+    if (name == "." || name == ".." || name == key || name.find('.') != std::string::npos)
+      continue; // only published trees, the lock files and temporary directories belong to them
+    removeUnlessLocked(STR(dir << "/" << name));
+  }
+}
+
+static void removeStalePackages(const std::string &key) {
+  auto dir = STR(Locations::cacheDirectoryPath << "/packages");
+  DIR *d = ::opendir(dir.c_str());
+  if (d == nullptr)
+    ERR("failed to read the directory '" << dir << "': " << strerror(errno))
+  RunAtEnd closeDir([d]() {
+    (void)::closedir(d);
+  });
+  auto now = ::time(nullptr);
+  while (auto *de = ::readdir(d)) {
+    std::string name = de->d_name;
+    if (name == "." || name == ".." || name == key || name.find('.') != std::string::npos)
+      continue; // only published trees, the lock files and temporary directories belong to them
+    auto path = STR(dir << "/" << name);
+    // the lock file is touched by every clone
+    struct stat sb;
+    bool sameBase = name.compare(0, packagesKeyBasePrefix, key, 0, packagesKeyBasePrefix) == 0;
+    if (sameBase && ::stat(CSTR(path << ".lock"), &sb) == 0 && now - sb.st_mtime < packagesExpirySeconds)
+      continue;
+    removeUnlessLocked(path);
+  }
+}
+
+static std::string packagesPath(const std::string &key) {
+  return STR(Locations::cacheDirectoryPath << "/packages/" << key);
+}
+
+//
+// crate records: the crate file that was last run from a path, by its identity, and its key
+//
+
+class CrateRecord {
+public:
+  std::string identity; // changes whenever the file is replaced or written to
+  std::string key;
+  std::string path;     // the real path of the crate file
+
+  static std::string identityOf(const struct stat &sb) {
+    return STR(sb.st_dev << ":" << sb.st_ino << ":" << sb.st_size << ":" << sb.st_mtim.tv_sec << "." << sb.st_mtim.tv_nsec
+               << ":" << sb.st_ctim.tv_sec << "." << sb.st_ctim.tv_nsec); // ctime can't be set back like mtime
+  }
+  static std::string fileFor(const std::string &path) {
+    uint8_t hash[32];
+    Util::sha256((const uint8_t*)path.data(), path.size(), hash);
+    return STR(Locations::cacheDirectoryPath << "/crates/" << Util::toHex(hash, 16));
+  }
+  bool read(const std::string &file) {
+    std::ifstream is(file);
+    return std::getline(is, identity) && std::getline(is, key) && std::getline(is, path);
+  }
+  void write(const std::string &file) const { // atomically, simultaneous runs can write the same record
+    auto tmpFile = STR(file << ".pid" << ::getpid() << ".tmp");
+    Util::Fs::writeFile(STR(identity << "\n" << key << "\n" << path << "\n"), tmpFile);
+    if (::rename(tmpFile.c_str(), file.c_str()) == -1) {
+      (void)::unlink(tmpFile.c_str());
+      ERR("failed to rename '" << tmpFile << "' to '" << file << "': " << strerror(errno))
+    }
+  }
+  bool isCurrent() const { // the crate file is still there unchanged
+    struct stat sb;
+    return ::stat(path.c_str(), &sb) == 0 && identityOf(sb) == identity;
+  }
+};
+
+static std::string legacyCrateKey(const MappedFile &mf) {
+  uint8_t hash[32];
+  Util::sha256(mf.data, mf.size, hash);
+  return Util::toHex(hash, sizeof(hash));
+}
+
+static std::string computeCrateKey(const std::string &crateFile) {
+  if (Archive::isCrateArchive(crateFile.c_str())) {
+    // the hashes of the blocks in the index, no decompression needed: extraction verifies every block against them,
+    // unlike +CRATE.MANIFEST, which is an ordinary member that nothing checks against the data
+    return Archive::Reader(crateFile).contentHash();
+  }
+
+  // legacy crates: hash of the whole file
+  return legacyCrateKey(MappedFile(crateFile));
+}
+
+static void removeStaleExtracted(const std::string &key) {
+  // trees are kept while some crate file that was run is still unchanged at its path
+  std::set<std::string> current = {key};
+  auto recordsDir = STR(Locations::cacheDirectoryPath << "/crates");
+  if (DIR *d = ::opendir(recordsDir.c_str())) {
+    RunAtEnd closeDir([d]() {
+      (void)::closedir(d);
+    });
+    while (auto *de = ::readdir(d)) {
+      std::string name = de->d_name;
+      if (name == "." || name == ".." || name.find('.') != std::string::npos)
+        continue; // records that are being written
+      auto file = STR(recordsDir << "/" << name);
+      CrateRecord record;
+      if (record.read(file) && record.isCurrent())
+        current.insert(record.key);
+      else
+        (void)::unlink(file.c_str()); // the crate file has been changed or removed
+    }
+  }
+
+  auto dir = STR(Locations::cacheDirectoryPath << "/extracted");
+  DIR *d = ::opendir(dir.c_str());
+  if (d == nullptr)
+    ERR("failed to read the directory '" << dir << "': " << strerror(errno))
+  RunAtEnd closeDir([d]() {
+    (void)::closedir(d);
+  });
+  while (auto *de = ::readdir(d)) {
+    std::string name = de->d_name;
+    if (name == "." || name == ".." || current.find(name) != current.end() || name.find('.') != std::string::npos)
+      continue; // only published trees, the lock files and temporary directories belong to them
+    removeUnlessLocked(STR(dir << "/" << name));
+  }
+}
+
+//
+// interface
+//
+
+std::string crateKey(const std::string &crateFile) {
+  // the key is only computed when the file at this path isn't the one that was run from it last time
+  char realPath[PATH_MAX];
+  struct stat sb;
+  if (::realpath(crateFile.c_str(), realPath) == nullptr || ::strchr(realPath, '\n') != nullptr || ::stat(realPath, &sb) == -1)
+    return computeCrateKey(crateFile); // can't be recorded
+  CrateRecord record;
+  auto recordFile = CrateRecord::fileFor(realPath);
+  auto identity = CrateRecord::identityOf(sb);
+  if (record.read(recordFile) && record.identity == identity && record.path == realPath)
+    return record.key;
+
+  record = {identity, computeCrateKey(crateFile), realPath};
+  createCacheDirectoryIfNeeded();
+  createCacheDirectoryIfNeeded("/crates");
+  record.write(recordFile);
+  return record.key;
+}
+
+std::string extractedPath(const std::string &key) {
+  return STR(Locations::cacheDirectoryPath << "/extracted/" << key);
+}
+
+bool isExtracted(const std::string &key) {
+  return Util::Fs::dirExists(extractedPath(key)); // trees only appear there complete
+}
+
+bool extract(const std::string &crateFile, const std::string &key, Extract::Stats &stats) {
+  if (isExtracted(key))
+    return false;
+
+  createCacheDirectoryIfNeeded();
+  createCacheDirectoryIfNeeded("/extracted");
+
+  // the crate file is opened again here, and it might have been replaced since the key was computed:
+  // what is extracted is checked against the key before it is published, so that no key gets other content
+  bool extracted = publish(extractedPath(key), [&key]() {return isExtracted(key);}, [&crateFile,&key,&stats](const std::string &tmpPath) {
+    if (Archive::isCrateArchive(crateFile.c_str())) {
+      Archive::Reader archive(crateFile);
+      if (archive.contentHash() != key)
+        ERR("the crate file '" << crateFile << "' has been replaced while it was being run")
+      stats = Extract::crateArchive(archive, tmpPath); // every block is verified against the index that the key is the hash of
+    } else {
+      int fd = ::open(crateFile.c_str(), O_RDONLY);
+      if (fd == -1)
+        ERR("failed to open the crate file '" << crateFile << "': " << strerror(errno))
+      RunAtEnd closeFd([fd]() {
+        (void)::close(fd);
+      });
+      struct stat sbBefore, sbAfter;
+      if (::fstat(fd, &sbBefore) == -1)
+        ERR("failed to stat the crate file '" << crateFile << "': " << strerror(errno))
+      MappedFile mf(fd, crateFile);
+      if (legacyCrateKey(mf) != key)
+        ERR("the crate file '" << crateFile << "' has been replaced while it was being run")
+      stats = Extract::stream([&mf,&crateFile](const Codec::FnData &feed) {
+        Codec::decompressData(mf.data, mf.size, crateFile, feed);
+      }, tmpPath);
+      // the mapping is shared: a write to the file after it was hashed changes its ctime
+      if (::fstat(fd, &sbAfter) == -1)
+        ERR("failed to stat the crate file '" << crateFile << "': " << strerror(errno))
+      if (CrateRecord::identityOf(sbAfter) != CrateRecord::identityOf(sbBefore))
+        ERR("the crate file '" << crateFile << "' has been written to while it was being extracted")
+    }
+  });
+  if (extracted)
+    removeStaleExtracted(key);
+  return extracted;
+}
+
+Extract::Stats cloneExtracted(const std::string &key, const std::string &dstDir, const std::vector<std::string> &writable) {
+  auto path = extractedPath(key);
+  int fdLock = ::open(CSTR(path << ".lock"), O_RDWR|O_CREAT|O_SHLOCK, 0600);
+  if (fdLock == -1)
+    ERR("failed to lock the cache entry '" << path << "': " << strerror(errno))
+  RunAtEnd unlock([fdLock]() {
+    (void)::close(fdLock);
+  });
+  if (!Util::Fs::dirExists(path))
+    ERR("the extracted tree '" << path << "' has been removed") // the crate file has been replaced meanwhile
+  return cloneTree(path, dstDir, writable);
+}
+
+Extract::Stats cloneTree(const std::string &srcDir, const std::string &dstDir, const std::vector<std::string> &writable) {
+  auto tmStart = std::chrono::steady_clock::now();
+  TreeCloner cloner(srcDir, dstDir, writable);
+  cloner.run();
+  cloner.stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+  return cloner.stats;
+}
+
+std::string baseKey(const std::string &baseArchive) {
+  MappedFile mf(baseArchive);
+  uint8_t hash[32];
+  Util::sha256(mf.data, mf.size, hash);
+  return Util::toHex(hash, sizeof(hash));
+}
+
+std::string basePath(const std::string &key) {
+  return STR(Locations::cacheDirectoryPath << "/base/" << key);
+}
+
+bool extractBase(const std::string &baseArchive, const std::string &key, Extract::Stats &stats) {
+  if (Util::Fs::dirExists(basePath(key)))
+    return false;
+
+  createCacheDirectoryIfNeeded();
+  createCacheDirectoryIfNeeded("/base");
+
+  bool extracted = publish(basePath(key), [&key]() {return Util::Fs::dirExists(basePath(key));}, [&baseArchive,&stats](const std::string &tmpPath) {
+    stats = Extract::crateFile(baseArchive, tmpPath); // base.txz is an xz-compressed tar, just like legacy crates
+  });
+  if (extracted)
+    removeStaleBases(key);
+  return extracted;
+}
+
+std::string downloadBase(const std::string &url, const std::string &baseArchive, Extract::Stats &stats, Download::Stats &downloadStats) {
+  // base.txz becomes the root of every crate, it is never used unverified
+  auto sha256 = Download::publishedSha256(url);
+  if (sha256.empty())
+    ERR("the MANIFEST next to '" << url << "' doesn't have the SHA256 of it, refusing to download it unverified;"
+        " base.txz can be placed as " << baseArchive << " manually instead")
+
+  createCacheDirectoryIfNeeded();
+  createCacheDirectoryIfNeeded("/base");
+
+  // the key is only known at the end, so the tree is unpacked under a temporary name
+  auto tmpPath = STR(Locations::cacheDirectoryPath << "/base/download-pid" << ::getpid() << ".tmp");
+  if (Util::Fs::dirExists(tmpPath))
+    Util::Fs::rmdirHier(tmpPath);
+  Util::Fs::mkdir(tmpPath, 0700);
+  RunAtEnd removeTmp([&tmpPath]() {
+    if (Util::Fs::dirExists(tmpPath))
+      Util::Fs::rmdirHier(tmpPath); // failed, or another process has unpacked the same base.txz meanwhile
+  });
+
+  // network -> base.txz and the xz decoder -> tar reader -> writer threads, all at the same time
+  std::string key;
+  stats = Extract::stream([&url,&baseArchive,&sha256,&downloadStats,&key](const Codec::FnData &feed) {
+    Codec::Decoder decoder(feed);
+    key = Download::toFile(url, baseArchive, sha256, [&decoder](const uint8_t *data, size_t size) {
+      decoder.feed(data, size);
+    }, [&decoder]() {
+      decoder.finish(); // a truncated download isn't kept
+    }, downloadStats);
+  }, tmpPath);
+
+  // publish it unless another process has meanwhile unpacked the same base.txz
+  if (publish(basePath(key), [&key]() {return Util::Fs::dirExists(basePath(key));}, [&tmpPath](const std::string &tmpPathKey) {
+    // the tree is already there, it only takes the place of the empty directory
+    Util::Fs::rmdir(tmpPathKey);
+    if (::rename(tmpPath.c_str(), tmpPathKey.c_str()) == -1)
+      ERR("failed to rename '" << tmpPath << "' to '" << tmpPathKey << "': " << strerror(errno))
+  }))
+    removeStaleBases(key);
+
+  return key;
+}
+
+Extract::Stats cloneBase(const std::string &key, const std::string &dstDir, const std::vector<std::string> &writable) {
+  auto path = basePath(key);
+  int fdLock = ::open(CSTR(path << ".lock"), O_RDWR|O_CREAT|O_SHLOCK, 0600);
+  if (fdLock == -1)
+    ERR("failed to lock the cache entry '" << path << "': " << strerror(errno))
+  RunAtEnd unlock([fdLock]() {
+    (void)::close(fdLock);
+  });
+  if (!Util::Fs::dirExists(path))
+    ERR("the base tree '" << path << "' has been removed") // a newer base.txz has replaced it meanwhile
+  return cloneTree(path, dstDir, writable);
+}
+
+std::string packagesKey(const std::string &baseKey, const std::string &description) {
+  uint8_t hash[32];
+  Util::sha256((const uint8_t*)description.data(), description.size(), hash);
+  return STR(baseKey.substr(0, packagesKeyBasePrefix) << "-" << Util::toHex(hash, sizeof(hash)));
+}
+
+bool hasPackages(const std::string &key) {
+  return Util::Fs::dirExists(packagesPath(key)); // trees only appear there complete
+}
+
+bool storePackages(const std::string &key, const std::string &jailDir, const std::vector<std::string> &writable, Extract::Stats &stats) {
+  if (hasPackages(key))
+    return false;
+
+  createCacheDirectoryIfNeeded();
+  createCacheDirectoryIfNeeded("/packages");
+
+  // the writable paths are copied both ways, so that neither the jail nor later clones can alter the stored tree;
+  // createCrate passes all paths as writable when anything runs in the jail
+  bool stored = publish(packagesPath(key), [&key]() {return hasPackages(key);}, [&jailDir,&writable,&stats](const std::string &tmpPath) {
+    stats = cloneTree(jailDir, tmpPath, writable);
+  });
+  if (stored)
+    removeStalePackages(key);
+  return stored;
+}
+
+Extract::Stats clonePackages(const std::string &key, const std::string &dstDir, const std::vector<std::string> &writable) {
+  auto path = packagesPath(key);
+  int fdLock = ::open(CSTR(path << ".lock"), O_RDWR|O_CREAT|O_SHLOCK, 0600);
+  if (fdLock == -1)
+    ERR("failed to lock the cache entry '" << path << "': " << strerror(errno))
+  RunAtEnd unlock([fdLock]() {
+    (void)::close(fdLock);
+  });
+  if (!hasPackages(key))
+    ERR("the package tree '" << path << "' has been removed") // it has expired meanwhile
+  (void)::futimens(fdLock, nullptr); // it is in use
+  return cloneTree(path, dstDir, writable);
+}
+
+}
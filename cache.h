@@ -0,0 +1,55 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Cache: pristine extracted trees of crates, one per crate content, kept in Locations::cacheDirectoryPath/extracted
+//
+// Runs with --cache don't extract the crate, they clone the cached tree into the jail directory instead: regular
+// files are hardlinked, and only files under the writable paths are copied. A hardlinked file shares its inode with
+// the cached tree, so a service that writes to it in place alters the cached tree for all later runs, and the
+// immutable flag can't protect them because link(2) refuses immutable files. This is why the cache is opt-in.
+// The tree is published by renaming a complete temporary directory while holding a lock file, so simultaneous
+// runs of the same crate extract it only once.
+//
+// The key of the crate file at each path is recorded in Locations::cacheDirectoryPath/crates along with the identity
+// of the file (device, inode, size, mtime and ctime), so that unchanged crate files aren't hashed again. When a tree
+// is extracted, the trees that no recorded crate file still has are removed.
+//
+// 'crate create' keeps the pristine tree of base.txz in Locations::cacheDirectoryPath/base the same way, keyed by
+// the hash of base.txz, so that a new version of base.txz gets a new tree, and trees of older versions are removed.
+//
+// It also keeps the jail trees with the packages of specs installed in Locations::cacheDirectoryPath/packages, keyed
+// by the base tree and by the description of everything that determines what pkg(8) installs, so that creates that
+// only differ in other ways skip pkg(8). When a tree is stored, the trees of other bases and the trees that haven't
+// been cloned for 30 days are removed.
+//
+
+#include "extract.h"
+#include "download.h"
+
+#include <string>
+#include <vector>
+
+namespace Cache {
+
+std::string crateKey(const std::string &crateFile);   // the content hash of the crate, only computed when the file at its path has changed
+std::string extractedPath(const std::string &key);    // where the pristine tree of the crate is
+bool isExtracted(const std::string &key);
+bool extract(const std::string &crateFile, const std::string &key, Extract::Stats &stats); // ensures that the tree is in the cache, returns false when it already was there
+Extract::Stats cloneExtracted(const std::string &key, const std::string &dstDir, const std::vector<std::string> &writable); // the tree isn't removed while it is cloned
+Extract::Stats cloneTree(const std::string &srcDir, const std::string &dstDir, const std::vector<std::string> &writable); // writable are absolute paths in the tree
+extern const std::vector<std::string> allWritable;    // pass as writable to copy every file
+
+std::string baseKey(const std::string &baseArchive);  // the hash of base.txz
+std::string basePath(const std::string &key);         // where the pristine tree of base.txz is
+bool extractBase(const std::string &baseArchive, const std::string &key, Extract::Stats &stats); // same as extract(), also removes trees of other versions
+std::string downloadBase(const std::string &url, const std::string &baseArchive, Extract::Stats &stats, Download::Stats &downloadStats); // downloads base.txz and unpacks it in the same pass, returns its key
+Extract::Stats cloneBase(const std::string &key, const std::string &dstDir, const std::vector<std::string> &writable); // the tree isn't removed while it is cloned
+
+std::string packagesKey(const std::string &baseKey, const std::string &description);
+bool hasPackages(const std::string &key);
+bool storePackages(const std::string &key, const std::string &jailDir, const std::vector<std::string> &writable, Extract::Stats &stats); // returns false when it already was there
+Extract::Stats clonePackages(const std::string &key, const std::string &dstDir, const std::vector<std::string> &writable);
+
+}
@@ -0,0 +1,86 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "args.h"
+#include "archive.h"
+#include "codec.h"
+#include "tar.h"
+#include "util.h"
+#include "err.h"
+#include "commands.h"
+
+#include <rang.hpp>
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <iostream>
+
+#define ERR(msg...) ERR2("printing a file from the crate", msg)
+
+#define LOG(msg...) \
+  { \
+    if (args.logProgress) \
+      std::cerr << rang::fg::gray << Util::tmSecMs() << ": " << msg << rang::style::reset << std::endl; \
+  }
+
+//
+// helpers
+//
+
+static void writeStdout(const uint8_t *data, size_t size) {
+  while (size > 0) {
+    auto res = ::write(STDOUT_FILENO, data, size);
+    if (res == -1)
+      ERR("failed to write to stdout: " << strerror(errno))
+    data += res;
+    size -= res;
+  }
+}
+
+static bool catLegacyCrate(const std::string &crateFile, const std::string &path) {
+  // the legacy format has no index: decompress until the file is found
+  class Handler : public Tar::Reader::Handler {
+  public:
+    std::string path;
+    bool        inFile = false;
+    bool        found = false;
+    void onEntry(const Tar::Entry &entry) override {
+      inFile = !found && entry.path == path;
+      found = found || inFile;
+    }
+    void onData(const uint8_t *data, size_t size) override {
+      if (inFile)
+        writeStdout(data, size);
+    }
+    void onEntryEnd() override {
+      inFile = false;
+    }
+  } handler;
+  handler.path = Tar::normalizePath(path);
+  Tar::Reader reader(handler);
+  Codec::decompressFile(crateFile, [&reader](const uint8_t *data, size_t size) {
+    reader.feed(data, size);
+  });
+  return handler.found;
+}
+
+//
+// interface
+//
+
+bool catCrate(const Args &args) {
+  LOG("'cat' command is invoked")
+
+  bool found;
+  if (Archive::isCrateArchive(args.catCrateFile.c_str()))
+    found = Archive::Reader(args.catCrateFile).readFile(args.catFilePath, writeStdout);
+  else
+    found = catLegacyCrate(args.catCrateFile, args.catFilePath);
+  if (!found)
+    ERR("the file '" << args.catFilePath << "' isn't found in the crate '" << args.catCrateFile << "'")
+
+  LOG("'cat' command has succeeded")
+  return true;
+}
@@ -0,0 +1,459 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "codec.h"
+#include "threads.h"
+#include "util.h"
+#include "err.h"
+
+#include <lzma.h>
+#include <zstd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#define ERR(msg...) ERR2("decompress", msg)
+
+namespace Codec {
+
+//
+// helpers
+//
+
+static const uint8_t xzMagic[6]   = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+static const uint8_t zstdMagic[4] = {0x28, 0xb5, 0x2f, 0xfd};
+static const int     maxWindowLog = sizeof(size_t) == 4 ? 30 : 31; // the largest zstd window, patches reference files up to this size
+
+class XzBlock {
+public:
+  uint64_t offset;           // compressed offset in file
+  uint64_t size;             // compressed size
+  uint64_t uncompressedSize;
+};
+
+// find blocks of a single-stream xz file from its index, returns false if the file doesn't have this layout
+static bool xzFindBlocks(const uint8_t *data, size_t size, lzma_check &check, std::vector<XzBlock> &blocks) {
+  // skip the stream padding
+  while (size >= 4 && data[size-1] == 0 && data[size-2] == 0 && data[size-3] == 0 && data[size-4] == 0)
+    size -= 4;
+  if (size < 2*LZMA_STREAM_HEADER_SIZE)
+    return false;
+
+  // stream header and footer
+  lzma_stream_flags header, footer;
+  if (::lzma_stream_header_decode(&header, data) != LZMA_OK)
+    return false;
+  if (::lzma_stream_footer_decode(&footer, data + size - LZMA_STREAM_HEADER_SIZE) != LZMA_OK)
+    return false;
+  if (::lzma_stream_flags_compare(&header, &footer) != LZMA_OK)
+    return false;
+  if (footer.backward_size > size - 2*LZMA_STREAM_HEADER_SIZE)
+    return false;
+
+  // index
+  lzma_index *index = nullptr;
+  uint64_t memlimit = UINT64_MAX;
+  size_t inPos = 0;
+  auto indexOffset = size - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+  if (::lzma_index_buffer_decode(&index, &memlimit, nullptr, data + indexOffset, &inPos, footer.backward_size) != LZMA_OK)
+    return false;
+  std::unique_ptr<lzma_index, void(*)(lzma_index*)> indexHolder(index, [](lzma_index *i) {::lzma_index_end(i, nullptr);});
+  if (::lzma_index_stream_size(index) != size) // several concatenated streams: not supported here
+    return false;
+
+  // blocks
+  lzma_index_iter iter;
+  ::lzma_index_iter_init(&iter, index);
+  while (!::lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+    blocks.push_back({iter.block.compressed_file_offset, iter.block.total_size, iter.block.uncompressed_size});
+  check = header.check;
+
+  return true;
+}
+
+static void xzDecodeBlock(const uint8_t *data, const XzBlock &xb, lzma_check check, std::vector<uint8_t> &out) {
+  lzma_filter filters[LZMA_FILTERS_MAX + 1];
+  lzma_block block;
+  ::memset(&block, 0, sizeof(block));
+  block.version = 0;
+  block.check = check;
+  block.filters = filters;
+  block.header_size = lzma_block_header_size_decode(data[xb.offset]);
+  if (::lzma_block_header_decode(&block, nullptr, data + xb.offset) != LZMA_OK)
+    ERR("failed to decode the xz block header at offset " << xb.offset)
+  RunAtEnd freeFilters([&filters]() {
+    for (unsigned i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+      ::free(filters[i].options);
+  });
+
+  out.resize(xb.uncompressedSize);
+  size_t inPos = block.header_size, outPos = 0;
+  auto res = ::lzma_block_buffer_decode(&block, nullptr, data + xb.offset, &inPos, xb.size, out.data(), &outPos, out.size());
+  if (res != LZMA_OK || outPos != out.size())
+    ERR("failed to decode the xz block at offset " << xb.offset << ": lzma error " << res)
+}
+
+static void xzDecompressSerial(const uint8_t *data, size_t size, FnData fnData) {
+  lzma_stream strm = LZMA_STREAM_INIT;
+  if (::lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+    ERR("failed to initialize the xz decoder")
+  RunAtEnd freeDecoder([&strm]() {
+    ::lzma_end(&strm);
+  });
+
+  uint8_t buf[0x10000];
+  strm.next_in = data;
+  strm.avail_in = size;
+  lzma_ret res;
+  do {
+    strm.next_out = buf;
+    strm.avail_out = sizeof(buf);
+    res = ::lzma_code(&strm, LZMA_FINISH);
+    if (res != LZMA_OK && res != LZMA_STREAM_END)
+      ERR("xz decoding failed: lzma error " << res)
+    if (strm.avail_out < sizeof(buf))
+      fnData(buf, sizeof(buf) - strm.avail_out);
+  } while (res != LZMA_STREAM_END);
+}
+
+//
+// interface
+//
+
+bool typeFromName(const std::string &name, Type &type) {
+  if (name == "xz")
+    type = TypeXz;
+  else if (name == "zstd")
+    type = TypeZstd;
+  else if (name == "none")
+    type = TypeNone;
+  else
+    return false;
+  return true;
+}
+
+const char* typeName(Type type) {
+  switch (type) {
+  case TypeNone: return "none";
+  case TypeXz:   return "xz";
+  case TypeZstd: return "zstd";
+  }
+  return "unknown";
+}
+
+bool isValidLevel(Type type, int level) {
+  if (level == LevelDefault)
+    return true;
+  switch (type) {
+  case TypeNone: return level == 0;
+  case TypeXz:   return 0 <= level && level <= 9;
+  case TypeZstd: return 1 <= level && level <= ::ZSTD_maxCLevel();
+  }
+  return false;
+}
+
+void compressBuffer(Type type, int level, const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+  switch (type) {
+  case TypeNone:
+    out.assign(data, data + size);
+    return;
+  case TypeXz: {
+    out.resize(::lzma_stream_buffer_bound(size));
+    size_t outPos = 0;
+    uint32_t preset = (level == LevelDefault ? LZMA_PRESET_DEFAULT : level) | LZMA_PRESET_EXTREME;
+    auto res = ::lzma_easy_buffer_encode(preset, LZMA_CHECK_CRC64, nullptr, data, size, out.data(), &outPos, out.size());
+    if (res != LZMA_OK)
+      ERR2("compress", "xz encoding failed: lzma error " << res)
+    out.resize(outPos);
+    return;
+  }
+  case TypeZstd: {
+    out.resize(::ZSTD_compressBound(size));
+    auto res = ::ZSTD_compress(out.data(), out.size(), data, size, level == LevelDefault ? 19 : level);
+    if (::ZSTD_isError(res))
+      ERR2("compress", "zstd encoding failed: " << ::ZSTD_getErrorName(res))
+    out.resize(res);
+    return;
+  }}
+  ERR2("compress", "unknown compression type " << type)
+}
+
+void decompressBuffer(Type type, const uint8_t *data, size_t size, size_t uncompressedSize, std::vector<uint8_t> &out) {
+  switch (type) {
+  case TypeNone:
+    if (size != uncompressedSize)
+      ERR("size mismatch in the uncompressed buffer")
+    out.assign(data, data + size);
+    return;
+  case TypeXz: {
+    out.resize(uncompressedSize);
+    uint64_t memlimit = UINT64_MAX;
+    size_t inPos = 0, outPos = 0;
+    auto res = ::lzma_stream_buffer_decode(&memlimit, 0/*flags*/, nullptr, data, &inPos, size, out.data(), &outPos, out.size());
+    if (res != LZMA_OK || inPos != size || outPos != uncompressedSize)
+      ERR("xz decoding failed: lzma error " << res)
+    return;
+  }
+  case TypeZstd: {
+    out.resize(uncompressedSize);
+    auto res = ::ZSTD_decompress(out.data(), out.size(), data, size);
+    if (::ZSTD_isError(res))
+      ERR("zstd decoding failed: " << ::ZSTD_getErrorName(res))
+    if (res != uncompressedSize)
+      ERR("size mismatch in the zstd buffer")
+    return;
+  }}
+  ERR("unknown compression type " << type)
+}
+
+void diffBuffer(const uint8_t *ref, size_t refSize, const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+  auto cctx = ::ZSTD_createCCtx();
+  if (cctx == nullptr)
+    ERR2("diff", "failed to initialize the zstd encoder")
+  RunAtEnd freeEncoder([cctx]() {
+    ::ZSTD_freeCCtx(cctx);
+  });
+  // the window has to cover the reference and the data, otherwise matches in the reference aren't found
+  int windowLog = 10; // the minimum of zstd
+  while (windowLog < maxWindowLog && (uint64_t(1) << windowLog) < uint64_t(refSize) + size)
+    windowLog++;
+  auto check = [](size_t res) {
+    if (::ZSTD_isError(res))
+      ERR2("diff", "zstd encoding failed: " << ::ZSTD_getErrorName(res))
+  };
+  check(::ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 19));
+  check(::ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, windowLog));
+  check(::ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1));
+  check(::ZSTD_CCtx_refPrefix(cctx, ref, refSize));
+  out.resize(::ZSTD_compressBound(size));
+  auto res = ::ZSTD_compress2(cctx, out.data(), out.size(), data, size);
+  check(res);
+  out.resize(res);
+}
+
+void patchBuffer(const uint8_t *ref, size_t refSize, const uint8_t *patch, size_t patchSize, size_t size, std::vector<uint8_t> &out) {
+  auto dctx = ::ZSTD_createDCtx();
+  if (dctx == nullptr)
+    ERR("failed to initialize the zstd decoder")
+  RunAtEnd freeDecoder([dctx]() {
+    ::ZSTD_freeDCtx(dctx);
+  });
+  auto check = [](size_t res) {
+    if (::ZSTD_isError(res))
+      ERR("zstd patching failed: " << ::ZSTD_getErrorName(res))
+  };
+  check(::ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, maxWindowLog));
+  check(::ZSTD_DCtx_refPrefix(dctx, ref, refSize));
+  out.resize(size);
+  auto res = ::ZSTD_decompressDCtx(dctx, out.data(), out.size(), patch, patchSize);
+  check(res);
+  if (res != size)
+    ERR("size mismatch in the zstd patch")
+}
+
+Type sniffFile(const char *file) {
+  int fd = ::open(file, O_RDONLY);
+  if (fd == -1)
+    return TypeNone; // can't open: can't be a compressed file
+  uint8_t signature[6];
+  auto res = ::read(fd, signature, sizeof(signature));
+  (void)::close(fd);
+  if (res != sizeof(signature))
+    return TypeNone;
+
+  if (::memcmp(signature, xzMagic, sizeof(xzMagic)) == 0)
+    return TypeXz;
+  if (::memcmp(signature, zstdMagic, sizeof(zstdMagic)) == 0)
+    return TypeZstd;
+  return TypeNone;
+}
+
+void decompressFile(const std::string &file, FnData fnData) {
+  MappedFile mf(file);
+  decompressData(mf.data, mf.size, file, fnData);
+}
+
+void decompressData(const uint8_t *data, size_t size, const std::string &what, FnData fnData) {
+  if (size >= sizeof(xzMagic) && ::memcmp(data, xzMagic, sizeof(xzMagic)) == 0)
+    xzDecompressData(data, size, fnData);
+  else if (size >= sizeof(zstdMagic) && ::memcmp(data, zstdMagic, sizeof(zstdMagic)) == 0)
+    zstdDecompressData(data, size, what, fnData);
+  else
+    ERR("'" << what << "' is neither an xz nor a zstd file")
+}
+
+void xzDecompressFile(const std::string &file, FnData fnData) {
+  MappedFile mf(file);
+  xzDecompressData(mf.data, mf.size, fnData);
+}
+
+void xzDecompressData(const uint8_t *data, size_t size, FnData fnData) {
+  lzma_check check;
+  std::vector<XzBlock> blocks;
+  if (!xzFindBlocks(data, size, check, blocks) || blocks.size() < 2) {
+    xzDecompressSerial(data, size, fnData);
+    return;
+  }
+
+  runOrdered(blocks.size(), [&](unsigned b, std::vector<uint8_t> &out) {
+    xzDecodeBlock(data, blocks[b], check, out);
+  }, [&](unsigned b, std::vector<uint8_t> &out) {
+    fnData(out.data(), out.size());
+  });
+}
+
+void zstdDecompressFile(const std::string &file, FnData fnData) {
+  MappedFile mf(file);
+  zstdDecompressData(mf.data, mf.size, file, fnData);
+}
+
+void zstdDecompressData(const uint8_t *data, size_t size, const std::string &what, FnData fnData) {
+  auto strm = ::ZSTD_createDStream();
+  if (strm == nullptr)
+    ERR("failed to initialize the zstd decoder")
+  RunAtEnd freeDecoder([strm]() {
+    ::ZSTD_freeDStream(strm);
+  });
+  ::ZSTD_initDStream(strm);
+
+  std::vector<uint8_t> buf(::ZSTD_DStreamOutSize());
+  ZSTD_inBuffer in = {data, size, 0};
+  size_t res = 0;
+  while (in.pos < in.size) {
+    ZSTD_outBuffer out = {buf.data(), buf.size(), 0};
+    res = ::ZSTD_decompressStream(strm, &out, &in);
+    if (::ZSTD_isError(res))
+      ERR("zstd decoding failed: " << ::ZSTD_getErrorName(res))
+    if (out.pos > 0)
+      fnData(buf.data(), out.pos);
+  }
+  // flush what the decoder still holds after consuming the whole input
+  while (res != 0) {
+    ZSTD_outBuffer out = {buf.data(), buf.size(), 0};
+    res = ::ZSTD_decompressStream(strm, &out, &in);
+    if (::ZSTD_isError(res))
+      ERR("zstd decoding failed: " << ::ZSTD_getErrorName(res))
+    if (out.pos == 0 && res != 0)
+      ERR("the zstd file '" << what << "' is truncated")
+    fnData(buf.data(), out.pos);
+  }
+}
+
+//
+// Decoder
+//
+
+class Decoder::Impl {
+public:
+  FnData               fnData;
+  Type                 type = TypeNone;
+  std::vector<uint8_t> head;      // the beginning of the stream until the magic can be recognized
+  lzma_stream          xz = LZMA_STREAM_INIT;
+  ZSTD_DStream        *zstd = nullptr;
+  bool                 ended = false;
+  std::vector<uint8_t> buf;
+
+  Impl(const FnData &newFnData) : fnData(newFnData), buf(0x10000) { }
+  ~Impl() {
+    if (type == TypeXz)
+      ::lzma_end(&xz);
+    if (zstd != nullptr)
+      ::ZSTD_freeDStream(zstd);
+  }
+
+  void start() {
+    if (head.size() >= sizeof(xzMagic) && ::memcmp(head.data(), xzMagic, sizeof(xzMagic)) == 0) {
+      if (::lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+        ERR("failed to initialize the xz decoder")
+      type = TypeXz;
+    } else if (::memcmp(head.data(), zstdMagic, sizeof(zstdMagic)) == 0) {
+      zstd = ::ZSTD_createDStream();
+      if (zstd == nullptr)
+        ERR("failed to initialize the zstd decoder")
+      ::ZSTD_initDStream(zstd);
+      type = TypeZstd;
+    } else {
+      ERR("the stream is neither xz nor zstd")
+    }
+  }
+  void decode(const uint8_t *data, size_t size, bool last) {
+    if (size == 0 && !last)
+      return; // decoders treat calls without progress as errors
+    switch (type) {
+    case TypeXz: {
+      xz.next_in = data;
+      xz.avail_in = size;
+      do {
+        xz.next_out = buf.data();
+        xz.avail_out = buf.size();
+        auto res = ::lzma_code(&xz, last ? LZMA_FINISH : LZMA_RUN);
+        if (res == LZMA_STREAM_END)
+          ended = true;
+        else if (res == LZMA_BUF_ERROR && last)
+          ERR("the xz stream is truncated")
+        else if (res != LZMA_OK)
+          ERR("xz decoding failed: lzma error " << res)
+        if (xz.avail_out < buf.size())
+          fnData(buf.data(), buf.size() - xz.avail_out);
+      } while (xz.avail_in > 0 || (xz.avail_out == 0 && !ended) || (last && !ended));
+      break;
+    } case TypeZstd: {
+      ZSTD_inBuffer in = {data, size, 0};
+      size_t res = 0;
+      bool full;
+      do {
+        ZSTD_outBuffer out = {buf.data(), buf.size(), 0};
+        res = ::ZSTD_decompressStream(zstd, &out, &in);
+        if (::ZSTD_isError(res))
+          ERR("zstd decoding failed: " << ::ZSTD_getErrorName(res))
+        if (out.pos > 0)
+          fnData(buf.data(), out.pos);
+        if (last && out.pos == 0 && res != 0)
+          ERR("the zstd stream is truncated")
+        full = out.pos == out.size; // the decoder might hold more output
+      } while (in.pos < in.size || full || (last && res != 0));
+      ended = res == 0;
+      break;
+    } default:
+      break;
+    }
+  }
+};
+
+Decoder::Decoder(const FnData &newFnData)
+: impl(new Impl(newFnData))
+{ }
+
+Decoder::~Decoder() {
+}
+
+void Decoder::feed(const uint8_t *data, size_t size) {
+  if (impl->type == TypeNone) {
+    auto n = std::min(size, sizeof(xzMagic) - impl->head.size());
+    impl->head.insert(impl->head.end(), data, data + n);
+    data += n;
+    size -= n;
+    if (impl->head.size() < sizeof(xzMagic))
+      return;
+    impl->start();
+    impl->decode(impl->head.data(), impl->head.size(), false);
+  }
+  impl->decode(data, size, false);
+}
+
+void Decoder::finish() {
+  if (impl->type == TypeNone)
+    ERR("the stream is truncated")
+  impl->decode(nullptr, 0, true);
+}
+
+}
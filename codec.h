@@ -0,0 +1,49 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+
+#include <stdint.h>
+
+namespace Codec {
+
+enum Type {TypeNone = 0, TypeXz = 1, TypeZstd = 2}; // values are stored in crate files
+
+typedef std::function<void(const uint8_t *data, size_t size)> FnData;
+
+const int LevelDefault = -1; // the default level of the codec: xz -6e, zstd -19 (xz levels are always used with the extreme flag)
+
+bool typeFromName(const std::string &name, Type &type); // xz, zstd, none
+const char* typeName(Type type);
+bool isValidLevel(Type type, int level);
+
+void compressBuffer(Type type, int level, const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+void decompressBuffer(Type type, const uint8_t *data, size_t size, size_t uncompressedSize, std::vector<uint8_t> &out);
+void diffBuffer(const uint8_t *ref, size_t refSize, const uint8_t *data, size_t size, std::vector<uint8_t> &out); // zstd with ref as the prefix: only what differs costs space
+void patchBuffer(const uint8_t *ref, size_t refSize, const uint8_t *patch, size_t patchSize, size_t size, std::vector<uint8_t> &out);
+Type sniffFile(const char *file); // the codec of the compressed file by its magic, TypeNone when it is neither xz nor zstd
+void decompressFile(const std::string &file, FnData fnData); // the decoder is picked by the file magic
+void decompressData(const uint8_t *data, size_t size, const std::string &what, FnData fnData); // the same for a file that is already mapped, what is for errors
+void xzDecompressFile(const std::string &file, FnData fnData); // independent blocks of multi-block streams are decoded in parallel, data is delivered in order
+void xzDecompressData(const uint8_t *data, size_t size, FnData fnData);
+void zstdDecompressFile(const std::string &file, FnData fnData);
+void zstdDecompressData(const uint8_t *data, size_t size, const std::string &what, FnData fnData);
+
+class Decoder { // decodes xz or zstd data that arrives in pieces, the codec is picked by the magic
+public:
+  Decoder(const FnData &newFnData);
+  ~Decoder();
+
+  void feed(const uint8_t *data, size_t size);
+  void finish(); // fails when the stream is truncated
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+}
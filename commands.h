@@ -7,3 +7,8 @@ class Spec;
 
 bool createCrate(const Args &args, const Spec &spec);
 bool runCrate(const Args &args, int argc, char** argv, int &outReturnCode);
+bool catCrate(const Args &args);
+bool manageStore(const Args &args);
+bool deltaCrate(const Args &args);
+bool patchCrate(const Args &args);
+bool benchCompress(const Args &args);
@@ -9,20 +9,31 @@
 #include "util.h"
 #include "err.h"
 #include "commands.h"
+#include "archive.h"
+#include "codec.h"
+#include "pack.h"
+#include "cache.h"
+#include "elf.h"
+#include "misc.h"
+#include "pathset.h"
+#include "prune.h"
+#include "trace.h"
+#include "download.h"
 
 #include <rang.hpp>
 
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
-#include <assert.h>
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <set>
 #include <functional>
+#include <thread>
 
 #define ERR(msg...) ERR2("creating a crate", msg)
 
@@ -36,6 +47,41 @@
 static uid_t myuid = ::getuid();
 static gid_t mygid = ::getgid();
 
+// parts of the base tree that are pruned: entirely, or all but the kept files
+static const std::vector<Prune::Part> prunedBaseParts = {
+  {"/bin",                    true},
+  {"/boot",                   false},
+  {"/etc/periodic",           false},
+  {"/lib",                    true},
+  {"/rescue",                 false},
+  {"/sbin",                   true},
+  {"/usr/bin",                true},
+  {"/usr/include",            false},
+  {"/usr/lib",                true},
+  {"/usr/lib/include",        false},
+  {"/usr/lib32",              false},
+  {"/usr/libexec",            true},
+  {"/usr/obj",                false},
+  {"/usr/sbin",               true},
+  {"/usr/share/bsdconfig",    false},
+  {"/usr/share/doc",          false},
+  {"/usr/share/dtrace",       false},
+  {"/usr/share/examples",     false},
+  {"/usr/share/games",        false},
+  {"/usr/share/i18n",         false},
+  {"/usr/share/man",          false},
+  {"/usr/share/misc",         false},
+  {"/usr/share/openssl",      false},
+  {"/usr/share/pc-sysinstall",false},
+  {"/usr/src",                false},
+  {"/usr/tests",              false},
+  {"/var/db/etcupdate",       false}
+};
+
+// paths of the base tree that are modified in place while the crate is being created: they are copied, not hardlinked,
+// when the rest of the tree is hardlinked from the cache
+static const std::vector<std::string> baseWritablePaths = {"/etc", "/var", "/root", "/tmp", "/usr/local"};
+
 //
 // helpers
 //
@@ -113,155 +159,193 @@ static void installAndAddPackagesInJail(const std::string &jailPath,
   notifyUserOfLongProcess(false, "pkg", STR("install the required packages: " << (pkgsInstall+pkgsAdd)));
 }
 
-static std::set<std::string> getElfDependencies(const std::string &elfPath, const std::string &jailPath,
-                                                std::function<bool(const std::string&)> filter = [](const std::string &path) {return true;})
-{
-  std::set<std::string> dset;
-  // It is possible to use elf(3) to read shared library dependences from the elf file,
-  // but it's hard to then find the disk location, ld-elf.so does this through some WooDoo magic.
-  // Instead, we just use ldd(1) to read this information.
-  std::istringstream is(Util::runCommandGetOutput(
-    STR(Cmd::chroot(jailPath) << "/bin/sh -c \"ldd " << elfPath << " | grep '=>' | sed -e 's|.* => ||; s| .*||'\""), "get elf dependencies"));
-  std::string s;
-  while (std::getline(is, s, '\n'))
-    if (!s.empty() && filter(s))
-      dset.insert(s);
-  return dset;
+static std::string fileHash(const std::string &file) {
+  MappedFile mf(file);
+  uint8_t hash[32];
+  Util::sha256(mf.data, mf.size, hash);
+  return Util::toHex(hash, sizeof(hash));
+}
+
+static std::string pkgCatalogVersion(const std::string &baseTree) { // the version of the catalog that pkg(8) in the base tree would use, empty when it is unknown
+  // the repository URL from the base configuration of pkg(8)
+  std::ifstream conf(STR(baseTree << "/etc/pkg/FreeBSD.conf"));
+  std::string line, url;
+  while (url.empty() && std::getline(conf, line)) { // url: "pkg+http://pkg.FreeBSD.org/${ABI}/quarterly",
+    auto key = line.find_first_not_of(" \t");
+    auto q1 = line.find('"');
+    auto q2 = q1 != std::string::npos ? line.find('"', q1 + 1) : std::string::npos;
+    if (key != std::string::npos && line.compare(key, 4, "url:") == 0 && q2 != std::string::npos)
+      url = line.substr(q1 + 1, q2 - q1 - 1);
+  }
+  if (url.empty())
+    return "";
+  if (url.compare(0, 4, "pkg+") == 0)
+    url = url.substr(4); // SRV records are for pkg(8) only
+  auto abi = url.find("${ABI}");
+  if (abi != std::string::npos)
+    url.replace(abi, 6, STR("FreeBSD:" << std::stoul(Util::getSysctlString("kern.osrelease")) << ":" << Util::getSysctlString("hw.machine_arch")));
+
+  // the catalog file changes with every build of the repository
+  for (auto file : {"packagesite.txz", "packagesite.pkg"}) {
+    auto version = Download::remoteVersion(STR(url << "/" << file));
+    if (!version.empty())
+      return STR(url << "/" << file << " " << version);
+  }
+  return "";
+}
+
+static std::string packagesDescription(const Spec &spec, const std::string &catalogVersion) { // everything that determines the tree with the packages installed
+  std::ostringstream ss;
+  for (auto &p : spec.pkgInstall)
+    ss << "install " << p << std::endl;
+  for (auto &p : spec.pkgAdd)
+    ss << "add " << fileHash(p) << std::endl;
+  for (auto &lo : spec.pkgLocalOverride)
+    ss << "override " << lo.first << " " << (Util::Fs::fileExists(lo.second) ? fileHash(lo.second) : "missing") << std::endl;
+  for (auto &n : spec.pkgNuke)
+    ss << "nuke " << n << std::endl;
+  auto scripts = spec.scripts.find("create:start"); // they run before pkg(8)
+  if (scripts != spec.scripts.end())
+    for (auto &script : scripts->second)
+      ss << "script " << script.first << " " << script.second << std::endl;
+  ss << "catalog " << catalogVersion << std::endl;
+  return ss.str();
 }
 
-static void removeRedundantJailParts(const std::string &jailPath, const Spec &spec) {
+static std::string removeRedundantJailParts(const Args &args, const std::string &jailPath, const Spec &spec) { // returns the discarded build tree in the additive mode
   namespace Fs = Util::Fs;
 
   const char *prefix = "/usr/local";
-  const char *prefixSlash = "/usr/local/";
-  auto prefixSlashSz = ::strlen(prefixSlash);
-  auto jailPathSz = jailPath.size();
   
   // local helpers
-  auto J = [&jailPath](auto subdir) {
-    return STR(jailPath << subdir);
-  };
-  auto toJailPath = [J](const std::set<std::string> &in, std::set<std::string> &out) {
+  auto addAll = [](const std::set<std::string> &in, PathSet &out) {
     for (auto &p : in)
-      out.insert(J(p));
-  };
-  auto fromJailPath = [&jailPath,jailPathSz](const std::string &file) {
-    auto fileCstr = file.c_str();
-    assert(::strncmp(jailPath.c_str(), fileCstr, jailPathSz) == 0); // really begins with jailPath
-    return fileCstr + jailPathSz;
-  };
-  auto isBasePath = [prefixSlash,prefixSlashSz](const std::string &path) {
-    return ::strncmp(path.c_str(), prefixSlash, prefixSlashSz) != 0;
+      out.insert(p);
   };
 
-  // form the 'except' set: it should only contain files in basem and they should begin with jailPath
-  std::set<std::string> except;
-  auto keepFile = [&except,&jailPath,J,toJailPath](auto &file) { // any file, not just ELF
-    except.insert(J(file));
-    if (Fs::isElfFileOrDir(J(file)) == 'E')
-      toJailPath(getElfDependencies(file, jailPath), except);
-  };
-  if (!spec.runCmdExecutable.empty()) {
-    if (isBasePath(spec.runCmdExecutable))
-      except.insert(J(spec.runCmdExecutable));
-    if (Fs::isElfFileOrDir(J(spec.runCmdExecutable)) == 'E')
-      toJailPath(getElfDependencies(spec.runCmdExecutable, jailPath), except);
+  // the parts of the base that are pruned
+  bool hasPkgs = !spec.pkgInstall.empty() || !spec.pkgAdd.empty();
+  std::vector<Prune::Part> parts = prunedBaseParts;
+  if (hasPkgs) {
+    parts.push_back({"/var/cache/pkg", false});
+    parts.push_back({"/var/db/pkg", false});
   }
+  bool removeStaticLibs = !spec.optionExists("no-rm-static-libs");
+
+  // the access trace: what the programs of the crate use, /usr/local is pruned down to it
+  std::set<std::string> accessed;
+  if (!args.createAccessTrace.empty()) {
+    unsigned numIgnored;
+    accessed = Trace::keepSet(Trace::load(args.createAccessTrace), numIgnored);
+    LOG("the access trace has " << accessed.size() << " paths, " << numIgnored << " relative paths are ignored")
+    parts.push_back({prefix, true});
+  }
+
+  // the patterns of the spec: anywhere in the tree, the kept ones win
+  auto removeGlobs = spec.baseRemove + spec.pruneRemove;
+  auto keepGlobs = spec.baseKeepWildcard + spec.pruneKeep;
+
+  // one traversal of the jail finds the ELF files of the packages, the keep pattern matches, and what is removed
+  auto traversal = Prune::traverse(jailPath, parts, removeGlobs, removeStaticLibs, hasPkgs && accessed.empty() ? prefix : "", keepGlobs);
+  LOG("the jail directory has been traversed: " << traversal.str())
+
+  // form the 'except' set: the paths that are kept in the pruned parts and patterns, relative to jailPath
+  PathSet except;
+  createCacheDirectoryIfNeeded();
+  Elf::DynamicCache elfCache(STR(Locations::cacheDirectoryPath << "/elf-dynamic")); // the same binaries are analyzed by every create
+  Elf::Resolver resolver(jailPath, &elfCache); // finds the libraries that ldd(1) would find in the jail, without running it
+  auto keepFile = [&except,&resolver,addAll](const std::string &file) { // any file, not just ELF
+    except.insert(file);
+    addAll(resolver.dependencies(file), except);
+  };
+  if (!spec.runCmdExecutable.empty())
+    keepFile(spec.runCmdExecutable);
   for (auto &file : spec.baseKeep)
     keepFile(file);
-  for (auto &fileWildcard : spec.baseKeepWildcard)
-    for (auto &file : Util::Fs::expandWildcards(fileWildcard, Cmd::chroot(jailPath)))
-      keepFile(file);
-  if (!spec.runServices.empty()) {
-    keepFile("/usr/sbin/service");  // needed to run a service
-    keepFile("/bin/cat");           // based on ktrace of 'service {name} start'
-    keepFile("/bin/chmod");         // --"--
-    keepFile("/usr/bin/env");       // --"--
-    keepFile("/bin/kenv");          // --"--
-    keepFile("/bin/mkdir");         // --"--
-    keepFile("/usr/bin/touch");     // --"--
-    keepFile("/usr/bin/procstat");  // --"--
-    keepFile("/usr/bin/grep");      // ?? needed?
-    keepFile("/sbin/sysctl");       // ??
-    keepFile("/usr/bin/limits");    // ??
-    keepFile("/usr/bin/sed");       // needed for /etc/rc.d/netif restart
-    keepFile("/bin/kenv");          // needed for /etc/rc.d/netif restart
-    keepFile("/usr/sbin/daemon");   // services are often run with daemon(8)
-    if (spec.runCmdExecutable.empty())
-      keepFile("/bin/sleep");       // our idle script runs
-  }
-  //keepFile("/sbin/rcorder");        // needed for /etc/rc
-  //keepFile("/usr/sbin/ip6addrctl"); // needed for /etc/rc
-  //keepFile("/usr/sbin/syslogd");    // needed for /etc/rc
-  //keepFile("/usr/bin/mktemp");      // needed for /etc/rc
-  //keepFile("/sbin/mdmfs");          // needed for /etc/rc
-  //keepFile("/bin/chmod");           // needed for /etc/rc
-  //keepFile("/usr/bin/find");        // needed for /etc/rc
-  //keepFile("/bin/mkdir");           // needed for /etc/rc
-  //keepFile("/usr/sbin/utx");        // needed for /etc/rc
-  //keepFile("/usr/bin/uname");       // needed for /etc/rc
-  //keepFile("/usr/bin/cmp");         // needed for /etc/rc
-  //keepFile("/bin/cp");              // needed for /etc/rc
-  //keepFile("/bin/chmod");           // needed for /etc/rc
-  //keepFile("/bin/rm");              // needed for /etc/rc
-  //keepFile("/bin/rmdir");           // needed for /etc/rc
-  keepFile("/sbin/sysctl");         // needed for /etc/rc.shutdown
-  if (spec.optionExists("net")) {
-    keepFile("/sbin/ifconfig");       // needed to set up interfaces
-    keepFile("/sbin/route");          // needed to set the default route
-    keepFile("/sbin/ipfw");           // needed to set firewall rules
-    keepFile("/usr/sbin/service");    // ??? needed for "net"-enabled crates to start the service ???
-    keepFile("/sbin/kldstat");        // ??? needed for "net"-enabled crates to start the service ???
-    keepFile("/sbin/kldload");        // ??? needed for "net"-enabled crates to start the service ???
+  for (auto &file : traversal.wildcardMatches)
+    keepFile(STR("/" << file));
+  // what crate itself runs in the jail, whether or not there is an access trace
+  for (auto &program : jailRunPrograms(spec))
+    keepFile(program);
+
+  // what the programs of the crate use: as the access trace has recorded it, or as it is guessed
+  if (!accessed.empty()) {
+    unsigned numKept = 0;
+    for (auto &path : accessed) {
+      auto &real = resolver.realPath(path);
+      if (real.empty() || Fs::dirExists(STR(jailPath << real)))
+        continue; // gone since it was traced, or a directory, which would be kept whole
+      keepFile(path);
+      except.insert(real); // the file that a symlink leads to is accessed too
+      numKept++;
+    }
+    except.insert(STR(prefix << "/etc")); // the configuration of the packages is small, and is often read only in situations that the trace doesn't cover
+    LOG(numKept << " files of the access trace are kept")
+  } else {
+    if (!spec.runServices.empty()) {
+      keepFile("/bin/cat");           // based on ktrace of 'service {name} start'
+      keepFile("/bin/chmod");         // --"--
+      keepFile("/usr/bin/env");       // --"--
+      keepFile("/bin/kenv");          // --"--
+      keepFile("/bin/mkdir");         // --"--
+      keepFile("/usr/bin/touch");     // --"--
+      keepFile("/usr/bin/procstat");  // --"--
+      keepFile("/usr/bin/grep");      // ?? needed?
+      keepFile("/sbin/sysctl");       // ??
+      keepFile("/usr/bin/limits");    // ??
+      keepFile("/usr/bin/sed");       // needed for /etc/rc.d/netif restart
+      keepFile("/bin/kenv");          // needed for /etc/rc.d/netif restart
+      keepFile("/usr/sbin/daemon");   // services are often run with daemon(8)
+    }
+    //keepFile("/sbin/rcorder");        // needed for /etc/rc
+    //keepFile("/usr/sbin/ip6addrctl"); // needed for /etc/rc
+    //keepFile("/usr/sbin/syslogd");    // needed for /etc/rc
+    //keepFile("/usr/bin/mktemp");      // needed for /etc/rc
+    //keepFile("/sbin/mdmfs");          // needed for /etc/rc
+    //keepFile("/bin/chmod");           // needed for /etc/rc
+    //keepFile("/usr/bin/find");        // needed for /etc/rc
+    //keepFile("/bin/mkdir");           // needed for /etc/rc
+    //keepFile("/usr/sbin/utx");        // needed for /etc/rc
+    //keepFile("/usr/bin/uname");       // needed for /etc/rc
+    //keepFile("/usr/bin/cmp");         // needed for /etc/rc
+    //keepFile("/bin/cp");              // needed for /etc/rc
+    //keepFile("/bin/chmod");           // needed for /etc/rc
+    //keepFile("/bin/rm");              // needed for /etc/rc
+    //keepFile("/bin/rmdir");           // needed for /etc/rc
   }
-  keepFile("/bin/sleep");           // needed for /etc/rc.shutdown
-  keepFile("/bin/date");            // needed for /etc/rc.shutdown
-  keepFile("/bin/sh"); // (1) allow to create a user in jail, the user has to have the default shell (2) needed to run scrips when they are specified
-  keepFile("/usr/bin/env"); // allow to pass environment to jail
-  keepFile("/usr/sbin/pw"); // allow to add users in jail
-  keepFile("/usr/sbin/pwd_mkdb"); // allow to add users in jail
-  keepFile("/usr/libexec/ld-elf.so.1"); // needed to run elf executables
-
-  if (!spec.pkgInstall.empty() || !spec.pkgAdd.empty())
-    for (auto &e : Fs::findElfFiles(J(prefix)))
-      toJailPath(getElfDependencies(fromJailPath(e), jailPath, [isBasePath](const std::string &path) {return isBasePath(path);}), except);
-
-  // remove items
-  Fs::rmdirFlatExcept(J("/bin"), except);
-  Fs::rmdirHier(J("/boot"));
-  Fs::rmdirHier(J("/etc/periodic"));
-  Fs::unlink(J("/usr/lib/include"));
-  Fs::rmdirHierExcept(J("/lib"), except);
-  Fs::rmdirHierExcept(J("/usr/lib"), except);
-  Fs::rmdirHier(J("/usr/lib32"));
-  Fs::rmdirHier(J("/usr/include"));
-  Fs::rmdirHierExcept(J("/sbin"), except);
-  Fs::rmdirHierExcept(J("/usr/bin"), except);
-  Fs::rmdirHierExcept(J("/usr/sbin"), except);
-  Fs::rmdirHierExcept(J("/usr/libexec"), except);
-  Fs::rmdirHier(J("/usr/share/dtrace"));
-  Fs::rmdirHier(J("/usr/share/doc"));
-  Fs::rmdirHier(J("/usr/share/examples"));
-  Fs::rmdirHier(J("/usr/share/bsdconfig"));
-  Fs::rmdirHier(J("/usr/share/games"));
-  Fs::rmdirHier(J("/usr/share/i18n"));
-  Fs::rmdirHier(J("/usr/share/man"));
-  Fs::rmdirHier(J("/usr/share/misc"));
-  Fs::rmdirHier(J("/usr/share/pc-sysinstall"));
-  Fs::rmdirHier(J("/usr/share/openssl"));
-  Fs::rmdirHier(J("/usr/tests"));
-  Fs::rmdir    (J("/usr/src"));
-  Fs::rmdir    (J("/usr/obj"));
-  Fs::rmdirHier(J("/var/db/etcupdate"));
-  Fs::rmdirFlat(J("/rescue"));
-  if (!spec.pkgInstall.empty() || !spec.pkgAdd.empty()) {
-    Fs::rmdirFlat(J("/var/cache/pkg"));
-    Fs::rmdirFlat(J("/var/db/pkg"));
+
+  for (auto &e : traversal.elfFiles) // their libraries in /usr/local too, which the patterns might match
+    addAll(resolver.dependencies(STR("/" << e)), except);
+  elfCache.save();
+  LOG("ELF dependencies are resolved: " << except.size() << " files are kept, the ELF cache stats: " << elfCache.stats.str())
+
+  // additive: link what is kept into a fresh tree that replaces the jail directory, the build tree is discarded as a whole
+  if (args.createAdditive) {
+    auto keptPath = STR(jailPath << "-kept");
+    bool swapped = false;
+    RunAtEnd removeKept([&keptPath,&swapped]() {
+      if (!swapped && Fs::dirExists(keptPath))
+        Fs::rmdirHier(keptPath);
+    });
+    auto stats = Prune::materialize(jailPath, keptPath, parts, removeGlobs, except, removeStaticLibs);
+    LOG("the kept files have been linked into a fresh tree: " << stats.str())
+    auto buildPath = STR(jailPath << "-build");
+    if (::rename(jailPath.c_str(), buildPath.c_str()) == -1)
+      ERR("failed to move the build tree away: " << strerror(errno))
+    if (::rename(keptPath.c_str(), jailPath.c_str()) == -1) {
+      auto err = STR("failed to replace the jail directory with the pruned tree: " << strerror(errno));
+      (void)::rename(buildPath.c_str(), jailPath.c_str());
+      ERR(err)
+    }
+    swapped = true;
+    return buildPath;
   }
 
-  // remove static libs if not requested to keep them
-  if (!spec.optionExists("no-rm-static-libs"))
-    Util::runCommand(STR("find " << jailPath << " -name '*.a' | xargs rm"), "remove static libs");
+  // subtractive: remove what the traversal has found
+  for (auto &stats : Prune::remove(jailPath, traversal, except))
+    LOG("pruned " << stats.str())
+
+  return "";
 }
 
 //
@@ -276,13 +360,6 @@ bool createCrate(const Args &args, const Spec &spec) {
   // output crate file name
   auto crateFileName = !args.createOutput.empty() ? args.createOutput : STR(guessCrateName(spec) << ".crate");
 
-  // download the base archive if not yet
-  if (!Util::Fs::fileExists(Locations::baseArchive)) {
-    std::cout << "downloading base.txz from " << Locations::baseArchiveUrl << " ..." << std::endl;
-    Util::runCommand(STR("fetch -o " << Locations::baseArchive << " " << Locations::baseArchiveUrl), "download base.txz");
-    std::cout << "base.txz has finished downloading" << std::endl;
-  }
-
   // create the jail directory
   auto jailPath = STR(Locations::jailDirectoryPath << "/chroot-create-" << Util::filePathToBareName(crateFileName) << "-pid" << ::getpid());
   res = mkdir(jailPath.c_str(), S_IRUSR|S_IWUSR|S_IXUSR);
@@ -302,43 +379,106 @@ bool createCrate(const Args &args, const Spec &spec) {
     Util::Fs::rmdirHier(jailPath);
   });
 
-  // unpack the base archive
-  LOG("unpacking the base archive")
-  Util::runCommand(STR("cat " << Locations::baseArchive
-                       << " | " << Cmd::xz << " --decompress | tar -xf - --uname \"\" --gname \"\" -C " << jailPath),
-                   "unpack the system base into the jail directory");
-  runScript("create:start");
+  // find the pristine base tree, base.txz is only unpacked when the cache doesn't have its tree yet
+  std::string baseKey;
+  {
+    Extract::Stats stats;
+    if (!Util::Fs::fileExists(Locations::baseArchive)) {
+      // download base.txz and unpack it as it arrives
+      std::cout << "downloading base.txz from " << Locations::baseArchiveUrl << " ..." << std::endl;
+      Download::Stats downloadStats;
+      baseKey = Cache::downloadBase(Locations::baseArchiveUrl, Locations::baseArchive, stats, downloadStats);
+      std::cout << "base.txz has finished downloading" << std::endl;
+      LOG("base.txz has been downloaded: " << downloadStats.str())
+      LOG("base.txz has been unpacked into the cache while downloading: " << stats.str())
+    } else {
+      baseKey = Cache::baseKey(Locations::baseArchive);
+      if (Cache::extractBase(Locations::baseArchive, baseKey, stats))
+        LOG("base.txz has been unpacked into the cache: " << stats.str())
+    }
+  }
+
+  // the tree with the packages installed is cached, keyed by what determines it: pkg(8) is skipped when it is there
+  std::string packagesKey;
+  if (!args.createNoCache && (!spec.pkgInstall.empty() || !spec.pkgAdd.empty())) {
+    auto catalogVersion = pkgCatalogVersion(Cache::basePath(baseKey));
+    if (!catalogVersion.empty())
+      packagesKey = Cache::packagesKey(baseKey, packagesDescription(spec, catalogVersion));
+    else
+      LOG("the version of the package catalog is unknown, the packages aren't cached")
+  }
+  bool packagesCached = !packagesKey.empty() && Cache::hasPackages(packagesKey);
+
+  // files hardlinked from the cache share their inodes with it: they are only hardlinked when nothing runs in the jail
+  // as root that could write to them in place (create scripts, install scripts of packages), or when asked to
+  bool runsInJail = !spec.pkgInstall.empty() || !spec.pkgAdd.empty()
+                    || spec.scripts.find("create:start") != spec.scripts.end() || spec.scripts.find("create:end") != spec.scripts.end();
+  auto &writable = args.createLinkCache || !runsInJail ? baseWritablePaths : Cache::allWritable;
+
+  // clone the base tree, or the cached tree with the packages installed
+  if (packagesCached) {
+    LOG("cloning the cached tree with the packages installed")
+    auto stats = Cache::clonePackages(packagesKey, jailPath, writable);
+    LOG("done cloning the tree with the packages installed: " << stats.str())
+  } else {
+    LOG("cloning the base tree")
+    auto stats = Cache::cloneBase(baseKey, jailPath, writable);
+    LOG("done cloning the base tree: " << stats.str())
+    runScript("create:start"); // with cached packages its effect is already in the tree
+  }
 
   // copy /etc/resolv.conf into the jail directory such that pkg would be able to resolve addresses
   Util::Fs::copyFile("/etc/resolv.conf", STR(jailPath << "/etc/resolv.conf"));
 
-  // mount devfs
-  LOG("mounting devfs in jail")
-  Mount mountDevfs("devfs", STR(jailPath << "/dev"), "");
-  mountDevfs.mount();
-
-  // mount the pkg cache
-  LOG("mounting pkg cache and as nullfs in jail")
-  Util::Fs::mkdir(STR(jailPath << "/var/cache/pkg"), 0755);
-  Mount mountPkgCache("nullfs", STR(jailPath << "/var/cache/pkg"), "/var/cache/pkg");
-  mountPkgCache.mount();
-
-  // install packages into the jail, if needed
-  if (!spec.pkgInstall.empty() || !spec.pkgAdd.empty()) {
-    LOG("installing packages ...")
-    installAndAddPackagesInJail(jailPath, spec.pkgInstall, spec.pkgAdd, spec.pkgLocalOverride, spec.pkgNuke);
-    LOG("done installing packages")
-  }
+  if (!packagesCached) {
+    // mount devfs
+    LOG("mounting devfs in jail")
+    Mount mountDevfs("devfs", STR(jailPath << "/dev"), "");
+    mountDevfs.mount();
+
+    // mount the pkg cache
+    LOG("mounting pkg cache and as nullfs in jail")
+    Util::Fs::mkdir(STR(jailPath << "/var/cache/pkg"), 0755);
+    Mount mountPkgCache("nullfs", STR(jailPath << "/var/cache/pkg"), "/var/cache/pkg");
+    mountPkgCache.mount();
+
+    // install packages into the jail, if needed
+    if (!spec.pkgInstall.empty() || !spec.pkgAdd.empty()) {
+      LOG("installing packages ...")
+      installAndAddPackagesInJail(jailPath, spec.pkgInstall, spec.pkgAdd, spec.pkgLocalOverride, spec.pkgNuke);
+      LOG("done installing packages")
+    }
 
-  // unmount
-  LOG("unmounting devfs in jail")
-  mountDevfs.unmount();
-  LOG("unmounting pkg cache in jail")
-  mountPkgCache.unmount();
+    // unmount
+    LOG("unmounting devfs in jail")
+    mountDevfs.unmount();
+    LOG("unmounting pkg cache in jail")
+    mountPkgCache.unmount();
+
+    // store the tree with the packages installed
+    if (!packagesKey.empty()) {
+      Extract::Stats stats;
+      if (Cache::storePackages(packagesKey, jailPath, writable, stats))
+        LOG("the tree with the packages installed has been stored in the cache: " << stats.str())
+    }
+  }
 
   // remove parts that aren't needed
   LOG("removing unnecessary parts")
-  removeRedundantJailParts(jailPath, spec);
+  std::thread discardBuildTree;
+  RunAtEnd joinDiscardBuildTree([&discardBuildTree]() {
+    if (discardBuildTree.joinable())
+      discardBuildTree.join();
+  });
+  auto buildPath = removeRedundantJailParts(args, jailPath, spec);
+  if (!buildPath.empty()) // removed while the crate is packed
+    discardBuildTree = std::thread([buildPath]() {
+      try {
+        Util::Fs::rmdirHier(buildPath);
+      } catch (const std::exception &e) {
+        WARN("failed to remove the build tree '" << buildPath << "': " << e.what())
+      }
+    });
 
   // remove /etc/resolv.conf in the jail directory
   Util::Fs::unlink(STR(jailPath << "/etc/resolv.conf"));
@@ -351,8 +491,18 @@ bool createCrate(const Args &args, const Spec &spec) {
   runScript("create:end");
 
   // pack the jail into a .crate file
-  LOG("creating the crate file " << crateFileName)
-  Util::runCommand(STR("tar cf - -C " << jailPath << " . | " << Cmd::xz << " --extreme > " << crateFileName), "compress the jail directory into the crate file");
+  LOG("creating the crate file " << crateFileName << " (" << args.createCompression << " compression)")
+  {
+    Codec::Type codec;
+    (void)Codec::typeFromName(args.createCompression, codec); // validated in Args::validate
+    auto blockSize = args.createBlockSize != 0 ? args.createBlockSize : args.createThin ? 0x40000 : 0x800000;
+    Archive::Writer writer(crateFileName, codec, args.createCompressionLevel, blockSize, args.createThin);
+    auto stats = Pack::directory(jailPath, true/*withManifest*/, [&writer](const uint8_t *data, size_t size) {
+      writer.write(data, size);
+    });
+    writer.finish();
+    LOG("done packing the jail directory: " << stats.str())
+  }
   Util::Fs::chown(crateFileName, myuid, mygid);
 
   // remove the create directory
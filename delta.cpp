@@ -0,0 +1,436 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "delta.h"
+#include "archive.h"
+#include "manifest.h"
+#include "codec.h"
+#include "tar.h"
+#include "threads.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <sha256.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include <iomanip>
+
+#define ERR(msg...) ERR2("crate delta", msg)
+
+namespace Delta {
+
+//
+// helpers
+//
+
+static const uint8_t magic[8] = {'C', 'R', 'A', 'T', 'E', 'D', 'L', 'T'};
+static const uint8_t version = 1;
+static const size_t  headerSize = sizeof(magic) + 1 + 8; // magic, version, body size
+
+static void put(std::vector<uint8_t> &buf, uint64_t val, unsigned bytes) {
+  for (unsigned i = 0; i < bytes; i++)
+    buf.push_back((val >> 8*i) & 0xff);
+}
+
+static void put(std::vector<uint8_t> &buf, const std::string &str) {
+  put(buf, str.size(), 2);
+  buf.insert(buf.end(), str.begin(), str.end());
+}
+
+class Parser {
+  const uint8_t *data;
+  size_t         size;
+  size_t         pos = 0;
+public:
+  Parser(const uint8_t *newData, size_t newSize) : data(newData), size(newSize) { }
+  uint64_t get(unsigned bytes) {
+    const uint8_t *p = get(bytes, true);
+    uint64_t val = 0;
+    for (unsigned i = 0; i < bytes; i++)
+      val |= uint64_t(p[i]) << 8*i;
+    return val;
+  }
+  const uint8_t* get(size_t bytes, bool) {
+    if (bytes > size - pos)
+      ERR("the delta is truncated")
+    pos += bytes;
+    return data + pos - bytes;
+  }
+  std::string getString() {
+    auto len = get(2);
+    return std::string((const char*)get(len, true), len);
+  }
+  bool atEnd() const {
+    return pos == size;
+  }
+};
+
+static void readStream(const std::string &crateFile, const Codec::FnData &fnData) { // the tar stream of a crate of either format
+  if (Archive::isCrateArchive(crateFile.c_str()))
+    Archive::Reader(crateFile).readAll(fnData);
+  else
+    Codec::decompressFile(crateFile, fnData);
+}
+
+static std::string dataHash(const uint8_t *data, size_t size) {
+  uint8_t hash[32];
+  Util::sha256(data, size, hash);
+  return std::string((const char*)hash, sizeof(hash));
+}
+
+class Tree : public Tar::Reader::Handler { // regular files of a crate by path and by content
+public:
+  class File {
+  public:
+    std::string          hash; // SHA256 of the data
+    std::vector<uint8_t> data; // only of the files that were asked to be kept
+  };
+  typedef std::function<bool(const std::string &path, const std::string &hash)> FnKeep;
+
+  std::map<std::string, File>        files;
+  std::map<std::string, std::string> paths;      // hash -> the first path with such data
+  std::string                        streamHash; // SHA256 of the whole tar stream
+
+  void load(const std::string &crateFile, const FnKeep &newFnKeep) {
+    fnKeep = newFnKeep;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    Tar::Reader reader(*this);
+    readStream(crateFile, [&ctx,&reader](const uint8_t *data, size_t size) {
+      SHA256_Update(&ctx, data, size);
+      reader.feed(data, size);
+    });
+    reader.finish();
+    uint8_t hash[32];
+    SHA256_Final(hash, &ctx);
+    streamHash = std::string((const char*)hash, sizeof(hash));
+  }
+
+private:
+  FnKeep               fnKeep;
+  bool                 inFile = false;
+  std::string          path;
+  std::vector<uint8_t> data;
+
+  void onEntry(const Tar::Entry &entry) override {
+    inFile = entry.type == '0';
+    path = entry.path;
+    data.clear();
+  }
+  void onData(const uint8_t *d, size_t size) override {
+    if (inFile)
+      data.insert(data.end(), d, d + size);
+  }
+  void onEntryEnd() override {
+    if (!inFile)
+      return;
+    auto &f = files[path];
+    f.hash = dataHash(data.data(), data.size());
+    f.data.clear();
+    if (fnKeep(path, f.hash))
+      f.data.swap(data);
+    paths.emplace(f.hash, path);
+    inFile = false;
+  }
+};
+
+class Splitter : public Tar::Reader::Handler { // cuts the tar stream into the data of regular files and everything else, byte for byte
+public:
+  typedef std::function<void(const uint8_t *data, size_t size)> FnLiteral;
+  typedef std::function<void(const std::string &path, const uint8_t *data, size_t size)> FnFile;
+
+  Splitter(const FnLiteral &newFnLiteral, const FnFile &newFnFile) : reader(*this), fnLiteral(newFnLiteral), fnFile(newFnFile) { }
+
+  void feed(const uint8_t *data, size_t size) {
+    pending.erase(pending.begin(), pending.begin() + consumed);
+    pendingOffset += consumed;
+    consumed = 0;
+    pending.insert(pending.end(), data, data + size);
+    reader.feed(data, size);
+  }
+  void finish() {
+    reader.finish();
+    fnLiteral(pending.data() + consumed, pending.size() - consumed); // the end-of-archive marker and whatever follows it
+  }
+
+private:
+  Tar::Reader          reader;
+  FnLiteral            fnLiteral;
+  FnFile               fnFile;
+  std::vector<uint8_t> pending;           // the stream from pendingOffset on
+  uint64_t             pendingOffset = 0;
+  size_t               consumed = 0;      // bytes of pending that were already delivered
+  std::string          path;
+  uint64_t             dataOffset = 0;
+  uint64_t             dataSize = 0;      // of the current entry when it is a regular file
+
+  void onEntry(const Tar::Entry &entry) override {
+    path = entry.path;
+    dataOffset = reader.streamOffset();
+    dataSize = entry.type == '0' && entry.sparse.empty() ? entry.size : 0; // the stored data of sparse files isn't the file, it stays in the literal
+  }
+  void onData(const uint8_t *data, size_t size) override {
+    // the data is still in pending
+  }
+  void onEntryEnd() override {
+    if (dataSize == 0)
+      return; // its header stays in the literal
+    size_t begin = dataOffset - pendingOffset;
+    fnLiteral(pending.data() + consumed, begin - consumed);
+    fnFile(path, pending.data() + begin, dataSize);
+    consumed = begin + dataSize;
+  }
+};
+
+class Op {
+public:
+  char                 type;      // 'L' literal, 'C' copy of the old file, 'D' patch of the old file
+  std::string          oldPath;
+  uint64_t             size = 0;  // of the new data
+  std::vector<uint8_t> data;      // literal data or the patch
+  bool                 patched = false; // set by the pool task of 'D': otherwise the data is the new file, and it is stored as 'L'
+};
+
+//
+// interface
+//
+
+std::string Stats::str() const {
+  return STR(numFiles << " files: " << numCopied << " unchanged, " << numPatched << " patched, " << (numFiles - numCopied - numPatched) << " stored;"
+             << " the delta is " << std::fixed << std::setprecision(1) << deltaSize/1e6 << " MB for the " << crateSize/1e6 << " MB crate");
+}
+
+Stats create(const std::string &oldCrateFile, const std::string &newCrateFile, const std::string &deltaFile) {
+  if (!Archive::isCrateArchive(newCrateFile.c_str()))
+    ERR("the crate '" << newCrateFile << "' isn't seekable, only seekable crates can be reproduced exactly")
+  Archive::Reader newArchive(newCrateFile);
+  Stats stats;
+
+  // hashes of the new files tell which old files are worth keeping for patches
+  std::map<std::string, std::string> newHashes;
+  Manifest manifest;
+  if (Manifest::read(newArchive, manifest)) {
+    for (auto &e : manifest.entries)
+      if (e.type == '0')
+        newHashes[e.path] = std::string((const char*)e.hash, sizeof(e.hash));
+    newHashes[Manifest::fileName] = ""; // it isn't in itself, and it has always changed
+  } else {
+    Tree newTree;
+    newTree.load(newCrateFile, [](const std::string &path, const std::string &hash) {return false;});
+    for (auto &f : newTree.files)
+      newHashes[f.first] = f.second.hash;
+  }
+
+  Tree oldTree;
+  oldTree.load(oldCrateFile, [&newHashes](const std::string &path, const std::string &hash) {
+    auto it = newHashes.find(path);
+    return it != newHashes.end() && it->second != hash;
+  });
+
+  // split the new stream into operations, patches are computed in parallel
+  std::vector<std::unique_ptr<Op>> ops;
+  auto literal = [&ops](const uint8_t *data, size_t size) {
+    if (size == 0)
+      return;
+    if (ops.empty() || ops.back()->type != 'L') {
+      ops.emplace_back(new Op);
+      ops.back()->type = 'L';
+    }
+    auto &op = *ops.back();
+    op.data.insert(op.data.end(), data, data + size);
+    op.size += size;
+  };
+  {
+    ThreadPool pool;
+    Splitter splitter(literal, [&](const std::string &path, const uint8_t *data, size_t size) {
+      stats.numFiles++;
+      auto hash = dataHash(data, size);
+      auto it = oldTree.files.find(path);
+      if (it != oldTree.files.end() && it->second.hash == hash) {
+        ops.emplace_back(new Op{'C', path, size, {}});
+      } else if (oldTree.paths.find(hash) != oldTree.paths.end()) {
+        ops.emplace_back(new Op{'C', oldTree.paths[hash], size, {}}); // moved or duplicated
+      } else if (it != oldTree.files.end() && !it->second.data.empty()) {
+        ops.emplace_back(new Op{'D', path, size, std::vector<uint8_t>(data, data + size)});
+        pool.add([op = ops.back().get(), &old = it->second.data]() {
+          std::vector<uint8_t> patch;
+          Codec::diffBuffer(old.data(), old.size(), op->data.data(), op->data.size(), patch);
+          if (patch.size() < op->data.size()) { // otherwise the difference is bigger than the file
+            op->data.swap(patch);
+            op->patched = true;
+          } // the type isn't changed here: literal() reads the type of the last op while the pool runs
+        });
+      } else {
+        literal(data, size);
+      }
+    });
+    newArchive.readAll([&splitter](const uint8_t *data, size_t size) {
+      splitter.feed(data, size);
+    });
+    splitter.finish();
+    pool.wait();
+  }
+
+  // serialize
+  MappedFile crate(newCrateFile);
+  std::vector<uint8_t> body;
+  body.insert(body.end(), oldTree.streamHash.begin(), oldTree.streamHash.end());
+  put(body, newArchive.codec(), 1);
+  put(body, (uint8_t)(int8_t)newArchive.level(), 1);
+  put(body, newArchive.blockSize(), 4);
+  put(body, newArchive.chunked() ? 0x01 : 0x00, 1);
+  put(body, crate.size, 8);
+  auto crateHash = dataHash(crate.data, crate.size);
+  body.insert(body.end(), crateHash.begin(), crateHash.end());
+  put(body, ops.size(), 4);
+  for (auto &op : ops) {
+    char type = op->type == 'D' && !op->patched ? 'L' : op->type;
+    put(body, type, 1);
+    switch (type) {
+    case 'L':
+      put(body, op->data.size(), 8);
+      body.insert(body.end(), op->data.begin(), op->data.end());
+      break;
+    case 'C':
+      stats.numCopied++;
+      put(body, op->oldPath);
+      break;
+    case 'D':
+      stats.numPatched++;
+      put(body, op->oldPath);
+      put(body, op->size, 8);
+      put(body, op->data.size(), 8);
+      body.insert(body.end(), op->data.begin(), op->data.end());
+      break;
+    }
+  }
+
+  std::vector<uint8_t> out(magic, magic + sizeof(magic));
+  put(out, version, 1);
+  put(out, body.size(), 8);
+  std::vector<uint8_t> compressed;
+  Codec::compressBuffer(Codec::TypeZstd, Codec::LevelDefault, body.data(), body.size(), compressed);
+  out.insert(out.end(), compressed.begin(), compressed.end());
+  Util::Fs::writeFile(std::string(out.begin(), out.end()), deltaFile);
+
+  stats.crateSize = crate.size;
+  stats.deltaSize = out.size();
+  return stats;
+}
+
+void apply(const std::string &oldCrateFile, const std::string &deltaFile, const std::string &newCrateFile) {
+  // read the delta
+  std::vector<uint8_t> body;
+  {
+    MappedFile mf(deltaFile);
+    if (mf.size < headerSize || ::memcmp(mf.data, magic, sizeof(magic)) != 0)
+      ERR("'" << deltaFile << "' isn't a crate delta")
+    Parser p(mf.data + sizeof(magic), headerSize - sizeof(magic));
+    if (p.get(1) != version)
+      ERR("the delta '" << deltaFile << "' has an unsupported version")
+    auto bodySize = p.get(8);
+    Codec::decompressBuffer(Codec::TypeZstd, mf.data + headerSize, mf.size - headerSize, bodySize, body);
+  }
+  Parser p(body.data(), body.size());
+  std::string oldStreamHash((const char*)p.get(32, true), 32);
+  auto codec = (Codec::Type)p.get(1);
+  auto level = (int)(int8_t)p.get(1);
+  auto blockSize = (uint32_t)p.get(4);
+  auto flags = p.get(1);
+  auto crateSize = p.get(8);
+  std::string crateHash((const char*)p.get(32, true), 32);
+  if (codec != Codec::TypeNone && codec != Codec::TypeXz && codec != Codec::TypeZstd)
+    ERR("the delta '" << deltaFile << "' has an unknown compression type " << codec)
+
+  class DeltaOp {
+  public:
+    char           type;
+    std::string    oldPath;
+    uint64_t       size;
+    const uint8_t *data;
+    uint64_t       dataSize;
+  };
+  std::vector<DeltaOp> ops(p.get(4));
+  std::set<std::string> oldPaths;
+  for (auto &op : ops) {
+    op.type = (char)p.get(1);
+    switch (op.type) {
+    case 'L':
+      op.dataSize = op.size = p.get(8);
+      op.data = p.get(op.dataSize, true);
+      break;
+    case 'C':
+      op.oldPath = p.getString();
+      break;
+    case 'D':
+      op.oldPath = p.getString();
+      op.size = p.get(8);
+      op.dataSize = p.get(8);
+      op.data = p.get(op.dataSize, true);
+      break;
+    default:
+      ERR("the delta '" << deltaFile << "' has an unknown operation")
+    }
+    if (!op.oldPath.empty())
+      oldPaths.insert(op.oldPath);
+  }
+  if (!p.atEnd())
+    ERR("the delta '" << deltaFile << "' has trailing data")
+
+  // files of the old crate that the delta refers to
+  Tree oldTree;
+  oldTree.load(oldCrateFile, [&oldPaths](const std::string &path, const std::string &hash) {
+    return oldPaths.find(path) != oldPaths.end();
+  });
+  if (oldTree.streamHash != oldStreamHash)
+    ERR("the delta '" << deltaFile << "' was made against a different crate than '" << oldCrateFile << "'")
+  for (auto &path : oldPaths)
+    if (oldTree.files.find(path) == oldTree.files.end())
+      ERR("the file '" << path << "' isn't in the crate '" << oldCrateFile << "'")
+
+  // rebuild the crate
+  bool succeeded = false;
+  RunAtEnd removeOnFailure([&newCrateFile,&succeeded]() {
+    if (!succeeded)
+      (void)::unlink(newCrateFile.c_str());
+  });
+  {
+    Archive::Writer writer(newCrateFile, codec, level, blockSize, flags & 0x01);
+    runOrdered(ops.size(), [&](unsigned idx, std::vector<uint8_t> &item) {
+      auto &op = ops[idx];
+      if (op.type == 'D') {
+        auto &old = oldTree.files.at(op.oldPath).data;
+        Codec::patchBuffer(old.data(), old.size(), op.data, op.dataSize, op.size, item);
+      }
+    }, [&](unsigned idx, std::vector<uint8_t> &item) {
+      auto &op = ops[idx];
+      switch (op.type) {
+      case 'L':
+        writer.write(op.data, op.dataSize);
+        break;
+      case 'C': {
+        auto &old = oldTree.files.at(op.oldPath).data;
+        writer.write(old.data(), old.size());
+        break;
+      } case 'D':
+        writer.write(item.data(), item.size());
+        break;
+      }
+    });
+    writer.finish();
+  }
+
+  MappedFile crate(newCrateFile);
+  if (crate.size != crateSize || dataHash(crate.data, crate.size) != crateHash)
+    ERR("the patched crate differs from the original one, probably the compression library has a different version")
+  succeeded = true;
+}
+
+}
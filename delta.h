@@ -0,0 +1,38 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Delta: the difference between two versions of a crate, so that only the change has to be distributed
+//
+// The delta reproduces the tar stream of the new crate file by file: files that are in the old crate are copied from it,
+// changed files are zstd-compressed with the old file of the same path as the reference, everything else is stored.
+// The new crate is then compressed again with the codec, level and block layout that it was created with, and it is
+// verified to be byte-identical to the original.
+//
+// Layout: magic, version, uncompressed size of the body, zstd-compressed body:
+//   SHA256 of the old tar stream, codec, level, block size, flags, size and SHA256 of the new crate file,
+//   u32 number of operations, operations: 'L' u64 size, data | 'C' u16 length, old path | 'D' u16 length, old path, u64 size, u64 patch size, patch
+//
+
+#include <string>
+
+#include <stdint.h>
+
+namespace Delta {
+
+class Stats {
+public:
+  unsigned numFiles = 0;   // regular files of the new crate
+  unsigned numCopied = 0;  // found in the old crate as they are
+  unsigned numPatched = 0; // stored as the difference with the old file
+  uint64_t crateSize = 0;  // size of the new crate file
+  uint64_t deltaSize = 0;  // size of the delta file
+
+  std::string str() const;
+};
+
+Stats create(const std::string &oldCrateFile, const std::string &newCrateFile, const std::string &deltaFile); // the new crate has to be seekable
+void apply(const std::string &oldCrateFile, const std::string &deltaFile, const std::string &newCrateFile);
+
+}
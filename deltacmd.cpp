@@ -0,0 +1,42 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "args.h"
+#include "delta.h"
+#include "util.h"
+#include "err.h"
+#include "commands.h"
+
+#include <rang.hpp>
+
+#include <string>
+#include <iostream>
+
+#define LOG(msg...) \
+  { \
+    if (args.logProgress) \
+      std::cerr << rang::fg::gray << Util::tmSecMs() << ": " << msg << rang::style::reset << std::endl; \
+  }
+
+//
+// interface
+//
+
+bool deltaCrate(const Args &args) {
+  LOG("'delta' command is invoked")
+
+  auto stats = Delta::create(args.deltaOldCrateFile, args.deltaNewCrateFile, args.deltaOutput);
+  std::cout << "the delta has been written to " << args.deltaOutput << ": " << stats.str() << std::endl;
+
+  LOG("'delta' command has succeeded")
+  return true;
+}
+
+bool patchCrate(const Args &args) {
+  LOG("'patch' command is invoked")
+
+  Delta::apply(args.patchOldCrateFile, args.patchDeltaFile, args.patchOutput);
+  std::cout << "the crate has been written to " << args.patchOutput << std::endl;
+
+  LOG("'patch' command has succeeded")
+  return true;
+}
@@ -0,0 +1,493 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "download.h"
+#include "util.h"
+#include "err.h"
+
+#include <fetch.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <sha256.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#define ERR(msg...) ERR2("download", msg)
+
+namespace Download {
+
+//
+// helpers
+//
+
+static const size_t   pieceSize = 0x40000;   // the network is read in pieces of this size
+static const size_t   maxQueued = 256;       // pieces that the consumer can fall behind by: 64MB
+static const uint64_t chunkSize = 0x400000;  // the unit of range requests and of resuming
+static const unsigned maxConnections = 8;
+static const unsigned maxRetries = 5;        // of every chunk, with an exponential backoff
+
+static const char* lastError() {
+  return fetchLastErrString[0] != 0 ? fetchLastErrString : strerror(errno);
+}
+
+static void writeAll(int fd, const uint8_t *data, size_t size, const std::string &file) {
+  while (size > 0) {
+    auto res = ::write(fd, data, size);
+    if (res == -1)
+      ERR("failed to write the file '" << file << "': " << strerror(errno))
+    data += res;
+    size -= res;
+  }
+}
+
+static void pwriteAll(int fd, const uint8_t *data, size_t size, uint64_t offset, const std::string &file) {
+  while (size > 0) {
+    auto res = ::pwrite(fd, data, size, offset);
+    if (res == -1)
+      ERR("failed to write the file '" << file << "': " << strerror(errno))
+    data += res;
+    size -= res;
+    offset += res;
+  }
+}
+
+class Url { // parsed URL of fetch(3)
+  struct url *u;
+public:
+  Url(const std::string &url) : u(::fetchParseURL(url.c_str())) {
+    if (u == nullptr)
+      ERR("invalid URL '" << url << "': " << lastError())
+  }
+  ~Url() {
+    ::fetchFreeURL(u);
+  }
+  struct url* get() const {return u;}
+};
+
+static int64_t remoteSize(const std::string &url) { // -1 when the server doesn't tell
+  Url u(url);
+  struct url_stat us;
+  if (::fetchStat(u.get(), &us, "") == -1)
+    return -1;
+  return us.size;
+}
+
+static bool honorsRanges(const std::string &url, uint64_t offset) { // whether the server sends the data from offset when asked to
+  Url u(url);
+  u.get()->offset = offset;
+  FILE *f = ::fetchXGet(u.get(), nullptr, "");
+  if (f == nullptr)
+    ERR("failed to download '" << url << "' from offset " << offset << ": " << lastError())
+  (void)::fclose(f);
+  return (uint64_t)u.get()->offset == offset; // fetch(3) reports where the data really starts
+}
+
+class Queue { // bounded queue of pieces between the network thread and the consumer
+  std::mutex                       mutex;
+  std::condition_variable          cvPut;
+  std::condition_variable          cvGet;
+  std::deque<std::vector<uint8_t>> pieces;
+  bool                             finished = false;
+  bool                             cancelled = false;
+  std::exception_ptr               exception;
+
+public:
+  bool put(std::vector<uint8_t> &piece) { // returns false when the consumer has given up
+    std::unique_lock<std::mutex> lock(mutex);
+    cvPut.wait(lock, [this]() {return pieces.size() < maxQueued || cancelled;});
+    if (cancelled)
+      return false;
+    pieces.emplace_back(std::move(piece));
+    cvGet.notify_one();
+    return true;
+  }
+  bool get(std::vector<uint8_t> &piece) { // returns false at the end of data, rethrows errors of the producer
+    std::unique_lock<std::mutex> lock(mutex);
+    cvGet.wait(lock, [this]() {return !pieces.empty() || finished;});
+    if (!pieces.empty()) {
+      piece = std::move(pieces.front());
+      pieces.pop_front();
+      cvPut.notify_one();
+      return true;
+    }
+    if (exception)
+      std::rethrow_exception(exception);
+    return false;
+  }
+  void finish(std::exception_ptr e = nullptr) {
+    std::unique_lock<std::mutex> lock(mutex);
+    finished = true;
+    exception = e;
+    cvGet.notify_one();
+  }
+  void cancel() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cancelled = true;
+    cvPut.notify_one();
+  }
+};
+
+class State { // the sidecar file: the header identifies the download, then a line for every finished chunk
+  std::string file;
+  int         fd = -1;
+
+public:
+  std::vector<bool> done;
+
+  State(const std::string &newFile) : file(newFile) { }
+  ~State() {
+    if (fd != -1)
+      (void)::close(fd);
+  }
+
+  bool open(const std::string &url, uint64_t size, unsigned numChunks) { // returns true when the earlier download can be resumed
+    auto header = STR("url " << url << "\nsize " << size << "\nchunk " << chunkSize << "\n");
+    done.assign(numChunks, false);
+    fd = ::open(file.c_str(), O_RDWR|O_CREAT|O_APPEND, 0644);
+    if (fd == -1)
+      ERR("failed to open the file '" << file << "': " << strerror(errno))
+    auto lines = Util::Fs::readFileLines(fd); // lines keep their '\n'
+    bool resumed = lines.size() >= 3 && lines[0] + lines[1] + lines[2] == header;
+    if (resumed)
+      for (unsigned i = 3; i < lines.size(); i++) {
+        unsigned idx;
+        if (lines[i].back() == '\n' && ::sscanf(lines[i].c_str(), "done %u", &idx) == 1 && idx < numChunks)
+          done[idx] = true; // an incomplete last line is ignored
+      }
+
+    // rewrite it, so that new lines don't continue an incomplete one
+    std::ostringstream ss;
+    ss << header;
+    for (unsigned i = 0; i < numChunks; i++)
+      if (done[i])
+        ss << "done " << i << "\n";
+    if (::ftruncate(fd, 0) == -1)
+      ERR("failed to truncate the file '" << file << "': " << strerror(errno))
+    auto data = ss.str();
+    writeAll(fd, (const uint8_t*)data.data(), data.size(), file);
+    return resumed;
+  }
+  void markDone(unsigned idx) { // the chunk has to be on disk already
+    auto line = STR("done " << idx << "\n");
+    writeAll(fd, (const uint8_t*)line.data(), line.size(), file);
+  }
+};
+
+class RangedFetcher { // fetches chunks in parallel, the consumer waits for them in order
+  const std::string       &url;
+  const std::string       &partFile;
+  int                      fd;
+  uint64_t                 size;
+  State                   &state;
+  std::mutex               mutex;
+  std::condition_variable  cvDone;
+  unsigned                 nextChunk = 0;
+  bool                     stop = false;
+  std::exception_ptr       exception;
+  std::vector<std::thread> threads;
+
+public:
+  std::atomic<uint64_t>    numBytes{0};
+  std::atomic<unsigned>    numRetries{0};
+
+  RangedFetcher(const std::string &newUrl, const std::string &newPartFile, int newFd, uint64_t newSize, State &newState)
+  : url(newUrl), partFile(newPartFile), fd(newFd), size(newSize), state(newState)
+  { }
+  ~RangedFetcher() {
+    cancel();
+  }
+
+  unsigned start() {
+    auto numMissing = (unsigned)std::count(state.done.begin(), state.done.end(), false);
+    auto numThreads = std::min(maxConnections, numMissing);
+    for (unsigned t = 0; t < numThreads; t++)
+      threads.emplace_back([this]() {
+        worker();
+      });
+    return numThreads;
+  }
+  void waitFor(unsigned idx) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cvDone.wait(lock, [this,idx]() {return state.done[idx] || exception;});
+    if (!state.done[idx])
+      std::rethrow_exception(exception);
+  }
+  void cancel() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stop = true;
+    }
+    for (auto &t : threads)
+      t.join();
+    threads.clear();
+  }
+
+private:
+  bool stopped() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return stop || exception;
+  }
+  bool take(unsigned &idx) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (nextChunk < state.done.size() && state.done[nextChunk])
+      nextChunk++;
+    if (stop || exception || nextChunk == state.done.size())
+      return false;
+    idx = nextChunk++;
+    return true;
+  }
+  void worker() {
+    try {
+      unsigned idx;
+      while (take(idx)) {
+        if (!fetchChunk(idx))
+          return;
+        if (::fdatasync(fd) == -1) // before the state file says that the chunk is there
+          ERR("failed to write the file '" << partFile << "': " << strerror(errno))
+        std::unique_lock<std::mutex> lock(mutex);
+        state.markDone(idx);
+        state.done[idx] = true;
+        cvDone.notify_all();
+      }
+    } catch (...) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!exception)
+        exception = std::current_exception();
+      cvDone.notify_all();
+    }
+  }
+  bool fetchChunk(unsigned idx) { // returns false when stopped
+    uint64_t pos = idx*chunkSize, end = std::min(size, pos + chunkSize);
+    for (unsigned attempt = 0; ; attempt++) {
+      try {
+        return fetchRange(pos, end);
+      } catch (const Exception &e) {
+        if (attempt == maxRetries)
+          throw;
+        numRetries++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500 << attempt));
+        if (stopped())
+          return false;
+      }
+    }
+  }
+  bool fetchRange(uint64_t &pos, uint64_t end) { // continues from where the failed attempt has stopped
+    Url u(url);
+    u.get()->offset = pos;
+    FILE *f = ::fetchXGet(u.get(), nullptr, "");
+    if (f == nullptr)
+      ERR("failed to download '" << url << "' from offset " << pos << ": " << lastError())
+    RunAtEnd closeUrl([f]() {
+      (void)::fclose(f);
+    });
+    if ((uint64_t)u.get()->offset != pos) // fetch(3) reports where the data really starts
+      ERR("the server of '" << url << "' has ignored the range request from offset " << pos)
+    uint8_t buf[0x10000];
+    while (pos < end) {
+      if (stopped())
+        return false;
+      auto res = ::fread(buf, 1, std::min((uint64_t)sizeof(buf), end - pos), f);
+      if (res == 0)
+        ERR("failed to download '" << url << "' at offset " << pos << ": " << (::ferror(f) ? lastError() : "the connection was closed"))
+      pwriteAll(fd, buf, res, pos, partFile);
+      pos += res;
+      numBytes += res;
+    }
+    return true;
+  }
+};
+
+static void fetchRanged(const std::string &url, const std::string &partFile, uint64_t size, const Codec::FnData &fnData, Stats &stats) {
+  unsigned numChunks = (size + chunkSize - 1)/chunkSize;
+  State state(STR(partFile << ".state"));
+  bool resumed = state.open(url, size, numChunks);
+  int fd = ::open(partFile.c_str(), O_RDWR|O_CREAT|(resumed ? 0 : O_TRUNC), 0644);
+  if (fd == -1)
+    ERR("failed to open the file '" << partFile << "': " << strerror(errno))
+  RunAtEnd closeFd([fd]() {
+    (void)::close(fd);
+  });
+  if (::ftruncate(fd, size) == -1)
+    ERR("failed to allocate the file '" << partFile << "': " << strerror(errno))
+  for (unsigned i = 0; i < numChunks; i++)
+    if (state.done[i])
+      stats.numResumedBytes += std::min(size - i*chunkSize, chunkSize);
+
+  // the partial file is kept on failure, the next attempt continues it
+  RangedFetcher fetcher(url, partFile, fd, size, state);
+  stats.numConnections = fetcher.start();
+  std::vector<uint8_t> buf(chunkSize);
+  for (unsigned i = 0; i < numChunks; i++) {
+    fetcher.waitFor(i);
+    auto len = std::min(size - i*chunkSize, chunkSize);
+    for (uint64_t done = 0; done < len;) {
+      auto res = ::pread(fd, buf.data() + done, len - done, i*chunkSize + done);
+      if (res <= 0)
+        ERR("failed to read the file '" << partFile << "': " << (res == 0 ? "it is truncated" : strerror(errno)))
+      done += res;
+    }
+    fnData(buf.data(), len);
+  }
+  fetcher.cancel();
+  stats.numBytes = fetcher.numBytes;
+  stats.numRetries = fetcher.numRetries;
+}
+
+static void fetchSequential(const std::string &url, const std::string &partFile, const Codec::FnData &fnData, Stats &stats) {
+  FILE *f = ::fetchGetURL(url.c_str(), "");
+  if (f == nullptr)
+    ERR("failed to download '" << url << "': " << lastError())
+  RunAtEnd closeUrl([f]() {
+    (void)::fclose(f);
+  });
+
+  int fd = ::open(partFile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd == -1)
+    ERR("failed to create the file '" << partFile << "': " << strerror(errno))
+  RunAtEnd closeFd([fd]() {
+    (void)::close(fd);
+  });
+
+  // the network thread writes the file, and queues the same data for the consumer
+  Queue queue;
+  std::thread thread([f,fd,&partFile,&url,&queue]() {
+    try {
+      while (true) {
+        std::vector<uint8_t> piece(pieceSize);
+        auto res = ::fread(piece.data(), 1, piece.size(), f);
+        if (res == 0 && ::ferror(f))
+          ERR("failed to download '" << url << "': " << lastError())
+        if (res == 0)
+          break;
+        piece.resize(res);
+        writeAll(fd, piece.data(), piece.size(), partFile);
+        if (!queue.put(piece))
+          break;
+      }
+      queue.finish();
+    } catch (...) {
+      queue.finish(std::current_exception());
+    }
+  });
+  RunAtEnd joinThread([&queue,&thread]() {
+    queue.cancel(); // in case the consumer has failed
+    thread.join();
+  });
+
+  std::vector<uint8_t> piece;
+  while (queue.get(piece)) {
+    stats.numBytes += piece.size();
+    fnData(piece.data(), piece.size());
+  }
+  joinThread.doNow();
+  stats.numConnections = 1;
+
+  if (::fsync(fd) == -1)
+    ERR("failed to write the file '" << partFile << "': " << strerror(errno))
+}
+
+//
+// interface
+//
+
+std::string Stats::str() const {
+  auto secs = seconds > 0 ? seconds : 1e-6;
+  return STR(std::fixed << std::setprecision(1) << numBytes/1e6 << " MB in " << std::setprecision(3) << seconds << " sec: "
+             << std::setprecision(1) << numBytes/1e6/secs << " MB/s over " << numConnections << " connection(s), "
+             << numRetries << " retries, " << numResumedBytes/1e6 << " MB resumed");
+}
+
+std::string remoteVersion(const std::string &url) {
+  Url u(url);
+  struct url_stat us;
+  if (::fetchStat(u.get(), &us, "") == -1 || us.size < 0 || us.mtime <= 0)
+    return "";
+  return STR(us.size << "@" << us.mtime);
+}
+
+std::string publishedSha256(const std::string &url) {
+  auto slash = url.rfind('/');
+  if (slash == std::string::npos)
+    return "";
+  FILE *f = ::fetchGetURL(STR(url.substr(0, slash + 1) << "MANIFEST").c_str(), "");
+  if (f == nullptr)
+    return "";
+  RunAtEnd closeUrl([f]() {
+    (void)::fclose(f);
+  });
+
+  // lines are: file name, SHA256, number of files, distribution name, description, whether it is selected by default
+  char line[1024];
+  while (::fgets(line, sizeof(line), f) != nullptr) {
+    auto fields = Util::splitString(Util::stripTrailingSpace(line), "\t");
+    if (fields.size() >= 2 && fields[0] == url.substr(slash + 1) && fields[1].size() == 64)
+      return fields[1];
+  }
+  return "";
+}
+
+std::string toFile(const std::string &url, const std::string &file, const std::string &sha256,
+                   const Codec::FnData &fnData, const std::function<void()> &fnEnd, Stats &stats) {
+  auto tmStart = std::chrono::steady_clock::now();
+  auto partFile = STR(file << ".part");
+  auto stateFile = STR(partFile << ".state");
+  bool complete = false, keepPart = false;
+  RunAtEnd removePart([&partFile,&stateFile,&complete,&keepPart]() {
+    if (!complete && !keepPart) {
+      (void)::unlink(partFile.c_str());
+      (void)::unlink(stateFile.c_str());
+    }
+  });
+
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  auto consume = [&ctx,&fnData](const uint8_t *data, size_t size) {
+    SHA256_Update(&ctx, data, size);
+    fnData(data, size);
+  };
+  auto size = remoteSize(url);
+  if (size > (int64_t)chunkSize && !honorsRanges(url, chunkSize))
+    size = -1; // every range would be refused, and the consumer might have the first chunk already
+  if (size > 0) {
+    keepPart = true; // it can be resumed until it is known to be wrong
+    fetchRanged(url, partFile, size, consume, stats);
+  } else {
+    fetchSequential(url, partFile, consume, stats);
+  }
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+
+  uint8_t hash[32];
+  SHA256_Final(hash, &ctx);
+  auto hashHex = Util::toHex(hash, sizeof(hash));
+  if (sha256.empty())
+    WARN("the download of '" << url << "' isn't verified: there is no published SHA256 for it, its SHA256 is " << hashHex)
+  else if (hashHex != sha256) {
+    keepPart = false;
+    ERR("the SHA256 of '" << url << "' is " << hashHex << " instead of the published " << sha256)
+  }
+  keepPart = false; // the data is right, it is only rejected by the consumer
+  fnEnd();
+
+  if (::rename(partFile.c_str(), file.c_str()) == -1)
+    ERR("failed to rename '" << partFile << "' to '" << file << "': " << strerror(errno))
+  complete = true;
+  (void)::unlink(stateFile.c_str());
+  return hashHex;
+}
+
+}
@@ -0,0 +1,44 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Download: fetches files with fetch(3), and hands their data over for processing while the download goes on
+//
+// When the server reports the size and honors range requests, the file is fetched in chunks over several connections with range requests.
+// Chunks that failed are retried from where they stopped, and finished chunks are recorded in the sidecar state file
+// (<file>.part.state), so that an interrupted download resumes with the chunks that are still missing.
+// Otherwise the file is fetched over one connection, which is read on a separate thread that stays ahead of
+// the consumer by at most a bounded amount of data.
+// Either way the consumer gets the data in order, as soon as it is on disk.
+//
+
+#include "codec.h"
+
+#include <string>
+#include <functional>
+
+#include <stdint.h>
+
+namespace Download {
+
+class Stats {
+public:
+  uint64_t numBytes = 0;        // downloaded now
+  uint64_t numResumedBytes = 0; // downloaded by an earlier, interrupted run
+  unsigned numConnections = 0;
+  unsigned numRetries = 0;
+  double   seconds = 0;
+
+  std::string str() const;
+};
+
+std::string publishedSha256(const std::string &url); // the checksum of a FreeBSD distribution file from the MANIFEST next to it, empty when it isn't there
+std::string remoteVersion(const std::string &url);  // the size and the modification time that the server reports, empty when it doesn't
+
+// fnData runs on the calling thread, fnEnd runs after the last data: the file only appears when the download is complete,
+// its SHA256 matches sha256 (an empty sha256 is warned about as unverified), and fnEnd succeeds; returns the SHA256 of the file
+std::string toFile(const std::string &url, const std::string &file, const std::string &sha256,
+                   const Codec::FnData &fnData, const std::function<void()> &fnEnd, Stats &stats);
+
+}
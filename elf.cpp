@@ -0,0 +1,383 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "elf.h"
+#include "util.h"
+#include "err.h"
+
+#include <elf.h>
+#include <elf-hints.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <fstream>
+#include <sstream>
+
+#define ERR(msg...) ERR2("ELF dependencies", msg)
+
+namespace Elf {
+
+//
+// helpers
+//
+
+template<class Ehdr, class Phdr, class Dyn>
+static bool readDynamicT(const uint8_t *data, size_t size, Dynamic &dynamic) {
+  auto ehdr = (const Ehdr*)data;
+  if (size < sizeof(Ehdr) || ehdr->e_phentsize != sizeof(Phdr) || ehdr->e_phoff > size || ehdr->e_phnum > (size - ehdr->e_phoff)/sizeof(Phdr))
+    return false;
+  auto phdrs = (const Phdr*)(data + ehdr->e_phoff);
+
+  // maps virtual addresses to file offsets through the PT_LOAD segments
+  auto vaddrToOffset = [phdrs,ehdr](uint64_t vaddr, uint64_t &offset) {
+    for (unsigned i = 0; i < ehdr->e_phnum; i++)
+      if (phdrs[i].p_type == PT_LOAD && vaddr >= phdrs[i].p_vaddr && vaddr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+        offset = vaddr - phdrs[i].p_vaddr + phdrs[i].p_offset;
+        return true;
+      }
+    return false;
+  };
+
+  // find the dynamic segment
+  const Phdr *phDynamic = nullptr;
+  for (unsigned i = 0; i < ehdr->e_phnum; i++)
+    if (phdrs[i].p_type == PT_DYNAMIC)
+      phDynamic = &phdrs[i];
+  if (phDynamic == nullptr || phDynamic->p_offset > size || phDynamic->p_filesz > size - phDynamic->p_offset)
+    return false; // static executable
+  auto dyns = (const Dyn*)(data + phDynamic->p_offset);
+  auto numDyns = phDynamic->p_filesz/sizeof(Dyn);
+
+  // string table
+  uint64_t strtab = 0, strsz = 0;
+  for (unsigned i = 0; i < numDyns && dyns[i].d_tag != DT_NULL; i++)
+    if (dyns[i].d_tag == DT_STRTAB)
+      strtab = dyns[i].d_un.d_ptr;
+    else if (dyns[i].d_tag == DT_STRSZ)
+      strsz = dyns[i].d_un.d_val;
+  uint64_t strOffset;
+  if (!vaddrToOffset(strtab, strOffset) || strOffset > size || strsz > size - strOffset)
+    return false;
+  auto str = [data,strOffset,strsz](uint64_t idx) {
+    if (idx >= strsz)
+      return std::string();
+    auto s = (const char*)data + strOffset + idx;
+    return std::string(s, ::strnlen(s, strsz - idx));
+  };
+
+  // entries
+  for (unsigned i = 0; i < numDyns && dyns[i].d_tag != DT_NULL; i++)
+    switch (dyns[i].d_tag) {
+    case DT_NEEDED:
+      dynamic.needed.push_back(str(dyns[i].d_un.d_val));
+      break;
+    case DT_RPATH:
+      dynamic.rpath = str(dyns[i].d_un.d_val);
+      break;
+    case DT_RUNPATH:
+      dynamic.runpath = str(dyns[i].d_un.d_val);
+      break;
+    }
+
+  return true;
+}
+
+static std::string readHintsDirs(const std::string &file) { // the directory list of ld-elf.so.hints that ldconfig(8) writes
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd == -1)
+    return ""; // ld-elf.so.1 goes on without hints
+  RunAtEnd closeFd([fd]() {
+    (void)::close(fd);
+  });
+  struct elfhints_hdr hdr;
+  if (::pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != ELFHINTS_MAGIC || hdr.version != 1 || hdr.dirlist > hdr.strsize)
+    return ""; // ld-elf.so.1 ignores such hints too
+  std::string dirlist(hdr.dirlistlen, '\0');
+  if (::pread(fd, &dirlist[0], dirlist.size(), hdr.strtab + hdr.dirlist) != (ssize_t)dirlist.size())
+    return "";
+  return dirlist;
+}
+
+static std::string substituteOrigin(const std::string &path, const std::string &origin) {
+  std::string res = path;
+  for (auto var : {"${ORIGIN}", "$ORIGIN"})
+    for (auto pos = res.find(var); pos != std::string::npos; pos = res.find(var, pos + origin.size()))
+      res.replace(pos, ::strlen(var), origin);
+  return res;
+}
+
+static std::vector<std::string> splitTabs(const std::string &line) { // keeps empty fields, unlike Util::splitString
+  std::vector<std::string> fields;
+  std::istringstream is(line);
+  std::string field;
+  while (std::getline(is, field, '\t'))
+    fields.push_back(field);
+  return fields;
+}
+
+static unsigned today() {
+  return ::time(nullptr)/(24*3600);
+}
+
+//
+// DynamicCache
+//
+
+// lines are tab-separated:
+//   f <identity> <hash>
+//   e <hash> <last used day> <is dynamic> <is elf32> <rpath> <runpath> <needed>...
+static const char *cacheHeader = "crate ELF dynamic cache v2";
+static const unsigned cacheExpiryDays = 30;
+
+std::string DynamicCache::Stats::str() const {
+  return STR("{hits=" << numHits << " misses=" << numMisses << " hashed=" << numHashed << "}");
+}
+
+DynamicCache::DynamicCache(const std::string &newFile)
+: file(newFile)
+{
+  std::ifstream is(file);
+  std::string line;
+  if (!std::getline(is, line) || line != cacheHeader)
+    return; // no cache yet, or of another version
+  while (std::getline(is, line)) {
+    auto fields = splitTabs(line);
+    if (fields.size() == 3 && fields[0] == "f")
+      oldHashes[fields[1]] = fields[2];
+    else if (fields.size() >= 7 && fields[0] == "e") {
+      auto &entry = entries[fields[1]];
+      entry.lastUsedDay = ::strtoul(fields[2].c_str(), nullptr, 10);
+      entry.isDynamic = fields[3] == "1";
+      entry.dynamic.elf32 = fields[4] == "1";
+      entry.dynamic.rpath = fields[5];
+      entry.dynamic.runpath = fields[6];
+      entry.dynamic.needed.assign(fields.begin() + 7, fields.end());
+    }
+  }
+}
+
+bool DynamicCache::find(const std::string &path, const struct stat &sb, bool &isDynamic, Dynamic &dynamic, std::string &hash) {
+  // the hash, without reading the file when it was hashed before; the ctime is a part of the identity because a file
+  // can be rewritten in place with its size and mtime restored, so files that were hardlinked since are hashed again,
+  // but their entries are still found by the hash
+  auto identity = STR(sb.st_dev << ":" << sb.st_ino << ":" << sb.st_size << ":" << sb.st_mtim.tv_sec << "." << sb.st_mtim.tv_nsec
+                      << ":" << sb.st_ctim.tv_sec << "." << sb.st_ctim.tv_nsec);
+  auto it = oldHashes.find(identity);
+  if (it != oldHashes.end())
+    hash = it->second;
+  else {
+    MappedFile mf(path);
+    uint8_t h[32];
+    Util::sha256(mf.data, mf.size, h);
+    hash = Util::toHex(h, sizeof(h));
+    stats.numHashed++;
+  }
+  hashes[identity] = hash;
+
+  // the entry
+  auto ite = entries.find(hash);
+  if (ite == entries.end()) {
+    stats.numMisses++;
+    return false;
+  }
+  ite->second.lastUsedDay = today();
+  isDynamic = ite->second.isDynamic;
+  dynamic = ite->second.dynamic;
+  stats.numHits++;
+  return true;
+}
+
+void DynamicCache::add(const std::string &hash, bool isDynamic, const Dynamic &dynamic) {
+  entries[hash] = Entry{isDynamic, dynamic, today()};
+}
+
+void DynamicCache::save() const {
+  auto tmpFile = STR(file << ".tmp-pid" << ::getpid());
+  std::ofstream os(tmpFile, std::ios::trunc);
+  os << cacheHeader << std::endl;
+  for (auto &h : hashes) // identities of files that are gone by now are forgotten
+    os << "f\t" << h.first << "\t" << h.second << std::endl;
+  for (auto &e : entries)
+    if (e.second.lastUsedDay + cacheExpiryDays >= today()) {
+      auto &d = e.second.dynamic;
+      os << "e\t" << e.first << "\t" << e.second.lastUsedDay << "\t" << e.second.isDynamic << "\t" << d.elf32 << "\t" << d.rpath << "\t" << d.runpath;
+      for (auto &n : d.needed)
+        os << "\t" << n;
+      os << std::endl;
+    }
+  os.close();
+  if (!os || ::rename(tmpFile.c_str(), file.c_str()) == -1) {
+    (void)::unlink(tmpFile.c_str());
+    ERR("failed to save the cache file '" << file << "'")
+  }
+}
+
+//
+// Resolver
+//
+
+// the same as in ld-elf.so.1
+static const char *standardDirs[2] = {"/lib/casper:/lib:/usr/lib", "/lib32:/usr/lib32"};
+
+Resolver::Resolver(const std::string &newRoot, DynamicCache *newCache)
+: root(newRoot),
+  cache(newCache)
+{
+  hintsDirs[0] = readHintsDirs(root + _PATH_ELF_HINTS);
+  hintsDirs[1] = readHintsDirs(root + _PATH_ELF32_HINTS);
+}
+
+std::set<std::string> Resolver::dependencies(const std::string &file) {
+  auto &real = realPath(file);
+  if (real.empty())
+    return {};
+  auto it = closures.find(real);
+  if (it != closures.end())
+    return it->second;
+  auto &deps = closures[real];
+  auto main = object(real);
+  if (main == nullptr)
+    return deps;
+
+  // breadth first, as ld-elf.so.1 loads them: a name is only looked up once, by the first object that needs it
+  std::set<std::string> names, loaded = {real};
+  std::vector<const Object*> queue = {main};
+  for (size_t i = 0; i < queue.size(); i++)
+    for (auto &name : queue[i]->dynamic.needed) {
+      std::string path;
+      if (!names.insert(name).second || !findLibrary(name, *queue[i], *main, path))
+        continue;
+      auto &libReal = realPath(path);
+      deps.insert(path);
+      deps.insert(libReal);
+      if (loaded.insert(libReal).second)
+        if (auto lib = object(libReal))
+          queue.push_back(lib);
+    }
+
+  return deps;
+}
+
+const std::string& Resolver::realPath(const std::string &path) { // resolves symlinks as if root was the root directory
+  auto it = realPaths.find(path);
+  if (it != realPaths.end())
+    return it->second;
+  auto &real = realPaths[path];
+
+  auto rest = Util::reverseVector(Util::splitString(path, "/"));
+  std::string res;
+  unsigned numLinks = 0;
+  while (!rest.empty()) {
+    auto component = rest.back();
+    rest.pop_back();
+    if (component == ".")
+      continue;
+    if (component == "..") {
+      res.resize(res.rfind('/') == std::string::npos ? 0 : res.rfind('/'));
+      continue;
+    }
+    auto next = STR(res << "/" << component);
+    struct stat sb;
+    if (::lstat((root + next).c_str(), &sb) == -1)
+      return real; // doesn't exist
+    if (S_ISLNK(sb.st_mode)) {
+      char target[PATH_MAX];
+      auto len = ::readlink((root + next).c_str(), target, sizeof(target));
+      if (len == -1 || ++numLinks > 32)
+        return real; // ELOOP
+      if (target[0] == '/')
+        res.clear();
+      for (auto &c : Util::reverseVector(Util::splitString(std::string(target, len), "/")))
+        rest.push_back(c);
+    } else if (!rest.empty() && !S_ISDIR(sb.st_mode)) {
+      return real; // ENOTDIR
+    } else {
+      res = next;
+    }
+  }
+
+  real = res.empty() ? "/" : res;
+  return real;
+}
+
+const Resolver::Object* Resolver::object(const std::string &real) {
+  auto it = objects.find(real);
+  if (it != objects.end())
+    return it->second.get();
+  auto &obj = objects[real];
+
+  struct stat sb;
+  if (::stat((root + real).c_str(), &sb) == -1 || !S_ISREG(sb.st_mode))
+    return nullptr;
+  std::unique_ptr<Object> o(new Object);
+  bool isDynamic;
+  std::string hash;
+  if (cache == nullptr || !cache->find(root + real, sb, isDynamic, o->dynamic, hash)) {
+    MappedFile file(root + real);
+    isDynamic = readDynamic(file.data, file.size, o->dynamic);
+    if (cache != nullptr)
+      cache->add(hash, isDynamic, o->dynamic);
+  }
+  if (!isDynamic)
+    return nullptr;
+  o->origin = real.substr(0, real.rfind('/'));
+  obj = std::move(o);
+  return obj.get();
+}
+
+bool Resolver::findLibrary(const std::string &name, const Object &ref, const Object &main, std::string &path) {
+  // the order of find_library() in rtld.c: DT_RPATH is ignored when there is DT_RUNPATH, LD_LIBRARY_PATH is ignored as it is not set in jails
+  if (name.find('/') != std::string::npos) {
+    path = substituteOrigin(name, ref.origin);
+    return !realPath(path).empty();
+  }
+  return (ref.dynamic.runpath.empty() && searchDirs(name, ref.dynamic.rpath, ref, path))
+      || (&ref != &main && ref.dynamic.runpath.empty() && main.dynamic.runpath.empty() && searchDirs(name, main.dynamic.rpath, main, path))
+      || searchDirs(name, ref.dynamic.runpath, ref, path)
+      || searchDirs(name, hintsDirs[ref.dynamic.elf32 ? 1 : 0], ref, path)
+      || searchDirs(name, standardDirs[ref.dynamic.elf32 ? 1 : 0], ref, path);
+}
+
+bool Resolver::searchDirs(const std::string &name, const std::string &dirs, const Object &ref, std::string &path) {
+  for (auto &dir : Util::splitString(dirs, ":")) {
+    auto candidate = STR(substituteOrigin(dir, ref.origin) << "/" << name);
+    if (!realPath(candidate).empty()) {
+      path = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// interface
+//
+
+bool isElf(const uint8_t *data, size_t size) {
+  return size >= EI_NIDENT && data[0] == 0x7f && data[1] == 'E' && data[2] == 'L' && data[3] == 'F';
+}
+
+bool readDynamic(const uint8_t *data, size_t size, Dynamic &dynamic) {
+  if (!isElf(data, size) || data[EI_DATA] != ELFDATA2LSB) // all platforms that we run on are little-endian
+    return false;
+  dynamic.elf32 = data[EI_CLASS] == ELFCLASS32;
+  switch (data[EI_CLASS]) {
+  case ELFCLASS64:
+    return readDynamicT<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(data, size, dynamic);
+  case ELFCLASS32:
+    return readDynamicT<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(data, size, dynamic);
+  default:
+    return false;
+  }
+}
+
+}
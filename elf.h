@@ -0,0 +1,110 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Elf: reads the dynamic linking information from ELF files, and finds the shared libraries that they need
+//
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+namespace Elf {
+
+class Dynamic {
+public:
+  std::vector<std::string> needed;  // DT_NEEDED
+  std::string              rpath;   // DT_RPATH
+  std::string              runpath; // DT_RUNPATH
+  bool                     elf32 = false;
+};
+
+bool isElf(const uint8_t *data, size_t size);
+bool readDynamic(const uint8_t *data, size_t size, Dynamic &dynamic); // returns false for non-ELF or static files
+
+//
+// DynamicCache: the dynamic sections of files by the SHA256 of their content, kept in a file between runs
+//
+// A file is only read to be hashed when it isn't the same inode with the same size, mtime and ctime as when it was
+// hashed before. Files that are hardlinked from the cached base tree get a new ctime with every link, so they are
+// hashed again, but not parsed again: the content hash makes an entry valid wherever the file is, and a file that
+// has changed gets a new entry. Entries that weren't used for 30 days
+// are dropped when the cache is saved.
+//
+
+class DynamicCache {
+public:
+  class Stats {
+  public:
+    unsigned numHits = 0;
+    unsigned numMisses = 0;
+    unsigned numHashed = 0; // files that were read to compute their hash
+
+    std::string str() const;
+  };
+
+  Stats stats;
+
+  DynamicCache(const std::string &newFile); // loads the file when it exists
+  bool find(const std::string &path, const struct stat &sb, bool &isDynamic, Dynamic &dynamic, std::string &hash); // sets hash for add() on a miss
+  void add(const std::string &hash, bool isDynamic, const Dynamic &dynamic);
+  void save() const; // replaces the file: concurrent runs can lose each other's new entries, but can't corrupt it
+
+private:
+  class Entry {
+  public:
+    bool     isDynamic;
+    Dynamic  dynamic;
+    unsigned lastUsedDay;
+  };
+
+  std::string                        file;
+  std::map<std::string, Entry>       entries;   // content hash -> entry
+  std::map<std::string, std::string> oldHashes; // file identity -> content hash, as loaded
+  std::map<std::string, std::string> hashes;    // file identity -> content hash, of the files seen now: only they are saved
+};
+
+//
+// Resolver: finds libraries in the directory tree 'root' the way ld-elf.so.1 would find them when 'root' is
+// the root directory: through DT_RPATH and DT_RUNPATH with $ORIGIN, then the directories of ld-elf.so.hints
+// in the tree, and then the standard directories. Libraries that aren't found are skipped, ldd(1) reports them
+// as 'not found'. Files are only read once for all calls.
+//
+
+class Resolver {
+public:
+  Resolver(const std::string &newRoot, DynamicCache *newCache = nullptr);
+
+  // all libraries that 'file' needs, directly or not, as the paths that ldd(1) would print, and as the files
+  // that they are symlinks to; paths are relative to the root
+  std::set<std::string> dependencies(const std::string &file);
+
+  // the path with its symlinks resolved inside the root, empty when it doesn't exist
+  const std::string& realPath(const std::string &path);
+
+private:
+  class Object {
+  public:
+    Dynamic     dynamic;
+    std::string origin; // $ORIGIN: the real directory of the file
+  };
+
+  std::string                                    root;
+  DynamicCache                                  *cache;
+  std::string                                    hintsDirs[2]; // colon-separated, for 64-bit and 32-bit files
+  std::map<std::string, std::unique_ptr<Object>> objects;      // real path -> object, null when the file isn't a dynamic ELF file
+  std::map<std::string, std::string>             realPaths;    // path -> real path, empty when it doesn't exist
+  std::map<std::string, std::set<std::string>>   closures;     // real path -> dependencies
+
+  const Object* object(const std::string &real);
+  bool findLibrary(const std::string &name, const Object &ref, const Object &main, std::string &path);
+  bool searchDirs(const std::string &name, const std::string &dirs, const Object &ref, std::string &path);
+};
+
+}
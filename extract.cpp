@@ -0,0 +1,333 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "extract.h"
+#include "archive.h"
+#include "store.h"
+#include "codec.h"
+#include "tar.h"
+#include "threads.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iomanip>
+
+#define ERR(msg...) ERR2("extract", msg)
+
+namespace Extract {
+
+//
+// helpers
+//
+
+static const size_t maxPooledFileSize  = 0x100000;  // bigger files are streamed by the reader thread itself
+static const size_t maxPooledBytes     = 0x4000000; // memory limit for file data waiting in the writer pool
+
+//
+// DirWriter: writes tar entries into a directory. Directories are created by the reader thread in the archive order
+// and are kept open, files and other entries are created relative to them by the pool of writer threads.
+//
+
+class DirWriter : public Tar::Reader::Handler {
+  class Job {
+  public:
+    Tar::Entry           entry;
+    int                  dirFd;
+    std::string          name;
+    std::vector<uint8_t> data;
+  };
+
+  std::string                dir;
+  std::map<std::string, int> dirFds;        // open directories by their relative path, "" is the top directory
+  std::vector<Tar::Entry>    dirEntries;    // directory attributes are applied at the end, after their content is written
+  std::unordered_set<std::string> seen;     // entries that were already handed to the pool
+  ThreadPool                 pool;
+  std::mutex                 mutex;
+  std::condition_variable    cvQueue;
+  size_t                     queuedBytes = 0;
+  unsigned                   queuedJobs = 0;
+  std::unique_ptr<Job>       job;           // the entry being read
+  int                        fd = -1;       // the big file being streamed by the reader thread
+
+public:
+  Stats stats;
+
+  DirWriter(const std::string &newDir) : dir(newDir) {
+    int fdTop = ::open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (fdTop == -1)
+      ERR("failed to open the directory '" << dir << "': " << strerror(errno))
+    dirFds[""] = fdTop;
+  }
+  ~DirWriter() {
+    if (fd != -1)
+      (void)::close(fd);
+    try {
+      pool.wait(); // tasks reference directory fds
+    } catch (...) {
+      // the error is already being reported
+    }
+    for (auto &df : dirFds)
+      (void)::close(df.second);
+  }
+  void onEntry(const Tar::Entry &entry) override {
+    checkPath(entry.path);
+    if (entry.type == '5') {
+      if (!entry.path.empty())
+        makeDir(entry.path);
+      dirEntries.push_back(entry);
+      count(0);
+      return;
+    }
+
+    // it is a file or some other non-directory entry
+    if (entry.path.empty())
+      ERR("the top directory entry isn't a directory")
+    if (dirFds.find(entry.path) != dirFds.end())
+      ERR("refusing to replace the directory '" << P(entry.path) << "' with a non-directory")
+    if (!seen.insert(entry.path).second || entry.type == '1')
+      drain(); // the same path repeated, or a hardlink to some file that might still be in the pool
+    job.reset(new Job);
+    job->entry = entry;
+    auto slash = entry.path.rfind('/');
+    job->dirFd = parentDirFd(entry.path);
+    job->name = slash == std::string::npos ? entry.path : entry.path.substr(slash + 1);
+    if (entry.type == '1') {
+      checkPath(entry.linkPath);
+      auto linkSlash = entry.linkPath.rfind('/');
+      int linkDirFd = parentDirFd(entry.linkPath);
+      auto linkName = linkSlash == std::string::npos ? entry.linkPath : entry.linkPath.substr(linkSlash + 1);
+      removeExisting(job->dirFd, job->name, entry.path);
+      if (::linkat(linkDirFd, linkName.c_str(), job->dirFd, job->name.c_str(), 0) == -1)
+        ERR("failed to create the hardlink '" << P(entry.path) << "': " << strerror(errno))
+      count(0);
+      job.reset();
+    } else if (entry.type == '0' && (entry.size > maxPooledFileSize || !entry.sparse.empty())) { // holes of sparse files are seeked over
+      removeExisting(job->dirFd, job->name, entry.path);
+      fd = createFile(*job);
+    } else if (entry.type == '0') {
+      job->data.reserve(entry.size);
+    }
+  }
+  void onData(const uint8_t *data, size_t size) override {
+    if (fd != -1)
+      writeAll(fd, data, size, job->entry.path);
+    else
+      job->data.insert(job->data.end(), data, data + size);
+  }
+  void onHole(uint64_t size) override {
+    if (::lseek(fd, size, SEEK_CUR) == -1) // only sparse files have holes, and they are streamed
+      ERR("failed to seek in the file '" << job->entry.path << "': " << strerror(errno))
+  }
+  void onEntryEnd() override {
+    if (!job)
+      return; // directory or hardlink
+    if (fd != -1) {
+      finishFile(fd, *job);
+      fd = -1;
+      job.reset();
+      return;
+    }
+    // hand the job over to the writer pool, wait if too much data is queued
+    auto size = job->data.size();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cvQueue.wait(lock, [this,size]() {return queuedJobs == 0 || (queuedBytes + size <= maxPooledBytes && queuedJobs < 64*pool.size());});
+      queuedBytes += size;
+      queuedJobs++;
+    }
+    std::shared_ptr<Job> j(job.release());
+    pool.add([this,j,size]() {
+      RunAtEnd dequeue([this,size]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        queuedBytes -= size;
+        queuedJobs--;
+        cvQueue.notify_all();
+      });
+      writeEntry(*j);
+    });
+  }
+  void drain() {
+    pool.wait();
+  }
+  void finish() {
+    drain();
+    // deepest directories first, so that setting times on children doesn't change them for parents
+    for (auto it = dirEntries.rbegin(); it != dirEntries.rend(); it++) {
+      auto &e = *it;
+      int dfd = dirFds[e.path];
+      struct timespec times[2] = {{e.mtime, 0}, {e.mtime, 0}};
+      if (::fchown(dfd, e.uid, e.gid) == -1 || ::fchmod(dfd, e.mode) == -1 || ::futimens(dfd, times) == -1)
+        ERR("failed to set attributes of the directory '" << P(e.path) << "': " << strerror(errno))
+    }
+  }
+
+private:
+  std::string P(const std::string &relPath) const {
+    return relPath.empty() ? dir : STR(dir << "/" << relPath);
+  }
+  static void checkPath(const std::string &relPath) {
+    if (!relPath.empty() && relPath[0] == '/')
+      ERR("refusing to extract the absolute path '" << relPath << "'")
+    for (auto &c : Util::splitString(relPath, "/"))
+      if (c == "..")
+        ERR("refusing to extract the path '" << relPath << "' containing '..'")
+  }
+  int parentDirFd(const std::string &relPath) {
+    auto slash = relPath.rfind('/');
+    if (slash == std::string::npos)
+      return dirFds[""];
+    auto parent = relPath.substr(0, slash);
+    auto it = dirFds.find(parent);
+    if (it != dirFds.end())
+      return it->second;
+    return makeDir(parent); // tar archives don't always have entries for all directories
+  }
+  int makeDir(const std::string &relPath) {
+    auto it = dirFds.find(relPath);
+    if (it != dirFds.end())
+      return it->second;
+    int parentFd = parentDirFd(relPath);
+    auto slash = relPath.rfind('/');
+    auto name = slash == std::string::npos ? relPath : relPath.substr(slash + 1);
+    if (::mkdirat(parentFd, name.c_str(), 0700) == -1 && errno != EEXIST)
+      ERR("failed to create the directory '" << P(relPath) << "': " << strerror(errno))
+    int dfd = ::openat(parentFd, name.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW); // existing symlinks aren't followed
+    if (dfd == -1)
+      ERR("failed to open the directory '" << P(relPath) << "': " << strerror(errno))
+    dirFds[relPath] = dfd;
+    return dfd;
+  }
+  static void removeExisting(int dirFd, const std::string &name, const std::string &relPath) {
+    if (::unlinkat(dirFd, name.c_str(), 0) == -1 && errno != ENOENT)
+      ERR("failed to remove the existing file '" << relPath << "': " << strerror(errno))
+  }
+  static void writeAll(int fd, const uint8_t *data, size_t size, const std::string &relPath) {
+    while (size > 0) {
+      auto res = ::write(fd, data, size);
+      if (res == -1)
+        ERR("failed to write the file '" << relPath << "': " << strerror(errno))
+      data += res;
+      size -= res;
+    }
+  }
+  static int createFile(const Job &j) {
+    int fd = ::openat(j.dirFd, j.name.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600);
+    if (fd == -1)
+      ERR("failed to create the file '" << j.entry.path << "': " << strerror(errno))
+    return fd;
+  }
+  void finishFile(int fd, const Job &j) {
+    auto &e = j.entry;
+    struct timespec times[2] = {{e.mtime, 0}, {e.mtime, 0}};
+    if ((!e.sparse.empty() && ::ftruncate(fd, e.size) == -1) || // a trailing hole
+        ::fchown(fd, e.uid, e.gid) == -1 || ::fchmod(fd, e.mode) == -1 || ::futimens(fd, times) == -1) {
+      auto err = STR("failed to set attributes of the file '" << e.path << "': " << strerror(errno));
+      (void)::close(fd);
+      ERR(err)
+    }
+    if (::close(fd) == -1)
+      ERR("failed to close the file '" << e.path << "': " << strerror(errno))
+    count(Tar::dataSize(e));
+  }
+  void count(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    stats.numFiles++;
+    stats.numBytes += bytes;
+  }
+  void writeEntry(const Job &j) { // runs on the writer pool
+    auto &e = j.entry;
+    removeExisting(j.dirFd, j.name, e.path);
+    switch (e.type) {
+    case '0': {
+      int fd = createFile(j);
+      try {
+        writeAll(fd, j.data.data(), j.data.size(), e.path);
+      } catch (...) {
+        (void)::close(fd);
+        throw;
+      }
+      finishFile(fd, j);
+      return;
+    } case '2':
+      if (::symlinkat(e.linkPath.c_str(), j.dirFd, j.name.c_str()) == -1)
+        ERR("failed to create the symlink '" << e.path << "': " << strerror(errno))
+      break;
+    case '3':
+    case '4':
+    case '6':
+      if (::mknodat(j.dirFd, j.name.c_str(), (e.type == '3' ? S_IFCHR : e.type == '4' ? S_IFBLK : S_IFIFO) | 0600,
+                    e.type == '6' ? 0 : makedev(e.devMajor, e.devMinor)) == -1)
+        ERR("failed to create the special file '" << e.path << "': " << strerror(errno))
+      break;
+    default:
+      WARN("extract: skipping the entry '" << e.path << "' of the unsupported type '" << e.type << "'")
+      return;
+    }
+    // attributes of symlinks and special files
+    struct timespec times[2] = {{e.mtime, 0}, {e.mtime, 0}};
+    if (::fchownat(j.dirFd, j.name.c_str(), e.uid, e.gid, AT_SYMLINK_NOFOLLOW) == -1)
+      ERR("failed to set the owner of '" << e.path << "': " << strerror(errno))
+    if (e.type != '2' && ::fchmodat(j.dirFd, j.name.c_str(), e.mode, 0) == -1)
+      ERR("failed to set the mode of '" << e.path << "': " << strerror(errno))
+    if (::utimensat(j.dirFd, j.name.c_str(), times, AT_SYMLINK_NOFOLLOW) == -1)
+      ERR("failed to set times of '" << e.path << "': " << strerror(errno))
+    count(0);
+  }
+};
+
+//
+// interface
+//
+
+std::string Stats::str() const {
+  auto secs = seconds > 0 ? seconds : 1e-6;
+  return STR(numFiles << " files, " << std::fixed << std::setprecision(1) << numBytes/1e6 << " MB in " << std::setprecision(3) << seconds << " sec: "
+             << std::setprecision(0) << numFiles/secs << " files/s, " << std::setprecision(1) << numBytes/1e6/secs << " MB/s");
+}
+
+Stats crateFile(const std::string &crateFile, const std::string &dir) {
+  if (Archive::isCrateArchive(crateFile.c_str())) {
+    Archive::Reader archive(crateFile);
+    return crateArchive(archive, dir);
+  }
+  return stream([&crateFile](const Codec::FnData &feed) {
+    Codec::decompressFile(crateFile, feed);
+  }, dir);
+}
+
+Stats crateArchive(Archive::Reader &archive, const std::string &dir) {
+  if (archive.chunked())
+    archive.setBlockSource(Store::blockSource()); // chunks that are in the store aren't decompressed again
+  return stream([&archive](const Codec::FnData &feed) {
+    archive.readAll(feed);
+  }, dir);
+}
+
+Stats stream(const std::function<void(const Codec::FnData &feed)> &fnProduce, const std::string &dir) {
+  auto tmStart = std::chrono::steady_clock::now();
+  DirWriter writer(dir);
+  Tar::Reader reader(writer);
+  fnProduce([&reader](const uint8_t *data, size_t size) {
+    reader.feed(data, size);
+  });
+  reader.finish();
+  writer.finish();
+  writer.stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+  return writer.stats;
+}
+
+}
@@ -0,0 +1,31 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+#include "codec.h"
+
+#include <string>
+#include <functional>
+
+#include <stdint.h>
+
+namespace Archive {
+class Reader;
+}
+
+namespace Extract {
+
+class Stats {
+public:
+  unsigned numFiles = 0;  // all entries that were written
+  uint64_t numBytes = 0;  // bytes of file data that were written
+  double   seconds = 0;
+
+  std::string str() const; // human readable throughput
+};
+
+Stats crateFile(const std::string &crateFile, const std::string &dir); // both seekable and legacy (xz-compressed tar) crate files
+Stats crateArchive(Archive::Reader &archive, const std::string &dir); // the seekable crate that is already open
+Stats stream(const std::function<void(const Codec::FnData &feed)> &fnProduce, const std::string &dir); // the tar stream is fed by fnProduce as it arrives
+
+}
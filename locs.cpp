@@ -5,15 +5,31 @@
 
 #include <string>
 
+#include <stdlib.h>
+#include <unistd.h>
+
 namespace Locations {
 
+static std::string urlHash(const std::string &url) {
+  uint8_t hash[32];
+  Util::sha256((const uint8_t*)url.data(), url.size(), hash);
+  return Util::toHex(hash, 8);
+}
+
 const char *jailDirectoryPath = "/var/run/crate";
 const char *jailSubDirectoryIfaces = "/ifaces";
 const char *cacheDirectoryPath = "/var/cache/crate";
 const std::string ctxFwUsersFilePath = std::string(jailDirectoryPath) + "/ctx-firewall-users";
-const std::string baseArchive = std::string(Locations::cacheDirectoryPath) + "/base.txz";
-const std::string baseArchiveUrl = STRg("ftp://ftp1.freebsd.org/pub/FreeBSD/snapshots/"
+
+// for testing against a local server: ignored when crate runs setuid, so that users can't point root at their own base.txz
+// (statics are initialized before main() makes uid equal to euid)
+static const char *baseArchiveUrlOverride = ::getuid() == ::geteuid() ? ::getenv("CRATE_BASE_URL") : nullptr;
+const std::string baseArchiveUrl = baseArchiveUrlOverride != nullptr ? std::string(baseArchiveUrlOverride) :
+                                   STRg("ftp://ftp1.freebsd.org/pub/FreeBSD/snapshots/"
                                         << Util::getSysctlString("hw.machine") << "/" << Util::getSysctlString("kern.osrelease")
                                         << "/base.txz");
+// base.txz from an overridden URL is kept under its own name, so that it can't be taken for the real one by other users
+const std::string baseArchive = baseArchiveUrlOverride == nullptr ? STRg(Locations::cacheDirectoryPath << "/base.txz") :
+                                STRg(Locations::cacheDirectoryPath << "/base-" << urlHash(baseArchiveUrl) << ".txz");
 
 }
@@ -54,6 +54,13 @@ static int mainGuarded(int argc, char** argv) {
   //
   unsigned numArgsProcessed = 0;
   Args args = parseArguments(argc, argv, numArgsProcessed);
+
+  //
+  // commands that only read and write the user's own files run as the user, before any of the files is opened
+  //
+  if (args.cmd == CmdCat || args.cmd == CmdDelta || args.cmd == CmdPatch || args.cmd == CmdBenchCompress)
+    dropPrivileges();
+
   args.validate();
 
   //
@@ -72,6 +79,21 @@ static int mainGuarded(int argc, char** argv) {
   } case CmdRun: {
     succ = runCrate(args, argc - numArgsProcessed, argv + numArgsProcessed, returnCode);
     break;
+  } case CmdCat: {
+    succ = catCrate(args);
+    break;
+  } case CmdStore: {
+    succ = manageStore(args);
+    break;
+  } case CmdDelta: {
+    succ = deltaCrate(args);
+    break;
+  } case CmdPatch: {
+    succ = patchCrate(args);
+    break;
+  } case CmdBenchCompress: {
+    succ = benchCompress(args);
+    break;
   } case CmdNone: {
     break; // impossible
   }}
@@ -0,0 +1,112 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "manifest.h"
+#include "archive.h"
+#include "util.h"
+#include "err.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define ERR(msg...) ERR2("crate manifest", msg)
+
+//
+// helpers
+//
+
+static const uint8_t magic[8] = {'C', 'R', 'A', 'T', 'E', 'M', 'F', 0x01};
+
+static void put(std::vector<uint8_t> &buf, uint64_t val, unsigned bytes) {
+  for (unsigned i = 0; i < bytes; i++)
+    buf.push_back((val >> 8*i) & 0xff);
+}
+
+class Parser {
+  const uint8_t *data;
+  size_t         size;
+  size_t         pos = 0;
+public:
+  Parser(const uint8_t *newData, size_t newSize) : data(newData), size(newSize) { }
+  uint64_t get(unsigned bytes) {
+    const uint8_t *p = get(bytes, true);
+    uint64_t val = 0;
+    for (unsigned i = 0; i < bytes; i++)
+      val |= uint64_t(p[i]) << 8*i;
+    return val;
+  }
+  const uint8_t* get(size_t bytes, bool) {
+    if (pos + bytes > size)
+      ERR("the manifest is truncated")
+    pos += bytes;
+    return data + pos - bytes;
+  }
+};
+
+//
+// interface
+//
+
+const char *Manifest::fileName = "+CRATE.MANIFEST";
+
+uint64_t Manifest::dataSize() const {
+  uint64_t size = 0;
+  for (auto &e : entries)
+    size += e.size;
+  return size;
+}
+
+const Manifest::Entry* Manifest::find(const std::string &path) const {
+  auto it = std::lower_bound(entries.begin(), entries.end(), path, [](const Entry &e, const std::string &p) {return e.path < p;});
+  return it != entries.end() && it->path == path ? &*it : nullptr;
+}
+
+void Manifest::serialize(std::vector<uint8_t> &out) const {
+  out.insert(out.end(), magic, magic + sizeof(magic));
+  put(out, entries.size(), 4);
+  for (auto &e : entries) {
+    put(out, e.path.size(), 2);
+    out.insert(out.end(), e.path.begin(), e.path.end());
+    put(out, (uint8_t)e.type, 1);
+    put(out, e.mode & 07777, 2);
+    put(out, e.size, 8);
+    put(out, e.isElf ? 1 : 0, 1);
+    put(out, e.linkGroup, 4);
+    if (e.type == '0')
+      out.insert(out.end(), e.hash, e.hash + sizeof(e.hash));
+  }
+}
+
+void Manifest::parse(const uint8_t *data, size_t size) {
+  if (size < sizeof(magic) || ::memcmp(data, magic, sizeof(magic)) != 0)
+    ERR("the manifest has an unknown format")
+  Parser p(data + sizeof(magic), size - sizeof(magic));
+  entries.clear();
+  for (auto n = p.get(4); n > 0; n--) {
+    Entry e;
+    auto len = p.get(2);
+    e.path = std::string((const char*)p.get(len, true), len);
+    e.type = (char)p.get(1);
+    e.mode = p.get(2);
+    e.size = p.get(8);
+    e.isElf = p.get(1) & 1;
+    e.linkGroup = p.get(4);
+    if (e.type == '0')
+      ::memcpy(e.hash, p.get(sizeof(e.hash), true), sizeof(e.hash));
+    else
+      ::memset(e.hash, 0, sizeof(e.hash));
+    entries.push_back(e);
+  }
+}
+
+bool Manifest::read(const Archive::Reader &archive, Manifest &manifest) {
+  std::vector<uint8_t> data;
+  if (!archive.readFile(fileName, [&data](const uint8_t *d, size_t size) {
+    data.insert(data.end(), d, d + size);
+  }))
+    return false;
+  manifest.parse(data.data(), data.size());
+  return true;
+}
@@ -0,0 +1,44 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Manifest: the list of files of the crate with their sizes, modes and hashes, stored as the first archive member
+// (+CRATE.MANIFEST), so that the run-time code knows what the crate contains before extracting it
+//
+// Layout (little-endian): magic, u32 number of entries, entries sorted by path:
+//   u16 path length, path, u8 type, u16 mode, u64 size, u8 flags, u32 hardlink group, SHA256 of data (regular files only)
+//
+
+#include "archive.h"
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <stdint.h>
+
+class Manifest {
+public:
+  class Entry {
+  public:
+    std::string path;          // as in Tar::Entry::path
+    char        type;          // as in Tar::Entry::type
+    mode_t      mode;
+    uint64_t    size;
+    uint8_t     hash[32];      // SHA256 of the data of regular files
+    bool        isElf;
+    uint32_t    linkGroup;     // hardlinks of the same file have the same non-zero group
+  };
+
+  static const char *fileName; // the archive member
+
+  std::vector<Entry> entries;
+
+  uint64_t dataSize() const;                         // all file data that extraction writes
+  const Entry* find(const std::string &path) const;  // nullptr when there is no such entry
+  void serialize(std::vector<uint8_t> &out) const;
+  void parse(const uint8_t *data, size_t size);
+
+  static bool read(const Archive::Reader &archive, Manifest &manifest); // returns false when the crate has no manifest
+};
@@ -1,13 +1,19 @@
 // Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
 
 #include "misc.h"
+#include "spec.h"
 #include "util.h"
 #include "err.h"
 #include "locs.h"
 
 #include <sys/stat.h>
+#include <unistd.h>
 #include <errno.h>
 
+// uid/gid of the user, statics are initialized before main() makes uid equal to euid
+static uid_t myuid = ::getuid();
+static gid_t mygid = ::getgid();
+
 //
 // internals
 //
@@ -31,6 +37,30 @@ void createJailsDirectoryIfNeeded(const char *subdir) {
   createDirectoryIfNeeded(CSTR(Locations::jailDirectoryPath << subdir), "jails");
 }
 
-void createCacheDirectoryIfNeeded() {
-  createDirectoryIfNeeded(Locations::cacheDirectoryPath, "cache");
+void createCacheDirectoryIfNeeded(const char *subdir) {
+  createDirectoryIfNeeded(CSTR(Locations::cacheDirectoryPath << subdir), "cache");
+}
+
+void dropPrivileges() {
+  // the group first, it can't be changed once the user is changed
+  if (::setresgid(mygid, mygid, mygid) == -1)
+    ERR2("drop privileges", "failed to set the group to " << mygid << ": " << strerror(errno))
+  if (::setresuid(myuid, myuid, myuid) == -1)
+    ERR2("drop privileges", "failed to set the user to " << myuid << ": " << strerror(errno))
+}
+
+std::vector<std::string> jailRunPrograms(const Spec &spec) {
+  std::vector<std::string> programs = {
+    "/libexec/ld-elf.so.1", "/usr/libexec/ld-elf.so.1", // needed to run elf executables
+    "/bin/sh",                                          // the default shell of the user, and scripts
+    "/usr/bin/env",                                     // passes the environment to the command
+    "/usr/sbin/pw", "/usr/sbin/pwd_mkdb",               // add users
+    "/usr/sbin/service", "/sbin/ipfw",                  // 'service ipfw start' runs in every jail
+    "/sbin/kldstat", "/sbin/kldload", "/sbin/sysctl",   // used by /etc/rc.d/ipfw, and by rc
+    "/bin/kenv", "/bin/date", "/bin/sleep"              // rc and rc.shutdown, the idle script of service-only crates
+  };
+  if (spec.optionExists("net"))
+    for (auto p : {"/sbin/ifconfig", "/sbin/route"})    // set up the interfaces and the default route
+      programs.push_back(p);
+  return programs;
 }
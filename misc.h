@@ -2,5 +2,14 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
+class Spec;
+
 void createJailsDirectoryIfNeeded(const char *subdir = ""); // subdir is assumed to include the leading slash when non-empty
-void createCacheDirectoryIfNeeded();
+void createCacheDirectoryIfNeeded(const char *subdir = ""); // subdir is assumed to include the leading slash when non-empty
+
+void dropPrivileges(); // back to the user who has invoked crate, for commands that only read and write the user's files
+
+std::vector<std::string> jailRunPrograms(const Spec &spec); // what 'run' itself runs in the jail: 'create' always keeps them
@@ -0,0 +1,341 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "pack.h"
+#include "tar.h"
+#include "manifest.h"
+#include "threads.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sha256.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+#define ERR(msg...) ERR2("pack", msg)
+
+namespace Pack {
+
+//
+// helpers
+//
+
+static const uint64_t pieceSize = 0x100000; // files are read in pieces of this size, small files are grouped into items of about this size
+
+class Node {
+public:
+  std::string path;     // relative, empty for the top directory
+  struct stat sb;
+  std::string linkPath; // symlink target
+  std::vector<std::pair<uint64_t, uint64_t>> sparse; // data segments of a file with holes, as in Tar::Entry
+};
+
+class Walker {
+  int               topFd;
+  ThreadPool        pool;
+  std::mutex        mutex;
+
+public:
+  std::vector<Node> nodes;
+
+  Walker(int newTopFd) : topFd(newTopFd) { }
+  ~Walker() {
+    try {
+      pool.wait(); // tasks reference the walker
+    } catch (...) {
+      // the error is already being reported
+    }
+  }
+
+  void run() {
+    Node top;
+    if (::fstat(topFd, &top.sb) == -1)
+      ERR("failed to stat the top directory: " << strerror(errno))
+    nodes.push_back(top);
+    walk("");
+    pool.wait();
+  }
+
+private:
+  void walk(const std::string &path) {
+    int fd = ::openat(topFd, path.empty() ? "." : path.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    if (fd == -1)
+      ERR("failed to open the directory '" << path << "': " << strerror(errno))
+    DIR *d = ::fdopendir(fd);
+    if (d == nullptr) {
+      (void)::close(fd);
+      ERR("failed to read the directory '" << path << "': " << strerror(errno))
+    }
+    RunAtEnd closeDir([d]() {
+      (void)::closedir(d);
+    });
+
+    std::vector<Node> found;
+    while (auto *de = ::readdir(d)) {
+      if (::strcmp(de->d_name, ".") == 0 || ::strcmp(de->d_name, "..") == 0)
+        continue;
+      Node node;
+      node.path = path.empty() ? std::string(de->d_name) : STR(path << "/" << de->d_name);
+      if (::fstatat(fd, de->d_name, &node.sb, AT_SYMLINK_NOFOLLOW) == -1)
+        ERR("failed to stat '" << node.path << "': " << strerror(errno))
+      switch (node.sb.st_mode & S_IFMT) {
+      case S_IFSOCK:
+        continue; // sockets can't be archived
+      case S_IFLNK: {
+        char target[PATH_MAX+1];
+        auto len = ::readlinkat(fd, de->d_name, target, sizeof(target) - 1);
+        if (len == -1)
+          ERR("failed to read the symbolic link '" << node.path << "': " << strerror(errno))
+        node.linkPath = std::string(target, len);
+        break;
+      } case S_IFDIR:
+        pool.add([this,p = node.path]() {
+          walk(p);
+        });
+        break;
+      case S_IFREG:
+        findHoles(fd, de->d_name, node);
+        break;
+      }
+      found.push_back(node);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    nodes.insert(nodes.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+  }
+  static void findHoles(int dirFd, const char *name, Node &node) {
+    if ((uint64_t)node.sb.st_blocks*512 >= (uint64_t)node.sb.st_size)
+      return; // fully allocated
+    int fd = ::openat(dirFd, name, O_RDONLY|O_NOFOLLOW);
+    if (fd == -1)
+      ERR("failed to open the file '" << node.path << "': " << strerror(errno))
+    RunAtEnd closeFd([fd]() {
+      (void)::close(fd);
+    });
+    auto segs = Util::Fs::getDataSegments(fd, node.sb);
+    if (segs.size() == 1 && segs[0].first == 0 && segs[0].second == (uint64_t)node.sb.st_size)
+      return; // compressed by the file system, but without holes
+    node.sparse = segs;
+    node.sparse.push_back({node.sb.st_size, 0}); // the end, in case the file ends with a hole
+  }
+};
+
+static void hashFile(int topFd, const std::string &path, Manifest::Entry &me) {
+  int fd = ::openat(topFd, path.c_str(), O_RDONLY|O_NOFOLLOW);
+  if (fd == -1)
+    ERR("failed to open the file '" << path << "': " << strerror(errno))
+  RunAtEnd closeFd([fd]() {
+    (void)::close(fd);
+  });
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  uint8_t buf[0x10000];
+  uint64_t total = 0;
+  while (true) {
+    auto res = ::read(fd, buf, sizeof(buf));
+    if (res == -1)
+      ERR("failed to read the file '" << path << "': " << strerror(errno))
+    if (res == 0)
+      break;
+    if (total == 0)
+      me.isElf = res >= 4 && buf[0] == 0x7f && buf[1] == 'E' && buf[2] == 'L' && buf[3] == 'F';
+    SHA256_Update(&ctx, buf, res);
+    total += res;
+  }
+  SHA256_Final(me.hash, &ctx);
+  if (total != me.size)
+    ERR("the file '" << path << "' has changed while being packed")
+}
+
+static Tar::Entry toEntry(const Node &node) {
+  Tar::Entry e;
+  switch (node.sb.st_mode & S_IFMT) {
+  case S_IFREG:  e.type = '0'; break;
+  case S_IFLNK:  e.type = '2'; break;
+  case S_IFCHR:  e.type = '3'; break;
+  case S_IFBLK:  e.type = '4'; break;
+  case S_IFDIR:  e.type = '5'; break;
+  case S_IFIFO:  e.type = '6'; break;
+  default:
+    ERR("unsupported file type of '" << node.path << "'")
+  }
+  e.path = node.path.empty() ? "./" : STR("./" << node.path << (e.type == '5' ? "/" : ""));
+  e.linkPath = node.linkPath;
+  e.mode = node.sb.st_mode & 07777;
+  e.uid = node.sb.st_uid; // the ids of the jail's own users and groups, see pack.h
+  e.gid = node.sb.st_gid;
+  e.mtime = node.sb.st_mtime;
+  e.size = e.type == '0' ? node.sb.st_size : 0;
+  e.devMajor = e.type == '3' || e.type == '4' ? major(node.sb.st_rdev) : 0;
+  e.devMinor = e.type == '3' || e.type == '4' ? minor(node.sb.st_rdev) : 0;
+  e.sparse = node.sparse;
+  return e;
+}
+
+//
+// interface
+//
+
+Extract::Stats directory(const std::string &dir, bool withManifest, const Codec::FnData &fnData) {
+  auto tmStart = std::chrono::steady_clock::now();
+  Extract::Stats stats;
+
+  int topFd = ::open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+  if (topFd == -1)
+    ERR("failed to open the directory '" << dir << "': " << strerror(errno))
+  RunAtEnd closeTop([topFd]() {
+    (void)::close(topFd);
+  });
+
+  // find all entries, and sort them: the order of directory iteration isn't deterministic
+  std::vector<Tar::Entry> entries;
+  std::vector<uint32_t> linkGroups;
+  time_t topMtime;
+  {
+    Walker walker(topFd);
+    walker.run();
+    std::sort(walker.nodes.begin(), walker.nodes.end(), [](const Node &n1, const Node &n2) {return n1.path < n2.path;});
+    topMtime = walker.nodes[0].sb.st_mtime;
+    std::map<std::pair<dev_t, ino_t>, unsigned> firstLinks;
+    for (auto &node : walker.nodes) {
+      if (withManifest && node.path == Manifest::fileName)
+        continue; // a stale one, it is replaced
+      entries.push_back(toEntry(node));
+      linkGroups.push_back(0);
+      auto &e = entries.back();
+      if (e.type == '0' && node.sb.st_nlink > 1) { // the first name of a hardlinked file carries the data, others link to it
+        auto it = firstLinks.find({node.sb.st_dev, node.sb.st_ino});
+        if (it == firstLinks.end()) {
+          firstLinks[{node.sb.st_dev, node.sb.st_ino}] = entries.size() - 1;
+          linkGroups.back() = firstLinks.size();
+        } else {
+          e.type = '1';
+          e.linkPath = entries[it->second].path;
+          e.size = 0;
+          e.sparse.clear();
+          linkGroups.back() = linkGroups[it->second];
+        }
+      }
+    }
+  }
+
+  // the manifest goes first, so all files are hashed before anything is written
+  if (withManifest) {
+    Manifest manifest;
+    manifest.entries.resize(entries.size());
+    {
+      ThreadPool pool;
+      for (unsigned i = 0; i < entries.size(); i++) {
+        auto &e = entries[i];
+        auto &me = manifest.entries[i];
+        me.path = Tar::normalizePath(e.path);
+        me.type = e.type;
+        me.mode = e.mode;
+        me.size = e.size;
+        me.isElf = false;
+        me.linkGroup = linkGroups[i];
+        ::memset(me.hash, 0, sizeof(me.hash));
+        if (e.type == '0')
+          pool.add([topFd,&me]() {
+            hashFile(topFd, me.path, me);
+          });
+      }
+      pool.wait();
+    }
+    std::vector<uint8_t> data;
+    manifest.serialize(data);
+    Tar::Entry e = {'0', STR("./" << Manifest::fileName), "", 0644, 0, 0, topMtime, data.size(), 0, 0, {}};
+    std::vector<uint8_t> out;
+    Tar::writeHeader(e, out);
+    out.insert(out.end(), data.begin(), data.end());
+    Tar::writePadding(data.size(), out);
+    fnData(out.data(), out.size());
+  }
+
+  // split the stream into items that are produced in parallel: pieces of big files, groups of small files,
+  // only data segments of sparse files are read
+  class Piece {
+  public:
+    unsigned entry;
+    uint64_t offset; // in the file
+    uint64_t size;
+    bool     first;  // the header goes before it
+    bool     last;   // the padding goes after it
+  };
+  std::vector<std::vector<Piece>> items(1);
+  uint64_t itemSize = 0;
+  for (unsigned i = 0; i < entries.size(); i++) {
+    auto &e = entries[i];
+    auto segs = !e.sparse.empty() ? e.sparse : std::vector<std::pair<uint64_t, uint64_t>>{{0, e.size}};
+    bool first = true;
+    for (auto &seg : segs) {
+      uint64_t offset = 0;
+      do {
+        auto size = std::min(seg.second - offset, pieceSize);
+        if (itemSize + size > pieceSize && !items.back().empty()) {
+          items.push_back({});
+          itemSize = 0;
+        }
+        items.back().push_back({i, seg.first + offset, size, first, false});
+        itemSize += size + 512;
+        offset += size;
+        first = false;
+      } while (offset < seg.second);
+    }
+    items.back().back().last = true;
+  }
+
+  runOrdered(items.size(), [&](unsigned idx, std::vector<uint8_t> &out) {
+    for (auto &piece : items[idx]) {
+      auto &e = entries[piece.entry];
+      if (piece.first)
+        Tar::writeHeader(e, out);
+      if (piece.size > 0) {
+        int fd = ::openat(topFd, Tar::normalizePath(e.path).c_str(), O_RDONLY|O_NOFOLLOW);
+        if (fd == -1)
+          ERR("failed to open the file '" << e.path << "': " << strerror(errno))
+        RunAtEnd closeFd([fd]() {
+          (void)::close(fd);
+        });
+        auto off = out.size();
+        out.resize(off + piece.size);
+        for (uint64_t done = 0; done < piece.size;) {
+          auto res = ::pread(fd, out.data() + off + done, piece.size - done, piece.offset + done);
+          if (res == -1)
+            ERR("failed to read the file '" << e.path << "': " << strerror(errno))
+          if (res == 0)
+            ERR("the file '" << e.path << "' has shrunk while being packed")
+          done += res;
+        }
+      }
+      if (piece.last)
+        Tar::writePadding(Tar::dataSize(e), out);
+    }
+  }, [&](unsigned, std::vector<uint8_t> &out) {
+    fnData(out.data(), out.size());
+  });
+
+  std::vector<uint8_t> end;
+  Tar::writeEnd(end);
+  fnData(end.data(), end.size());
+
+  stats.numFiles = entries.size();
+  for (auto &e : entries)
+    stats.numBytes += Tar::dataSize(e);
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+  return stats;
+}
+
+}
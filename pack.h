@@ -0,0 +1,25 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Pack: produces the tar stream of a directory tree in-process
+//
+// The tree is walked and files are read ahead on a thread pool. Entries are in the sorted order of their paths
+// and user and group names aren't recorded, so that identical trees always produce identical streams.
+// Numeric user and group ids are kept as they are: they belong to the /etc/passwd and /etc/group of the jail, where
+// packages create their users with the fixed ids of the ports tree, and services like tor refuse to start when their
+// files have other owners. Host ids don't get into the tree, because 'create' runs as root and copies files as root.
+// The stream optionally begins with the manifest of the tree (see manifest.h).
+//
+
+#include "codec.h"
+#include "extract.h"
+
+#include <string>
+
+namespace Pack {
+
+Extract::Stats directory(const std::string &dir, bool withManifest, const Codec::FnData &fnData); // the tar stream is delivered in order, in pieces
+
+}
@@ -0,0 +1,124 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "pathset.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+static const size_t arenaBlockSize = 0x10000;
+
+//
+// helpers
+//
+
+static std::vector<std::string> components(const std::string &path) { // lexically resolved
+  std::vector<std::string> res;
+  for (auto &c : Util::splitString(path, "/"))
+    if (c == "..") {
+      if (!res.empty())
+        res.pop_back();
+    } else if (c != ".") {
+      res.push_back(c);
+    }
+  return res;
+}
+
+//
+// interface
+//
+
+PathSet::PathSet() {
+  nodes.push_back(NodeData{None, std::string_view(), 0, false}); // Root
+}
+
+bool PathSet::insert(const std::string &path) {
+  Node node = Root;
+  for (auto &c : components(path)) {
+    auto it = children.find(Key{node, c});
+    if (it != children.end()) {
+      node = it->second;
+      continue;
+    }
+    auto name = store(c);
+    nodes.push_back(NodeData{node, name, 0, false});
+    nodes[node].numChildren++;
+    node = nodes.size() - 1;
+    children[Key{nodes[node].parent, name}] = node;
+  }
+  if (nodes[node].isMember)
+    return false;
+  nodes[node].isMember = true;
+  numPaths++;
+  return true;
+}
+
+bool PathSet::contains(const std::string &path) const {
+  return isMember(find(path));
+}
+
+bool PathSet::containsPathOrParent(const std::string &path) const {
+  Node node = Root;
+  for (size_t pos = 0; pos < path.size(); ) {
+    auto end = std::min(path.find('/', pos), path.size());
+    if (end > pos) {
+      auto it = children.find(Key{node, std::string_view(path.data() + pos, end - pos)});
+      if (it == children.end())
+        return false;
+      node = it->second;
+      if (nodes[node].isMember)
+        return true;
+    }
+    pos = end + 1;
+  }
+  return false;
+}
+
+PathSet::Node PathSet::find(const std::string &path) const {
+  Node node = Root;
+  for (auto &c : components(path))
+    if ((node = child(node, c.c_str())) == None)
+      break;
+  return node;
+}
+
+PathSet::Node PathSet::child(Node node, const char *name) const {
+  if (node == None)
+    return None;
+  auto it = children.find(Key{node, std::string_view(name)});
+  return it != children.end() ? it->second : None;
+}
+
+std::string PathSet::path(Node node) const {
+  if (node == Root)
+    return "/";
+  std::vector<std::string_view> names;
+  for (; node != Root; node = nodes[node].parent)
+    names.push_back(nodes[node].name);
+  std::string res;
+  for (auto it = names.rbegin(); it != names.rend(); it++)
+    res.append("/").append(*it);
+  return res;
+}
+
+void PathSet::forEach(const std::function<void(const std::string &path)> &fn) const {
+  for (Node node = 0; node < nodes.size(); node++) // nodes are created after their parents
+    if (nodes[node].isMember)
+      fn(path(node));
+}
+
+std::string_view PathSet::store(const std::string &name) {
+  if (arena.empty() || arenaUsed + name.size() > arenaBlockSize) {
+    arena.emplace_back(new char[std::max(arenaBlockSize, name.size())]);
+    arenaUsed = 0;
+  }
+  auto p = arena.back().get() + arenaUsed;
+  ::memcpy(p, name.data(), name.size());
+  arenaUsed += name.size();
+  return std::string_view(p, name.size());
+}
@@ -0,0 +1,71 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// PathSet: a set of absolute paths stored as a trie of their components, used for the paths that are kept when a
+// tree is pruned
+//
+// Component names are kept in an arena, and children are found through one hash table keyed by (parent node, name).
+// A directory walk therefore looks each entry up with a single probe and never builds the entry's path. A node
+// exists only when its path or something under it is in the set, so a subtree with nothing kept is recognized at
+// its top and can be removed without any more lookups.
+//
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+
+#include <stdint.h>
+
+class PathSet {
+public:
+  typedef uint32_t Node;
+  static const Node None = ~(Node)0;
+  static const Node Root = 0; // "/"
+
+  PathSet();
+
+  bool insert(const std::string &path); // '.' and '..' are resolved lexically, returns false when it was already there
+  bool contains(const std::string &path) const;
+  bool containsPathOrParent(const std::string &path) const; // path is normalized
+  size_t size() const {return numPaths;}
+
+  // walking along a directory tree: None means that nothing at or under the path is in the set
+  Node find(const std::string &path) const;
+  Node child(Node node, const char *name) const; // node can be None
+  bool isMember(Node node) const {return node != None && nodes[node].isMember;}
+  bool hasChildren(Node node) const {return node != None && nodes[node].numChildren > 0;}
+  std::string path(Node node) const;
+  void forEach(const std::function<void(const std::string &path)> &fn) const; // all paths, parents before children
+
+private:
+  class NodeData {
+  public:
+    Node             parent;
+    std::string_view name;        // points into the arena
+    uint32_t         numChildren;
+    bool             isMember;
+  };
+  class Key {
+  public:
+    Node             parent;
+    std::string_view name;
+    bool operator==(const Key &other) const {return parent == other.parent && name == other.name;}
+  };
+  class KeyHash {
+  public:
+    size_t operator()(const Key &key) const {return std::hash<std::string_view>()(key.name)*31 + key.parent;}
+  };
+
+  std::vector<NodeData>                 nodes;
+  std::unordered_map<Key, Node, KeyHash> children;
+  std::vector<std::unique_ptr<char[]>>  arena;
+  size_t                                arenaUsed = 0; // in the last block
+  size_t                                numPaths = 0;
+
+  std::string_view store(const std::string &name);
+};
@@ -0,0 +1,508 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "prune.h"
+#include "pathset.h"
+#include "threads.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+
+#define ERR(msg...) ERR2("pruning the jail", msg)
+
+namespace Prune {
+
+//
+// helpers
+//
+
+static double secondsSince(std::chrono::steady_clock::time_point tmStart) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+}
+
+static std::string join(const std::string &path, const char *name) { // relative paths are without the leading slash
+  return path.empty() ? std::string(name) : STR(path << "/" << name);
+}
+
+static std::string relative(const std::string &absPath) {
+  return absPath.substr(absPath.find_first_not_of('/') == std::string::npos ? absPath.size() : absPath.find_first_not_of('/'));
+}
+
+static unsigned depth(const std::string &path) {
+  return std::count(path.begin(), path.end(), '/');
+}
+
+static bool globMatch(const char *p, const char *s) { // see prune.h for the syntax
+  for (; *p; p++, s++)
+    switch (*p) {
+    case '*':
+      if (p[1] == '*') { // any number of characters, slashes included
+        p += 2;
+        if (*p == '/' && globMatch(p + 1, s)) // "/**/" also matches "/"
+          return true;
+        for (;; s++) {
+          if (globMatch(p, s))
+            return true;
+          if (!*s)
+            return false;
+        }
+      }
+      for (p++;; s++) { // any number of characters within a path component
+        if (globMatch(p, s))
+          return true;
+        if (!*s || *s == '/')
+          return false;
+      }
+    case '?':
+      if (!*s || *s == '/')
+        return false;
+      break;
+    case '[': {
+      auto end = ::strchr(p + (p[1] == '!' ? 3 : 2), ']'); // ']' right after '[' or "[!" is a member
+      if (end == nullptr) { // not a class, the literal '['
+        if (*s != '[')
+          return false;
+        break;
+      }
+      if (!*s || *s == '/')
+        return false;
+      bool negate = p[1] == '!';
+      bool member = false;
+      for (auto c = p + (negate ? 2 : 1); c < end; c++)
+        if (c[1] == '-' && c + 2 < end) {
+          member = member || (*s >= c[0] && *s <= c[2]);
+          c += 2;
+        } else {
+          member = member || *s == *c;
+        }
+      if (member == negate)
+        return false;
+      p = end;
+      break;
+    }
+    default:
+      if (*s != *p)
+        return false;
+    }
+  return !*s;
+}
+
+static int matchingGlob(const std::vector<std::string> &globs, const std::string &absPath) { // returns the index, or -1
+  for (unsigned i = 0; i < globs.size(); i++)
+    if (globMatch(globs[i].c_str(), absPath.c_str()))
+      return i;
+  return -1;
+}
+
+// Traverser: every directory is a task on the thread pool, as in Util::Fs::findElfFiles(), and every entry is
+// checked against all rules while the directory is open
+class Traverser {
+  static const int NoRule = -1;
+
+  int                                  top;
+  std::unordered_map<std::string, int> parts;     // relative path -> rule
+  std::vector<std::string>             removeGlobs;
+  int                                  firstGlobRule;
+  int                                  staticLibRule;
+  bool                                 removeStaticLibs;
+  std::string                          elfDir;    // relative, empty when ELF files aren't looked for
+  std::vector<std::string>             keepGlobs;
+  std::mutex                           mutex;
+  ThreadPool                           pool;
+
+public:
+  Traversal traversal;
+
+  Traverser(const std::string &root, const std::vector<Part> &newParts, const std::vector<std::string> &newRemoveGlobs,
+            bool newRemoveStaticLibs, const std::string &newElfDir, const std::vector<std::string> &newKeepGlobs)
+  : removeGlobs(newRemoveGlobs),
+    removeStaticLibs(newRemoveStaticLibs),
+    elfDir(relative(newElfDir)),
+    keepGlobs(newKeepGlobs)
+  {
+    top = ::open(root.c_str(), O_RDONLY|O_DIRECTORY);
+    if (top == -1)
+      ERR("failed to open the directory '" << root << "': " << strerror(errno))
+    // rules are in the order of removal: static libraries, then parts deeper first, so that the directories of the
+    // parts that contain them are empty by then, then patterns, which only match outside of the parts
+    staticLibRule = traversal.removals.size();
+    traversal.removals.push_back({"*.a", false, {}});
+    auto sortedParts = newParts;
+    std::stable_sort(sortedParts.begin(), sortedParts.end(), [](const Part &p1, const Part &p2) {
+      return depth(p1.path) > depth(p2.path);
+    });
+    for (auto &part : sortedParts) {
+      parts[relative(part.path)] = traversal.removals.size();
+      traversal.removals.push_back({part.path, part.exceptKept, {}});
+    }
+    firstGlobRule = traversal.removals.size();
+    for (auto &glob : removeGlobs)
+      traversal.removals.push_back({glob, true, {}}); // kept paths win over patterns
+  }
+  ~Traverser() {
+    try {
+      pool.wait(); // tasks use the top directory fd
+    } catch (...) {
+      // the error is already being reported
+    }
+    (void)::close(top);
+  }
+
+  void run() {
+    pool.add([this]() {
+      walk("", NoRule, false);
+    });
+    pool.wait();
+  }
+
+private:
+  void walk(const std::string &path, int rule, bool inElfDir) {
+    int fd = ::openat(top, path.empty() ? "." : path.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    if (fd == -1)
+      ERR("failed to open the directory '" << path << "': " << strerror(errno))
+    auto d = ::fdopendir(fd);
+    if (d == nullptr) {
+      (void)::close(fd);
+      ERR("failed to read the directory '" << path << "': " << strerror(errno))
+    }
+    RunAtEnd closeDir([d]() {
+      (void)::closedir(d);
+    });
+
+    // everything is collected locally, and added to the traversal under one lock at the end
+    std::map<int, Traversal::DirRemoval> removals; // by rule
+    if (rule != NoRule)
+      removals.emplace(rule, Traversal::DirRemoval{path, {}, true});
+    auto removalFor = [&removals,&path](int r) -> Traversal::DirRemoval& { // a file in a directory that stays unless it is added
+      return removals.emplace(r, Traversal::DirRemoval{path, {}, false}).first->second;
+    };
+    std::vector<std::string> elfFiles, wildcardMatches;
+    unsigned numEntries = 0;
+    while (auto de = ::readdir(d)) {
+      if (::strcmp(de->d_name, ".") == 0 || ::strcmp(de->d_name, "..") == 0)
+        continue;
+      numEntries++;
+      auto subPath = join(path, de->d_name);
+      auto it = parts.find(subPath);
+      auto subRule = it != parts.end() ? it->second : rule;
+      std::string absPath;
+      if (subRule == NoRule && !removeGlobs.empty()) {
+        absPath = STR("/" << subPath);
+        auto glob = matchingGlob(removeGlobs, absPath);
+        if (glob != -1)
+          subRule = firstGlobRule + glob;
+      }
+
+      // the type, and the size of files that can be removed
+      struct stat sb;
+      auto type = de->d_type;
+      bool isStaticLib = removeStaticLibs && subRule == NoRule && type != DT_DIR && Util::Fs::hasExtension(de->d_name, ".a");
+      if (type == DT_UNKNOWN || (type != DT_DIR && (subRule != NoRule || isStaticLib))) {
+        if (::fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+          ERR("failed to stat '" << subPath << "': " << strerror(errno))
+        type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : S_ISLNK(sb.st_mode) ? DT_LNK : DT_UNKNOWN;
+        isStaticLib = isStaticLib && type == DT_REG;
+      }
+
+      // keep patterns
+      if (!keepGlobs.empty()) {
+        if (absPath.empty())
+          absPath = STR("/" << subPath);
+        if (matchingGlob(keepGlobs, absPath) != -1)
+          wildcardMatches.push_back(subPath);
+      }
+
+      // rules
+      if (type == DT_DIR) {
+        bool subInElfDir = inElfDir || subPath == elfDir;
+        pool.add([this,subPath,subRule,subInElfDir]() {
+          walk(subPath, subRule, subInElfDir);
+        });
+      } else if (subRule != NoRule) {
+        removalFor(subRule).files.push_back({de->d_name, type == DT_REG ? (uint64_t)sb.st_size : 0});
+      } else if (isStaticLib) {
+        removalFor(staticLibRule).files.push_back({de->d_name, (uint64_t)sb.st_size});
+      } else if (inElfDir && type == DT_REG && Util::Fs::isElfFileOrDirAt(fd, de->d_name, DT_REG) == 'E') {
+        elfFiles.push_back(subPath);
+      }
+    }
+    closeDir.doNow();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto &r : removals)
+      traversal.removals[r.first].dirs.push_back(std::move(r.second));
+    traversal.elfFiles.insert(traversal.elfFiles.end(), elfFiles.begin(), elfFiles.end());
+    traversal.wildcardMatches.insert(traversal.wildcardMatches.end(), wildcardMatches.begin(), wildcardMatches.end());
+    traversal.numDirs++;
+    traversal.numEntries += numEntries;
+  }
+};
+
+class Materializer {
+  class Dir {
+  public:
+    std::string path; // relative, without the leading slash
+    struct stat sb;
+  };
+
+  int                         srcTop;
+  int                         dstTop;
+  std::map<std::string, bool> parts;     // relative path -> exceptKept, paths that match removeGlobs are added as they are found
+  std::vector<std::string>    removeGlobs;
+  bool                        removeStaticLibs;
+  std::vector<Dir>            dirs;      // attributes are applied at the end, after their content is linked
+
+public:
+  Stats stats;
+
+  Materializer(const std::string &srcDir, const std::string &dstDir, const std::vector<Part> &newParts, const std::vector<std::string> &newRemoveGlobs,
+               bool newRemoveStaticLibs)
+  : removeGlobs(newRemoveGlobs),
+    removeStaticLibs(newRemoveStaticLibs)
+  {
+    srcTop = ::open(srcDir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (srcTop == -1)
+      ERR("failed to open the directory '" << srcDir << "': " << strerror(errno))
+    if (::mkdir(dstDir.c_str(), 0700) == -1 || (dstTop = ::open(dstDir.c_str(), O_RDONLY|O_DIRECTORY)) == -1) {
+      auto err = STR("failed to create the directory '" << dstDir << "': " << strerror(errno));
+      (void)::close(srcTop);
+      ERR(err)
+    }
+    for (auto &part : newParts)
+      parts[relative(part.path)] = part.exceptKept;
+    struct stat sb;
+    if (::fstat(srcTop, &sb) == -1)
+      ERR("failed to stat '" << srcDir << "': " << strerror(errno))
+    dirs.push_back({"", sb});
+  }
+  ~Materializer() {
+    (void)::close(srcTop);
+    (void)::close(dstTop);
+  }
+
+  void linkAll(const std::string &path) { // path is a directory that exists in both trees
+    int srcFd = ::openat(srcTop, path.empty() ? "." : path.c_str(), O_RDONLY|O_DIRECTORY);
+    if (srcFd == -1)
+      ERR("failed to open the directory '" << path << "': " << strerror(errno))
+    auto d = ::fdopendir(srcFd);
+    if (d == nullptr) {
+      (void)::close(srcFd);
+      ERR("failed to read the directory '" << path << "': " << strerror(errno))
+    }
+    RunAtEnd closeDir([d]() {
+      (void)::closedir(d);
+    });
+    std::vector<std::string> subdirs; // recursion happens after the directory is read, with one directory open at a time
+    while (auto de = ::readdir(d)) {
+      if (::strcmp(de->d_name, ".") == 0 || ::strcmp(de->d_name, "..") == 0)
+        continue;
+      auto subPath = join(path, de->d_name);
+      if (parts.find(subPath) != parts.end())
+        continue; // pruned, kept paths under it are linked by linkExcept()
+      if (!removeGlobs.empty() && matchingGlob(removeGlobs, STR("/" << subPath)) != -1) {
+        parts[subPath] = true; // pruned the same way, kept paths win over patterns
+        continue;
+      }
+      struct stat sb;
+      if (::fstatat(srcFd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+        ERR("failed to stat '" << subPath << "': " << strerror(errno))
+      if (S_ISDIR(sb.st_mode)) {
+        makeDir(subPath, sb);
+        subdirs.push_back(subPath);
+      } else if (!(removeStaticLibs && S_ISREG(sb.st_mode) && Util::Fs::hasExtension(de->d_name, ".a"))) {
+        link(subPath);
+      }
+    }
+    closeDir.doNow();
+    for (auto &subdir : subdirs)
+      linkAll(subdir);
+  }
+
+  void linkExcept(const PathSet &except) { // the kept paths in the pruned parts
+    except.forEach([this](const std::string &absPath) {
+      auto path = relative(absPath);
+      if (!inKeptPart(path))
+        return; // outside of the pruned parts it is linked already, and in the removed parts it goes
+      // directories on the way
+      for (auto slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        auto dir = path.substr(0, slash);
+        struct stat sb;
+        if (::fstatat(dstTop, dir.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0)
+          continue;
+        if (::fstatat(srcTop, dir.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == -1)
+          return; // the kept path doesn't exist
+        if (!S_ISDIR(sb.st_mode)) {
+          link(dir); // a symlink on the way: the path that it leads to is kept on its own
+          return;
+        }
+        makeDir(dir, sb);
+      }
+      // the path itself
+      struct stat sb, sbDst;
+      if (::fstatat(srcTop, path.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == -1 || ::fstatat(dstTop, path.c_str(), &sbDst, AT_SYMLINK_NOFOLLOW) == 0)
+        return; // doesn't exist, or is linked already
+      if (S_ISDIR(sb.st_mode)) {
+        makeDir(path, sb); // a kept directory is kept whole
+        linkAll(path);
+      } else {
+        link(path);
+      }
+    });
+  }
+
+  void applyDirAttributes() {
+    std::sort(dirs.begin(), dirs.end(), [](const Dir &d1, const Dir &d2) {return d1.path > d2.path;}); // children first
+    for (auto &dir : dirs) {
+      auto name = dir.path.empty() ? "." : dir.path.c_str();
+      struct timespec times[2] = {dir.sb.st_atim, dir.sb.st_mtim};
+      if (::fchownat(dstTop, name, dir.sb.st_uid, dir.sb.st_gid, 0) == -1 || ::fchmodat(dstTop, name, dir.sb.st_mode & 07777, 0) == -1 ||
+          ::utimensat(dstTop, name, times, 0) == -1)
+        ERR("failed to set attributes of '" << dir.path << "': " << strerror(errno))
+    }
+  }
+
+private:
+  bool inKeptPart(const std::string &path) const { // is under a part with exceptKept, and not under any other part
+    bool kept = false;
+    for (auto slash = path.find('/'); ; slash = path.find('/', slash + 1)) {
+      auto it = parts.find(path.substr(0, slash));
+      if (it != parts.end()) {
+        if (!it->second)
+          return false;
+        kept = true;
+      }
+      if (slash == std::string::npos)
+        return kept;
+    }
+  }
+  void makeDir(const std::string &path, const struct stat &sb) {
+    if (::mkdirat(dstTop, path.c_str(), 0700) == -1)
+      ERR("failed to create the directory '" << path << "': " << strerror(errno))
+    dirs.push_back({path, sb});
+    stats.numDirs++;
+  }
+  void link(const std::string &path) { // hardlinks anything but directories, symlinks themselves are linked
+    if (::linkat(srcTop, path.c_str(), dstTop, path.c_str(), 0) == -1)
+      ERR("failed to link '" << path << "': " << strerror(errno))
+    stats.numLinks++;
+  }
+};
+
+//
+// interface
+//
+
+std::string Traversal::str() const {
+  return STR(numDirs << " directories, " << numEntries << " entries in " << std::fixed << std::setprecision(3) << seconds << " sec");
+}
+
+std::string RuleStats::str() const {
+  return STR(rule << ": " << numFiles << " files, " << std::fixed << std::setprecision(1) << numBytes/1e6 << " MB, "
+             << numDirs << " directories in " << std::setprecision(3) << seconds << " sec");
+}
+
+Traversal traverse(const std::string &root, const std::vector<Part> &parts, const std::vector<std::string> &removeGlobs, bool removeStaticLibs,
+                   const std::string &elfDir, const std::vector<std::string> &keepGlobs) {
+  auto tmStart = std::chrono::steady_clock::now();
+  Traverser traverser(root, parts, removeGlobs, removeStaticLibs, elfDir, keepGlobs);
+  traverser.run();
+  traverser.traversal.seconds = secondsSince(tmStart);
+  return std::move(traverser.traversal);
+}
+
+std::vector<RuleStats> remove(const std::string &root, const Traversal &traversal, const PathSet &except) {
+  std::vector<RuleStats> res;
+  ThreadPool pool;
+  for (auto &removal : traversal.removals) {
+    auto r = &removal;
+    auto tmStart = std::chrono::steady_clock::now();
+    RuleStats stats;
+    stats.rule = r->rule;
+    std::mutex mutex;
+    auto isKept = [r,&except](const std::string &path) { // relative path
+      return r->exceptKept && except.containsPathOrParent(path);
+    };
+
+    // files, relative to the fds of their directories
+    for (auto &dir : r->dirs)
+      pool.add([&root,&dir,&stats,&mutex,isKept]() {
+        if (dir.files.empty())
+          return;
+        auto dirPath = STR(root << "/" << dir.path);
+        int fd = ::open(dirPath.c_str(), O_RDONLY|O_DIRECTORY);
+        if (fd == -1)
+          ERR("failed to open the directory '" << dirPath << "': " << strerror(errno))
+        RunAtEnd closeFd([fd]() {
+          (void)::close(fd);
+        });
+        unsigned numFiles = 0;
+        uint64_t numBytes = 0;
+        for (auto &file : dir.files) {
+          if (isKept(join(dir.path, file.first.c_str())))
+            continue;
+          Util::Fs::unlinkAt(fd, file.first.c_str(), 0, dirPath);
+          numFiles++;
+          numBytes += file.second;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        stats.numFiles += numFiles;
+        stats.numBytes += numBytes;
+      });
+    pool.wait();
+
+    // directories, children first: those with kept paths under them stay
+    std::vector<const std::string*> dirs;
+    for (auto &dir : r->dirs)
+      if (dir.removeDir)
+        dirs.push_back(&dir.path);
+    std::sort(dirs.begin(), dirs.end(), [](auto p1, auto p2) {return depth(*p1) > depth(*p2);});
+    for (auto path : dirs) {
+      if (isKept(*path))
+        continue;
+      auto dirPath = STR(root << "/" << *path);
+      if (::unlinkat(AT_FDCWD, dirPath.c_str(), AT_REMOVEDIR) == -1) {
+        if (r->exceptKept && (errno == ENOTEMPTY || errno == EEXIST))
+          continue; // something under it is kept
+        Util::Fs::unlinkAt(AT_FDCWD, dirPath.c_str(), AT_REMOVEDIR, ""); // clears schg, or fails
+      }
+      stats.numDirs++;
+    }
+
+    stats.seconds = secondsSince(tmStart);
+    res.push_back(stats);
+  }
+
+  return res;
+}
+
+std::string Stats::str() const {
+  return STR(numDirs << " directories, " << numLinks << " links in " << std::fixed << std::setprecision(3) << seconds << " sec");
+}
+
+Stats materialize(const std::string &srcDir, const std::string &dstDir, const std::vector<Part> &parts, const std::vector<std::string> &removeGlobs,
+                  const PathSet &except, bool removeStaticLibs) {
+  auto tmStart = std::chrono::steady_clock::now();
+  Materializer materializer(srcDir, dstDir, parts, removeGlobs, removeStaticLibs);
+  materializer.linkAll("");
+  materializer.linkExcept(except);
+  materializer.applyDirAttributes();
+  materializer.stats.seconds = secondsSince(tmStart);
+  return materializer.stats;
+}
+
+}
@@ -0,0 +1,97 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Prune: removes what a crate doesn't need from its jail tree
+//
+// The tree is traversed once, in parallel, and every directory is read only once: the traversal finds the ELF files
+// whose dependencies are kept, the paths that match the keep wildcards, and what each pruning rule would remove.
+// The removal itself happens after the set of kept paths is complete, by the lists that the traversal has made,
+// so that nothing is read again.
+//
+// What is pruned is given by parts, which are the fixed lists of the base, and by patterns, which the spec supplies
+// for any path of the tree. The patterns are globs of absolute paths: '*' and '?' match within one path component,
+// "[...]" is a class of characters ("[!...]" negates it), and '**' matches across components, with "/**/" matching
+// "/" as well. A directory that matches is pruned with everything under it. The kept paths win over the patterns.
+//
+// Alternatively, the pruned tree is built additively: only what is kept is hardlinked from the build tree into
+// a fresh tree, so that the work is proportional to the size of the crate, and not to the size of the base plus
+// the packages.
+//
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+class PathSet;
+
+namespace Prune {
+
+class Part { // a part of the tree that is pruned
+public:
+  std::string path;
+  bool        exceptKept; // the paths of the 'except' set stay, the rest goes
+};
+
+class Traversal { // what the traversal has found
+public:
+  class DirRemoval { // entries of one directory
+  public:
+    std::string                                   path;      // relative to the root
+    std::vector<std::pair<std::string, uint64_t>> files;     // names and sizes of everything but directories
+    bool                                          removeDir; // the directory itself goes too
+  };
+  class RuleRemoval {
+  public:
+    std::string             rule;       // the path of the part, the pattern, or "*.a" for static libraries
+    bool                    exceptKept;
+    std::vector<DirRemoval> dirs;       // in no particular order
+  };
+
+  std::vector<std::string> elfFiles;        // under the ELF directory, relative to the root
+  std::vector<std::string> wildcardMatches; // relative to the root
+  std::vector<RuleRemoval> removals;        // one for each part and pattern, and one for static libraries, in the order of removal
+  unsigned                 numDirs = 0;
+  unsigned                 numEntries = 0;
+  double                   seconds = 0;
+
+  std::string str() const;
+};
+
+class RuleStats { // what a rule has removed
+public:
+  std::string rule;
+  unsigned    numFiles = 0;
+  uint64_t    numBytes = 0;
+  unsigned    numDirs = 0;
+  double      seconds = 0;
+
+  std::string str() const;
+};
+
+// traverses the tree under root, removeGlobs are the patterns of what is pruned outside of the parts, elfDir is where ELF
+// files are looked for (none when it is empty), keepGlobs are the patterns that are reported in wildcardMatches
+Traversal traverse(const std::string &root, const std::vector<Part> &parts, const std::vector<std::string> &removeGlobs, bool removeStaticLibs,
+                   const std::string &elfDir, const std::vector<std::string> &keepGlobs);
+
+// removes what the traversal has found, but the paths of 'except' (and what is under them) in the parts and the
+// patterns that keep them
+std::vector<RuleStats> remove(const std::string &root, const Traversal &traversal, const PathSet &except);
+
+class Stats {
+public:
+  unsigned numDirs = 0;
+  unsigned numLinks = 0; // files, symlinks and other non-directories
+  double   seconds = 0;
+
+  std::string str() const;
+};
+
+// creates dstDir with everything of srcDir but the pruned parts and patterns, and with the paths of 'except' under
+// the parts and the patterns that keep them; the paths in parts and in except are relative to srcDir
+Stats materialize(const std::string &srcDir, const std::string &dstDir, const std::vector<Part> &parts, const std::vector<std::string> &removeGlobs,
+                  const PathSet &except, bool removeStaticLibs);
+
+}
@@ -8,6 +8,12 @@
 #include "net.h"
 #include "scripts.h"
 #include "ctx.h"
+#include "extract.h"
+#include "archive.h"
+#include "cache.h"
+#include "store.h"
+#include "codec.h"
+#include "misc.h"
 #include "util.h"
 #include "err.h"
 #include "commands.h"
@@ -31,6 +37,9 @@ extern "C" { // sys/jail.h isn't C++-safe: https://bugs.freebsd.org/bugzilla/sho
 #include <memory>
 #include <limits>
 #include <filesystem>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 
 #define ERR(msg...) ERR2("running a crate container", msg)
 
@@ -49,6 +58,7 @@ static const char* user = ::getenv("USER");
 static bool optionInitializeRc = false; // this pulls a lot of dependencies, and starts a lot of things that we don't need in crate
 static unsigned fwRuleBaseIn = 19000;  // ipfw rule number base for in rules: in rules should be before out rules because of rule conflicts
 static unsigned fwRuleBaseOut = 59000; // ipfw rule number base TODO Need to investigate how to eliminate rule conflicts.
+static const std::vector<std::string> defaultWritablePaths = {"/etc", "/var", "/tmp", "/root", "/home", "/usr/local/etc"}; // copied, not hardlinked, when the jail is cloned from the cache
 
 // hosts's default gateway network parameters
 static std::string gwIface;
@@ -70,6 +80,7 @@ static std::string argsToString(int argc, char** argv) {
 //
 bool runCrate(const Args &args, int argc, char** argv, int &outReturnCode) {
   LOG("'run' command is invoked, " << argc << " arguments are provided")
+  auto tmStart = std::chrono::steady_clock::now();
 
   // variables
   int res;
@@ -96,12 +107,39 @@ bool runCrate(const Args &args, int argc, char** argv, int &outReturnCode) {
     m->mount();
   };
 
-  // extract the crate archive into the jail directory
+  // extract the crate archive into the jail directory, or into the extraction cache from where it is cloned below
+  std::string cachedTree;
+  std::string cacheKey = args.runCache ? Cache::crateKey(args.runCrateFile) : "";
+  if ((!args.runCache || !Cache::isExtracted(cacheKey)) && Archive::isCrateArchive(args.runCrateFile.c_str())) {
+    // thin crates share their chunks with other crates through the chunk store, which is only read when the crate is extracted
+    Archive::Reader archive(args.runCrateFile);
+    if (archive.chunked() && Store::import(archive))
+      LOG("imported the crate file " << args.runCrateFile << " into the chunk store")
+  }
   LOG("extracting the crate file " << args.runCrateFile << " into " << jailPath)
-  Util::runCommand(STR(Cmd::xz << " < " << args.runCrateFile << " | tar xf - -C " << jailPath), "extract the crate file into the jail directory");
+  if (args.runCache) {
+    Extract::Stats stats;
+    cachedTree = Cache::extractedPath(cacheKey);
+    if (Cache::extract(args.runCrateFile, cacheKey, stats))
+      LOG("done extracting the crate file " << args.runCrateFile << " into the cache " << cachedTree << ": " << stats.str())
+    else
+      LOG("the crate file " << args.runCrateFile << " is already extracted in the cache " << cachedTree)
+  } else if (args.runExtractInProcess || Codec::sniffFile(args.runCrateFile.c_str()) != Codec::TypeXz) { // the seekable format and zstd can only be extracted in-process
+    auto stats = Extract::crateFile(args.runCrateFile, jailPath);
+    LOG("done extracting the crate file " << args.runCrateFile << ": " << stats.str())
+  } else {
+    Util::runCommand(STR(Cmd::xz << " --decompress < " << args.runCrateFile << " | tar xf - -C " << jailPath), "extract the crate file into the jail directory");
+    LOG("done extracting the crate file " << args.runCrateFile)
+  }
 
   // parse +CRATE.SPEC
-  auto spec = parseSpec(J("/+CRATE.SPEC")).preprocess();
+  auto spec = parseSpec(cachedTree.empty() ? J("/+CRATE.SPEC") : STR(cachedTree << "/+CRATE.SPEC")).preprocess();
+
+  // clone the cached tree: files that the container can write are copied, the rest is hardlinked
+  if (!cachedTree.empty()) {
+    auto stats = Cache::cloneExtracted(cacheKey, jailPath, defaultWritablePaths + spec.runWritable);
+    LOG("done cloning the cached tree into " << jailPath << ": " << stats.str())
+  }
 
   // check the pre-conditions
   if (spec.optionExists("net")) {
@@ -450,6 +488,7 @@ bool runCrate(const Args &args, int argc, char** argv, int &outReturnCode) {
 
   // run the process
   runScript("run:before-execute");
+  LOG("time-to-exec: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count() << " sec")
   int returnCode = 0;
   if (!spec.runCmdExecutable.empty()) {
     LOG("running the command in jail: env=" << jailEnv)
@@ -26,6 +26,35 @@
 static std::list<std::string> allOptionsLst = {"x11", "net", "ssl-certs", "tor", "video", "gl", "no-rm-static-libs", "dbg-ktrace"}; // the order is important for option processing
 static std::set<std::string> allOptionsSet(std::begin(allOptionsLst), std::end(allOptionsLst));
 
+// prune presets: the patterns that they remove and keep
+static bool prunePreset(const std::string &preset, std::vector<std::string> &remove, std::vector<std::string> &keep) {
+  auto eq = preset.find('=');
+  auto name = preset.substr(0, eq);
+  auto arg = eq != std::string::npos ? preset.substr(eq + 1) : "";
+  if (name == "docs" && eq == std::string::npos) {
+    for (auto p : {"/usr/local/share/doc", "/usr/local/share/gtk-doc", "/usr/local/share/examples", "/usr/local/share/info",
+                   "/usr/local/share/man", "/usr/local/info", "/usr/local/man"})
+      remove.push_back(p);
+  } else if (name == "headers" && eq == std::string::npos) {
+    remove.push_back("/usr/local/include");
+    remove.push_back("/usr/local/lib/*/include"); // glib-2.0/include, etc.
+  } else if (name == "libtool" && eq == std::string::npos) {
+    remove.push_back("/usr/local/lib/**/*.la");
+  } else if (name == "locales-except" && !arg.empty()) { // locales-except=en,de
+    for (auto dir : {"/usr/local/share/locale", "/usr/share/locale"}) {
+      remove.push_back(STR(dir << "/*"));
+      keep.push_back(STR(dir << "/C"));   // the C locales of the base are always kept
+      keep.push_back(STR(dir << "/C.*"));
+      for (auto &lang : Util::splitString(arg, ","))
+        for (auto suffix : {"", "_*", ".*", "@*"})
+          keep.push_back(STR(dir << "/" << lang << suffix));
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
 // helpers
 static std::string AsString(const YAML::Node &node) {
   return node.template as<std::string>();
@@ -247,6 +276,11 @@ Spec Spec::preprocess() const {
   if (O("dbg-ktrace", true))
     spec.baseKeep.push_back("/usr/bin/ktrace");
 
+  // prune presets => their patterns
+  for (auto &preset : spec.prunePresets)
+    (void)prunePreset(preset, spec.pruneRemove, spec.pruneKeep); // validated in Spec::validate
+  spec.prunePresets.clear();
+
   return spec;
 }
 
@@ -275,6 +309,11 @@ void Spec::validate() const {
     if (!isFullPath(runCmdExecutable))
       ERR("the executable path has to be a full path, executable=" << runCmdExecutable)
 
+  // writable paths must be full paths
+  for (auto &w : runWritable)
+    if (!isFullPath(w))
+      ERR("the writable path has to be a full path, writable=" << w)
+
   // shared directories must be full paths
   for (auto &dirShare : dirsShare)
     if (!isFullPath(Util::pathSubstituteVarsInPath(dirShare.first)) || !isFullPath(Util::pathSubstituteVarsInPath(dirShare.second)))
@@ -285,6 +324,19 @@ void Spec::validate() const {
     if (!isFullPath(Util::pathSubstituteVarsInPath(fileShare.first)) || !isFullPath(Util::pathSubstituteVarsInPath(fileShare.second)))
       ERR("the shared directory paths have to be a full paths, share=" << fileShare.first << "->" << fileShare.second)
 
+  // prune patterns must be full paths
+  for (auto pv : {&baseRemove, &pruneRemove, &pruneKeep})
+    for (auto &p : *pv)
+      if (!isFullPath(p))
+        ERR("the prune pattern has to be a full path, pattern=" << p)
+
+  // prune presets must be from the supported set
+  for (auto &preset : prunePresets) {
+    std::vector<std::string> remove, keep;
+    if (!prunePreset(preset, remove, keep))
+      ERR("the unknown prune preset '" << preset << "' was supplied")
+  }
+
   // options must be from the supported set
   for (auto &o : options)
     if (allOptionsSet.find(o.first) == allOptionsSet.end())
@@ -360,6 +412,18 @@ Spec parseSpec(const std::string &fname) {
           ERR("unknown element base/" << b.first << " in spec")
         }
       }
+    } else if (isKey(k, "prune")) {
+      for (auto b : k.second) {
+        if (isKey(b, "presets")) {
+          listOrScalarOnly(b.second, spec.prunePresets, "prune/presets");
+        } else if (isKey(b, "remove")) {
+          listOrScalarOnly(b.second, spec.pruneRemove, "prune/remove");
+        } else if (isKey(b, "keep")) {
+          listOrScalarOnly(b.second, spec.pruneKeep, "prune/keep");
+        } else {
+          ERR("unknown element prune/" << b.first << " in spec")
+        }
+      }
     } else if (isKey(k, "pkg")) {
       for (auto b : k.second) {
         if (isKey(b, "install")) {
@@ -393,6 +457,8 @@ Spec parseSpec(const std::string &fname) {
           }
         } else if (isKey(b, "service")) {
           listOrScalarOnly(b.second, spec.runServices, "run/service");
+        } else if (isKey(b, "writable")) {
+          listOrScalarOnly(b.second, spec.runWritable, "run/writable");
         } else {
           ERR("unknown element run/" << b.first << " in spec")
         }
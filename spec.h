@@ -36,7 +36,11 @@ public:
   };
   std::vector<std::string>                           baseKeep;
   std::vector<std::string>                           baseKeepWildcard;
-  std::vector<std::string>                           baseRemove;
+  std::vector<std::string>                           baseRemove;              // 0..oo patterns of base paths to remove, see prune.h for the syntax
+
+  std::vector<std::string>                           prunePresets;            // 0..oo named sets of prune rules, expanded into pruneRemove/pruneKeep by preprocess()
+  std::vector<std::string>                           pruneRemove;             // 0..oo patterns of paths to remove, in base and in /usr/local
+  std::vector<std::string>                           pruneKeep;               // 0..oo patterns of paths to keep, they win over pruneRemove and baseRemove
 
   std::vector<std::string>                           pkgInstall;              // 0..oo packages to install
   std::vector<std::pair<std::string, std::string>>   pkgLocalOverride;        // 0..oo packages to override
@@ -46,6 +50,7 @@ public:
   std::string                                        runCmdExecutable;        // 0..1 executables can be run
   std::string                                        runCmdArgs;              // can only be set when runCmdExecutable is set, always has a leading space when not blank
   std::vector<std::string>                           runServices;             // 0..oo services can be run
+  std::vector<std::string>                           runWritable;             // 0..oo paths that the container writes into, in addition to the default ones
 
   std::vector<std::pair<std::string, std::string>>   dirsShare;               // any number of directories can be shared, {from -> to} mappings are elements
   std::vector<std::pair<std::string, std::string>>   filesShare;              // any number of files can be shared, {from -> to} mappings are elements
@@ -0,0 +1,239 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "store.h"
+#include "archive.h"
+#include "threads.h"
+#include "locs.h"
+#include "misc.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iomanip>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+#define ERR(msg...) ERR2("chunk store", msg)
+
+namespace Store {
+
+//
+// helpers
+//
+
+static std::string storePath(const char *sub) {
+  return STR(Locations::cacheDirectoryPath << "/chunks" << sub);
+}
+
+static std::string chunkPath(const std::string &hex) {
+  return STR(storePath("/data/") << hex.substr(0, 2) << "/" << hex);
+}
+
+static std::string cratePath(const std::string &key) {
+  return STR(storePath("/crates/") << key);
+}
+
+static int lockStore() {
+  createCacheDirectoryIfNeeded();
+  createCacheDirectoryIfNeeded("/chunks");
+  createCacheDirectoryIfNeeded("/chunks/data");
+  createCacheDirectoryIfNeeded("/chunks/crates");
+  int fd = ::open(storePath("/lock").c_str(), O_RDWR|O_CREAT|O_EXLOCK, 0600);
+  if (fd == -1)
+    ERR("failed to lock the chunk store: " << strerror(errno))
+  return fd;
+}
+
+static void writeChunk(const std::string &hex, const std::vector<uint8_t> &data) {
+  auto dir = STR(storePath("/data/") << hex.substr(0, 2));
+  if (::mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+    ERR("failed to create the directory '" << dir << "': " << strerror(errno))
+
+  // write it under a temporary name, readers only see complete chunks
+  auto path = chunkPath(hex);
+  auto tmpPath = STR(path << ".tmp");
+  int fd = ::open(tmpPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd == -1)
+    ERR("failed to create the chunk '" << tmpPath << "': " << strerror(errno))
+  for (size_t off = 0; off < data.size();) {
+    auto res = ::write(fd, data.data() + off, data.size() - off);
+    if (res == -1) {
+      auto err = errno;
+      (void)::close(fd);
+      (void)::unlink(tmpPath.c_str());
+      ERR("failed to write the chunk '" << tmpPath << "': " << strerror(err))
+    }
+    off += res;
+  }
+  if (::close(fd) == -1 || ::rename(tmpPath.c_str(), path.c_str()) == -1)
+    ERR("failed to store the chunk '" << path << "': " << strerror(errno))
+}
+
+static void readCounters(uint64_t &numHits, uint64_t &numMisses) {
+  numHits = numMisses = 0;
+  std::ifstream file(storePath("/stats"));
+  std::string name;
+  uint64_t value;
+  while (file >> name >> value)
+    if (name == "hits")
+      numHits = value;
+    else if (name == "misses")
+      numMisses = value;
+}
+
+static void addCounters(uint64_t numHits, uint64_t numMisses) { // under the store lock
+  uint64_t oldHits, oldMisses;
+  readCounters(oldHits, oldMisses);
+  auto path = storePath("/stats");
+  std::ofstream file(STR(path << ".tmp"), std::ios::trunc);
+  file << "hits " << oldHits + numHits << std::endl;
+  file << "misses " << oldMisses + numMisses << std::endl;
+  file.close();
+  if (!file || ::rename(CSTR(path << ".tmp"), path.c_str()) == -1)
+    ERR("failed to update the chunk store statistics")
+}
+
+//
+// interface
+//
+
+std::string Stats::str() const {
+  auto percent = [](uint64_t part, uint64_t whole) {
+    return whole > 0 ? 100.*part/whole : 0.;
+  };
+  return STR(std::fixed << std::setprecision(1)
+             << "crates:          " << numCrates << std::endl
+             << "chunks:          " << numChunks << std::endl
+             << "stored:          " << storedBytes/1e6 << " MB" << std::endl
+             << "referenced:      " << referencedBytes/1e6 << " MB" << std::endl
+             << "dedupe ratio:    " << std::setprecision(2) << (storedBytes > 0 ? double(referencedBytes)/storedBytes : 1.) << std::endl
+             << "saved:           " << std::setprecision(1) << (double(referencedBytes) - double(storedBytes))/1e6 << " MB" << std::endl
+             << "disk cost:       " << storedBytes/1e6 << " MB on top of the crate files, which still embed all of their blocks" << std::endl
+             << "hit rate:        " << percent(numHits, numHits + numMisses) << "% (" << numHits << " hits, " << numMisses << " misses)");
+}
+
+bool import(const Archive::Reader &archive) {
+  int fdLock = lockStore();
+  RunAtEnd unlock([fdLock]() {
+    (void)::close(fdLock);
+  });
+
+  auto crateDir = cratePath(archive.contentHash());
+  if (Util::Fs::dirExists(crateDir))
+    return false;
+
+  // chunks that the crate references, and which of them are missing
+  std::map<std::string, unsigned> chunks; // by hash: the first block with it
+  auto &blocks = archive.blocks();
+  for (unsigned b = 0; b < blocks.size(); b++)
+    chunks.emplace(Util::toHex(blocks[b].hash, sizeof(blocks[b].hash)), b);
+  std::vector<std::pair<std::string, unsigned>> missing;
+  for (auto &c : chunks)
+    if (!Util::Fs::fileExists(chunkPath(c.first)))
+      missing.push_back(c);
+
+  // decompress the missing chunks into the store
+  {
+    ThreadPool pool;
+    for (auto &m : missing)
+      pool.add([&archive,&m]() {
+        std::vector<uint8_t> data;
+        archive.readBlock(m.second, data);
+        writeChunk(m.first, data);
+      });
+    pool.wait();
+  }
+
+  // reference the chunks from the crate, and publish the references all at once
+  auto tmpDir = STR(crateDir << ".tmp");
+  if (Util::Fs::dirExists(tmpDir))
+    Util::Fs::rmdirHier(tmpDir); // left behind by a failed import
+  Util::Fs::mkdir(tmpDir, 0700);
+  for (auto &c : chunks)
+    Util::Fs::link(chunkPath(c.first), STR(tmpDir << "/" << c.first));
+  if (::rename(tmpDir.c_str(), crateDir.c_str()) == -1)
+    ERR("failed to publish the references of the crate '" << crateDir << "': " << strerror(errno))
+
+  addCounters(chunks.size() - missing.size(), missing.size());
+  return true;
+}
+
+bool remove(const Archive::Reader &archive) {
+  int fdLock = lockStore();
+  RunAtEnd unlock([fdLock]() {
+    (void)::close(fdLock);
+  });
+
+  auto crateDir = cratePath(archive.contentHash());
+  if (!Util::Fs::dirExists(crateDir))
+    return false;
+
+  for (const auto &entry : fs::directory_iterator(crateDir)) {
+    auto chunk = chunkPath(entry.path().filename());
+    Util::Fs::unlink(entry.path());
+    struct stat sb;
+    if (::stat(chunk.c_str(), &sb) == 0 && sb.st_nlink == 1) // no other crate references it
+      Util::Fs::unlink(chunk);
+  }
+  Util::Fs::rmdir(crateDir);
+  return true;
+}
+
+Archive::FnBlockSource blockSource() {
+  return [](const Archive::Block &block, std::vector<uint8_t> &data) {
+    auto path = chunkPath(Util::toHex(block.hash, sizeof(block.hash)));
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false; // not in the store
+    RunAtEnd closeFd([fd]() {
+      (void)::close(fd);
+    });
+    data.resize(block.uncompressedSize);
+    size_t off = 0;
+    while (off < data.size()) {
+      auto res = ::read(fd, data.data() + off, data.size() - off);
+      if (res == -1)
+        ERR("failed to read the chunk '" << path << "': " << strerror(errno))
+      if (res == 0)
+        ERR("the chunk '" << path << "' is truncated")
+      off += res;
+    }
+    return true;
+  };
+}
+
+Stats stats() {
+  Stats stats;
+  auto dataDir = storePath("/data");
+  auto cratesDir = storePath("/crates");
+  if (Util::Fs::dirExists(cratesDir))
+    for (const auto &entry : fs::directory_iterator(cratesDir))
+      if (entry.path().extension() != ".tmp")
+        stats.numCrates++;
+  if (Util::Fs::dirExists(dataDir))
+    for (const auto &entry : fs::recursive_directory_iterator(dataDir)) {
+      struct stat sb;
+      if (entry.path().extension() == ".tmp" || ::lstat(entry.path().c_str(), &sb) == -1 || !S_ISREG(sb.st_mode))
+        continue;
+      stats.numChunks++;
+      stats.storedBytes += sb.st_size;
+      stats.referencedBytes += sb.st_size*(sb.st_nlink - 1);
+    }
+  readCounters(stats.numHits, stats.numMisses);
+  return stats;
+}
+
+}
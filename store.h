@@ -0,0 +1,43 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Store: the chunk store that chunked crates on this host share, in Locations::cacheDirectoryPath/chunks
+//
+// Blocks of chunked crates are kept there uncompressed, under their hash, so that blocks that several crates have
+// in common (libc, libcrypto, ...) are stored and decompressed once. Every imported crate has a directory of hardlinks
+// to the chunks that it references, so the reference count of a chunk is its link count less one.
+// A thin crate file still embeds all of its blocks, compressed, so that it can run on any host: the store saves
+// decompression, not disk, and the chunks on disk are an extra cost on top of the crate files. 'crate run' only
+// imports a crate when it extracts it, not when its tree is already in the extraction cache.
+//
+// Layout: data/<2 hex digits>/<hash>, crates/<crate content hash>/<hash>, stats, lock.
+//
+
+#include "archive.h"
+
+#include <string>
+
+#include <stdint.h>
+
+namespace Store {
+
+class Stats {
+public:
+  unsigned numCrates = 0;
+  unsigned numChunks = 0;
+  uint64_t storedBytes = 0;     // bytes of chunk data on disk
+  uint64_t referencedBytes = 0; // bytes of chunk data that crates reference, counting every reference
+  uint64_t numHits = 0;         // imported chunks that were already in the store
+  uint64_t numMisses = 0;       // imported chunks that had to be decompressed into the store
+
+  std::string str() const; // human readable report with the dedupe ratio, bytes saved, the extra disk cost and the hit rate
+};
+
+bool import(const Archive::Reader &archive); // adds the crate's chunks to the store, returns false when the crate was already imported
+bool remove(const Archive::Reader &archive); // drops the crate's references, and chunks that are no longer referenced
+Archive::FnBlockSource blockSource();        // reads blocks from the store
+Stats stats();
+
+}
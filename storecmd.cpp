@@ -0,0 +1,47 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "args.h"
+#include "archive.h"
+#include "store.h"
+#include "util.h"
+#include "err.h"
+#include "commands.h"
+
+#include <rang.hpp>
+
+#include <string>
+#include <iostream>
+
+#define ERR(msg...) ERR2("managing the chunk store", msg)
+
+#define LOG(msg...) \
+  { \
+    if (args.logProgress) \
+      std::cerr << rang::fg::gray << Util::tmSecMs() << ": " << msg << rang::style::reset << std::endl; \
+  }
+
+//
+// interface
+//
+
+bool manageStore(const Args &args) {
+  LOG("'store " << args.storeSubcommand << "' command is invoked")
+
+  if (args.storeSubcommand == "stats") {
+    std::cout << Store::stats().str() << std::endl;
+  } else if (args.storeSubcommand == "import") {
+    Archive::Reader archive(args.storeCrateFile);
+    if (Store::import(archive))
+      std::cout << "the crate '" << args.storeCrateFile << "' has been imported into the chunk store" << std::endl;
+    else
+      std::cout << "the crate '" << args.storeCrateFile << "' is already in the chunk store" << std::endl;
+  } else if (args.storeSubcommand == "remove") {
+    Archive::Reader archive(args.storeCrateFile);
+    if (!Store::remove(archive))
+      ERR("the crate '" << args.storeCrateFile << "' isn't in the chunk store")
+    std::cout << "the crate '" << args.storeCrateFile << "' has been removed from the chunk store" << std::endl;
+  }
+
+  LOG("'store " << args.storeSubcommand << "' command has succeeded")
+  return true;
+}
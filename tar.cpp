@@ -0,0 +1,503 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "tar.h"
+#include "util.h"
+#include "err.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <string>
+#include <algorithm>
+
+#define ERR(msg...) ERR2("tar archive", msg)
+
+namespace Tar {
+
+//
+// helpers
+//
+
+static const size_t blockSize = 512;
+
+static uint64_t parseNumber(const uint8_t *field, size_t size) {
+  if (field[0] & 0x80) { // GNU base-256 encoding
+    uint64_t n = field[0] & 0x3f;
+    for (size_t i = 1; i < size; i++)
+      n = (n << 8) | field[i];
+    return n;
+  }
+  uint64_t n = 0;
+  size_t i = 0;
+  while (i < size && (field[i] == ' ' || field[i] == 0))
+    i++;
+  for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+    n = (n << 3) | (field[i] - '0');
+  return n;
+}
+
+static std::string parseString(const uint8_t *field, size_t size) {
+  return std::string((const char*)field, ::strnlen((const char*)field, size));
+}
+
+static bool isZeroBlock(const uint8_t *block) {
+  for (size_t i = 0; i < blockSize; i++)
+    if (block[i] != 0)
+      return false;
+  return true;
+}
+
+static void putNumber(uint8_t *field, size_t size, uint64_t n) {
+  if (n >> 3*(size - 1) != 0) { // doesn't fit in octal digits: GNU base-256 encoding
+    for (size_t i = size; i > 0; i--, n >>= 8)
+      field[i-1] = n & 0xff;
+    field[0] |= 0x80;
+    return;
+  }
+  for (size_t i = size - 1; i > 0; i--, n >>= 3)
+    field[i-1] = '0' + (n & 7);
+  field[size-1] = 0;
+}
+
+static void putString(uint8_t *field, size_t size, const std::string &str) {
+  ::memcpy(field, str.c_str(), std::min(size, str.size()));
+}
+
+static void putPaxRecord(std::string &pax, const char *key, const std::string &value) {
+  // the record's length includes the length field itself
+  auto rest = STR(" " << key << "=" << value << "\n");
+  auto len = rest.size() + 1;
+  while (std::to_string(len).size() + rest.size() != len)
+    len++;
+  pax += STR(len << rest);
+}
+
+static bool checksumOk(const uint8_t *block) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < blockSize; i++)
+    sum += i >= 148 && i < 156 ? ' ' : block[i];
+  return sum == parseNumber(block + 148, 8);
+}
+
+std::string normalizePath(const std::string &path) {
+  std::string p = path;
+  while (p.size() >= 2 && p[0] == '.' && p[1] == '/')
+    p = p.substr(2);
+  while (!p.empty() && p[0] == '/')
+    p = p.substr(1);
+  while (!p.empty() && p[p.size()-1] == '/')
+    p.resize(p.size() - 1);
+  if (p == ".")
+    p.clear();
+  return p;
+}
+
+static std::string sparseName(const std::string &path) { // the ustar name of a sparse file, so that readers that don't know the format don't overwrite it
+  auto slash = path.rfind('/');
+  return slash == std::string::npos ? STR("GNUSparseFile.0/" << path) : STR(path.substr(0, slash) << "/GNUSparseFile.0" << path.substr(slash));
+}
+
+static std::string sparseMap(const Entry &entry) { // the number of segments, and then their offsets and sizes, a number per line
+  auto map = STR(entry.sparse.size() << "\n");
+  for (auto &seg : entry.sparse)
+    map += STR(seg.first << "\n" << seg.second << "\n");
+  map.resize(map.size() + (blockSize - map.size() % blockSize) % blockSize, '\0');
+  return map;
+}
+
+static bool parseSparseMap(const std::string &map, std::vector<std::pair<uint64_t, uint64_t>> &sparse) { // returns false when the map isn't complete yet
+  std::vector<uint64_t> numbers;
+  size_t off = 0;
+  while (numbers.empty() || numbers.size() < 1 + 2*numbers[0]) {
+    auto nl = map.find('\n', off);
+    if (nl == std::string::npos)
+      return false;
+    if (nl == off || map.find_first_not_of("0123456789", off) < nl)
+      ERR("malformed sparse map")
+    numbers.push_back(std::stoull(map.substr(off, nl - off)));
+    off = nl + 1;
+    if (numbers[0] > map.size())
+      ERR("malformed sparse map")
+  }
+  sparse.clear();
+  for (uint64_t i = 0; i < numbers[0]; i++)
+    sparse.push_back({numbers[1 + 2*i], numbers[2 + 2*i]});
+  return true;
+}
+
+static std::vector<std::pair<std::string, std::string>> parsePax(const std::string &data) {
+  // records are: "%d %s=%s\n", the number being the length of the whole record
+  std::vector<std::pair<std::string, std::string>> kv;
+  size_t off = 0;
+  while (off < data.size()) {
+    auto space = data.find(' ', off);
+    if (space == std::string::npos)
+      ERR("malformed pax header")
+    auto len = std::stoul(data.substr(off, space - off));
+    if (len == 0 || off + len > data.size() || data[off + len - 1] != '\n')
+      ERR("malformed pax record")
+    auto rec = data.substr(space + 1, off + len - 1 - (space + 1));
+    auto eq = rec.find('=');
+    if (eq == std::string::npos)
+      ERR("malformed pax record '" << rec << "'")
+    kv.push_back({rec.substr(0, eq), rec.substr(eq + 1)});
+    off += len;
+  }
+  return kv;
+}
+
+//
+// interface
+//
+
+uint64_t dataSize(const Entry &entry) {
+  if (entry.sparse.empty())
+    return entry.size;
+  uint64_t size = 0;
+  for (auto &seg : entry.sparse)
+    size += seg.second;
+  return size;
+}
+
+void Reader::Handler::onHole(uint64_t size) {
+  static const uint8_t zeros[0x10000] = {};
+  while (size > 0) {
+    auto n = (size_t)std::min(size, (uint64_t)sizeof(zeros));
+    onData(zeros, n);
+    size -= n;
+  }
+}
+
+Reader::Reader(Handler &newHandler)
+: handler(newHandler)
+{ }
+
+void Reader::feed(const uint8_t *data, size_t size) {
+  while (size > 0)
+    switch (state) {
+    case StHeader: {
+      if (blockFill == 0 && !inEntry)
+        offsetEntry = offset;
+      auto n = std::min(size, blockSize - blockFill);
+      ::memcpy(block + blockFill, data, n);
+      blockFill += n;
+      offset += n;
+      data += n;
+      size -= n;
+      if (blockFill == blockSize) {
+        blockFill = 0;
+        onHeader();
+      }
+      break;
+    } case StSparseMap: {
+      // the map is read block by block until it is complete
+      auto n = (size_t)std::min(std::min((uint64_t)size, remaining), (uint64_t)(blockSize - meta.size() % blockSize));
+      meta.append((const char*)data, n);
+      remaining -= n;
+      offset += n;
+      data += n;
+      size -= n;
+      if (meta.size() % blockSize == 0 || remaining == 0)
+        onSparseMapEnd();
+      break;
+    } case StData:
+      case StMeta: {
+      auto n = (size_t)std::min((uint64_t)size, remaining);
+      if (state == StData)
+        deliver(data, n);
+      else
+        meta.append((const char*)data, n);
+      remaining -= n;
+      offset += n;
+      data += n;
+      size -= n;
+      if (remaining == 0) {
+        if (state == StData)
+          endData();
+        else
+          onMetaEnd();
+        afterData();
+      }
+      break;
+    } case StPadding: {
+      auto n = (size_t)std::min((uint64_t)size, padding);
+      padding -= n;
+      offset += n;
+      data += n;
+      size -= n;
+      if (padding == 0)
+        state = StHeader;
+      break;
+    } case StEnd:
+      return; // ignore everything after the end-of-archive marker
+    }
+}
+
+void Reader::finish() {
+  if (state != StEnd && !(state == StHeader && blockFill == 0 && numZeroBlocks > 0))
+    ERR("the archive is truncated")
+}
+
+void writeHeader(const Entry &entry, std::vector<uint8_t> &out) {
+  auto fillHeader = [](uint8_t *block, char type, const std::string &path, const std::string &linkPath,
+                       mode_t mode, uid_t uid, gid_t gid, time_t mtime, uint64_t size, unsigned devMajor, unsigned devMinor) {
+    putString(block, 100, path);
+    putNumber(block + 100, 8, mode & 07777);
+    putNumber(block + 108, 8, uid);
+    putNumber(block + 116, 8, gid);
+    putNumber(block + 124, 12, size);
+    putNumber(block + 136, 12, mtime > 0 ? mtime : 0);
+    block[156] = type;
+    putString(block + 157, 100, linkPath);
+    ::memcpy(block + 257, "ustar\0" "00", 8);
+    if (type == '3' || type == '4') {
+      putNumber(block + 329, 8, devMajor);
+      putNumber(block + 337, 8, devMinor);
+    }
+    uint64_t sum = 0;
+    ::memset(block + 148, ' ', 8);
+    for (size_t i = 0; i < blockSize; i++)
+      sum += block[i];
+    putNumber(block + 148, 7, sum);
+  };
+
+  // paths that don't fit go into a pax header, ustar only gets their beginning
+  std::string pax;
+  auto path = entry.path;
+  if (!entry.sparse.empty()) {
+    putPaxRecord(pax, "GNU.sparse.major", "1");
+    putPaxRecord(pax, "GNU.sparse.minor", "0");
+    putPaxRecord(pax, "GNU.sparse.name", entry.path);
+    putPaxRecord(pax, "GNU.sparse.realsize", std::to_string(entry.size));
+    path = sparseName(entry.path);
+  } else if (entry.path.size() > 100) {
+    putPaxRecord(pax, "path", entry.path);
+  }
+  if (entry.linkPath.size() > 100)
+    putPaxRecord(pax, "linkpath", entry.linkPath);
+  if (!pax.empty()) {
+    auto off = out.size();
+    out.resize(off + blockSize, 0);
+    fillHeader(out.data() + off, 'x', "PaxHeader", "", 0644, 0, 0, entry.mtime, pax.size(), 0, 0);
+    out.insert(out.end(), pax.begin(), pax.end());
+    writePadding(pax.size(), out);
+  }
+
+  // the sparse map is a part of the data
+  auto map = entry.sparse.empty() ? std::string() : sparseMap(entry);
+  auto off = out.size();
+  out.resize(off + blockSize, 0);
+  fillHeader(out.data() + off, entry.type, path, entry.linkPath,
+             entry.mode, entry.uid, entry.gid, entry.mtime, entry.type == '0' ? map.size() + dataSize(entry) : 0, entry.devMajor, entry.devMinor);
+  out.insert(out.end(), map.begin(), map.end());
+}
+
+void writePadding(uint64_t dataSize, std::vector<uint8_t> &out) {
+  out.resize(out.size() + (blockSize - dataSize % blockSize) % blockSize, 0);
+}
+
+void writeEnd(std::vector<uint8_t> &out) {
+  out.resize(out.size() + 2*blockSize, 0);
+}
+
+uint64_t Reader::entryOffset() const {
+  return offsetEntry;
+}
+
+uint64_t Reader::streamOffset() const {
+  return offset;
+}
+
+void Reader::onHeader() {
+  if (isZeroBlock(block)) {
+    if (++numZeroBlocks == 2)
+      state = StEnd;
+    return;
+  }
+  numZeroBlocks = 0;
+  if (!checksumOk(block))
+    ERR("header checksum mismatch")
+
+  auto type = (char)block[156];
+  auto size = parseNumber(block + 124, 12);
+  padding = (blockSize - size % blockSize) % blockSize;
+
+  // meta-entries
+  if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+    inEntry = type != 'g';
+    metaType = type;
+    meta.clear();
+    remaining = size;
+    state = StMeta;
+    if (remaining == 0) {
+      onMetaEnd();
+      afterData();
+    }
+    return;
+  }
+
+  // regular entry
+  auto &e = current;
+  e.type = type == 0 || type == '7' ? '0' : type; // contiguous files are regular files
+  std::string name = parseString(block, 100);
+  if (::memcmp(block + 257, "ustar", 5) == 0) {
+    auto prefix = parseString(block + 345, 155);
+    if (!prefix.empty())
+      name = STR(prefix << "/" << name);
+  }
+  e.path = !nextPath.empty() ? nextPath : name;
+  e.linkPath = !nextLinkPath.empty() ? nextLinkPath : parseString(block + 157, 100);
+  e.mode = parseNumber(block + 100, 8) & 07777;
+  e.uid = parseNumber(block + 108, 8);
+  e.gid = parseNumber(block + 116, 8);
+  e.mtime = parseNumber(block + 136, 12);
+  e.size = size;
+  e.devMajor = parseNumber(block + 329, 8);
+  e.devMinor = parseNumber(block + 337, 8);
+  e.sparse.clear();
+  std::string sparseMajor, sparsePath;
+  uint64_t sparseSize = 0;
+  for (auto &kv : nextPax)
+    if (kv.first == "path")
+      e.path = kv.second;
+    else if (kv.first == "linkpath")
+      e.linkPath = kv.second;
+    else if (kv.first == "size")
+      e.size = size = std::stoull(kv.second);
+    else if (kv.first == "uid")
+      e.uid = std::stoul(kv.second);
+    else if (kv.first == "gid")
+      e.gid = std::stoul(kv.second);
+    else if (kv.first == "mtime")
+      e.mtime = std::stoll(kv.second);
+    else if (kv.first == "GNU.sparse.major")
+      sparseMajor = kv.second;
+    else if (kv.first == "GNU.sparse.name")
+      sparsePath = kv.second;
+    else if (kv.first == "GNU.sparse.realsize" || kv.first == "GNU.sparse.size")
+      sparseSize = std::stoull(kv.second);
+  nextPath.clear();
+  nextLinkPath.clear();
+  nextPax.clear();
+  inEntry = false;
+  if (e.type != '0')
+    e.size = 0; // only regular files carry data (hardlinks of bsdtar can also carry it, but it is the same data)
+  remaining = size;
+  padding = (blockSize - size % blockSize) % blockSize;
+
+  // sparse files: their data begins with the map
+  if (!sparseMajor.empty() && e.type == '0') {
+    if (sparseMajor != "1")
+      ERR("unsupported version " << sparseMajor << " of the sparse file format of '" << e.path << "'")
+    if (!sparsePath.empty())
+      e.path = sparsePath;
+    e.size = sparseSize;
+    e.path = normalizePath(e.path);
+    meta.clear();
+    state = StSparseMap;
+    if (remaining == 0)
+      ERR("the sparse file '" << e.path << "' has no map")
+    return;
+  }
+
+  e.path = normalizePath(e.path);
+  if (e.type == '1')
+    e.linkPath = normalizePath(e.linkPath);
+  startData();
+}
+
+void Reader::onSparseMapEnd() {
+  if (!parseSparseMap(meta, current.sparse)) {
+    if (remaining == 0 || meta.size() > 0x100000)
+      ERR("the sparse map of '" << current.path << "' is truncated")
+    return; // read one more block
+  }
+  meta.clear();
+  uint64_t end = 0;
+  for (auto &seg : current.sparse) {
+    if (seg.first < end || seg.first + seg.second > current.size)
+      ERR("the sparse map of '" << current.path << "' is inconsistent")
+    end = seg.first + seg.second;
+  }
+  if (dataSize(current) != remaining)
+    ERR("the sparse map of '" << current.path << "' doesn't match its data")
+  startData();
+}
+
+void Reader::startData() { // remaining and padding are already set
+  sparseSeg = 0;
+  sparseSegDone = 0;
+  sparsePos = 0;
+  handler.onEntry(current);
+  if (remaining == 0) {
+    endData();
+    afterData();
+  } else if (current.size == 0) { // data that we don't deliver
+    padding += remaining;
+    remaining = 0;
+    handler.onEntryEnd();
+    afterData();
+  } else {
+    state = StData;
+  }
+}
+
+void Reader::deliver(const uint8_t *data, size_t size) {
+  if (current.sparse.empty()) {
+    handler.onData(data, size);
+    return;
+  }
+  // data of sparse files goes to its segments, holes between them are reported
+  auto &sparse = current.sparse;
+  while (size > 0) {
+    while (sparseSeg < sparse.size() && sparseSegDone == sparse[sparseSeg].second) {
+      sparseSeg++;
+      sparseSegDone = 0;
+    }
+    auto segPos = sparse[sparseSeg].first + sparseSegDone; // the map was checked against the data size
+    if (sparsePos < segPos) {
+      handler.onHole(segPos - sparsePos);
+      sparsePos = segPos;
+    }
+    auto n = (size_t)std::min((uint64_t)size, sparse[sparseSeg].second - sparseSegDone);
+    handler.onData(data, n);
+    sparseSegDone += n;
+    sparsePos += n;
+    data += n;
+    size -= n;
+  }
+}
+
+void Reader::endData() {
+  if (!current.sparse.empty() && sparsePos < current.size)
+    handler.onHole(current.size - sparsePos);
+  handler.onEntryEnd();
+}
+
+void Reader::onMetaEnd() {
+  auto stripNul = [](const std::string &s) {
+    auto nul = s.find('\0');
+    return nul == std::string::npos ? s : s.substr(0, nul);
+  };
+  switch (metaType) {
+  case 'x':
+    for (auto &kv : parsePax(meta))
+      nextPax.push_back(kv);
+    break;
+  case 'g':
+    break; // global headers don't carry anything that we need
+  case 'L':
+    nextPath = stripNul(meta);
+    break;
+  case 'K':
+    nextLinkPath = stripNul(meta);
+    break;
+  }
+  meta.clear();
+}
+
+void Reader::afterData() {
+  state = padding > 0 ? StPadding : StHeader;
+}
+
+}
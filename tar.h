@@ -0,0 +1,94 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Tar: streaming reader of tar archives (ustar, pax and GNU long names), and the writer of ustar headers
+//
+// Sparse files are stored in the GNU sparse 1.0 pax format: the data area begins with the map of data segments,
+// and only the segments follow. The reader hands holes over separately, so that they can be skipped by the writer.
+//
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace Tar {
+
+class Entry {
+public:
+  char        type;     // ustar typeflag: '0' file, '1' hardlink, '2' symlink, '3' char device, '4' block device, '5' directory, '6' fifo
+  std::string path;     // relative path, without the leading "./", empty for the top directory
+  std::string linkPath; // hardlink or symlink target
+  mode_t      mode;
+  uid_t       uid;
+  gid_t       gid;
+  time_t      mtime;
+  uint64_t    size;     // size of the data that follows, the real size for sparse files
+  unsigned    devMajor;
+  unsigned    devMinor;
+  std::vector<std::pair<uint64_t, uint64_t>> sparse; // data segments (offset, size) of a sparse file, ending with (size, 0), empty when it has no holes
+};
+
+std::string normalizePath(const std::string &path); // archive path as it appears in Entry::path
+uint64_t dataSize(const Entry &entry);              // bytes of data that are stored: all of it, or only the segments of a sparse file
+
+void writeHeader(const Entry &entry, std::vector<uint8_t> &out); // appends the header, preceded by a pax header when needed, and followed by the sparse map
+void writePadding(uint64_t dataSize, std::vector<uint8_t> &out); // appends the padding that follows the entry's data, dataSize is as returned by dataSize()
+void writeEnd(std::vector<uint8_t> &out);                        // appends the end-of-archive marker
+
+class Reader {
+public:
+  class Handler {
+  public:
+    virtual ~Handler() { }
+    virtual void onEntry(const Entry &entry) = 0;
+    virtual void onData(const uint8_t *data, size_t size) = 0; // data of the last entry, possibly in several pieces
+    virtual void onEntryEnd() = 0;
+    virtual void onHole(uint64_t size);                        // a hole in a sparse file, delivered as zeros through onData() unless overridden
+  };
+
+  Reader(Handler &newHandler);
+
+  void feed(const uint8_t *data, size_t size); // data can be split arbitrarily between calls
+  void finish();                               // fails when the archive was truncated
+  uint64_t entryOffset() const;                // stream offset of the first header (including meta-entries) of the last entry
+  uint64_t streamOffset() const;               // bytes consumed so far: in onEntry() this is where the entry's data begins
+
+private:
+  enum State {StHeader, StSparseMap, StData, StMeta, StPadding, StEnd};
+
+  Handler             &handler;
+  State               state = StHeader;
+  uint8_t             block[512];
+  size_t              blockFill = 0;
+  uint64_t            remaining = 0;   // remaining data bytes in the current entry or meta-entry
+  uint64_t            padding = 0;     // remaining padding bytes after the data
+  char                metaType = 0;    // 'x', 'g', 'L', 'K' while reading meta-data
+  std::string         meta;            // meta-data being collected
+  std::string         nextPath;        // overrides from pax and GNU meta-entries
+  std::string         nextLinkPath;
+  std::vector<std::pair<std::string, std::string>> nextPax;
+  unsigned            numZeroBlocks = 0;
+  uint64_t            offset = 0;      // bytes consumed so far
+  uint64_t            offsetEntry = 0; // stream offset where the current entry began
+  bool                inEntry = false; // meta-entries of the current entry were already seen
+  Entry               current;         // the entry whose sparse map or data is being read
+  unsigned            sparseSeg = 0;   // the data segment being delivered
+  uint64_t            sparseSegDone = 0;
+  uint64_t            sparsePos = 0;   // file offset of the next data
+
+  void onHeader();
+  void onSparseMapEnd();
+  void startData();
+  void deliver(const uint8_t *data, size_t size);
+  void endData();
+  void onMetaEnd();
+  void afterData();
+};
+
+}
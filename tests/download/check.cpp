@@ -0,0 +1,290 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+//
+// checks Download::toFile() against a local HTTP server: each argument names a case
+//   resume    a download that the consumer has interrupted continues from the chunks in <file>.part.state
+//   no-range  a server that reports the size but ignores Range is read over one connection
+//   retry     a connection that is cut in the middle of a chunk is continued from where it stopped
+//   mismatch  a download with the wrong SHA256 fails, and leaves neither the file nor the part file behind
+//
+
+#include "download.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <algorithm>
+
+static const uint64_t chunkSize = 0x400000; // the unit of range requests and of resuming in download.cpp
+static const uint64_t fileSize = 3*chunkSize + 12345;
+
+class Server { // serves one file over HTTP/1.1 on a loopback port, with a connection per request
+  std::vector<uint8_t>     data;
+  int                      fd;
+  unsigned                 port;
+  std::atomic<bool>        stop{false};
+  std::thread              thread;
+  std::vector<std::thread> connections;
+  std::atomic<bool>        cut{false};
+
+public:
+  bool                     ignoreRange = false;
+  uint64_t                 cutRangeFrom = 0;     // the first response from this offset stops in the middle of its chunk
+  std::atomic<unsigned>    numRequests{0};
+
+  Server(const std::vector<uint8_t> &newData) : data(newData) {
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sa;
+    ::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sa);
+    if (fd == -1 || ::bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 || ::listen(fd, 16) == -1 ||
+        ::getsockname(fd, (struct sockaddr*)&sa, &len) == -1)
+      ERR2("test server", "failed to listen: " << strerror(errno))
+    port = ntohs(sa.sin_port);
+    thread = std::thread([this]() {
+      while (!stop) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (::poll(&pfd, 1, 100) <= 0)
+          continue;
+        int c = ::accept(fd, nullptr, nullptr);
+        if (c != -1)
+          connections.emplace_back([this,c]() {
+            serve(c);
+            (void)::close(c);
+          });
+      }
+    });
+  }
+  ~Server() {
+    stop = true;
+    thread.join();
+    for (auto &c : connections)
+      c.join();
+    (void)::close(fd);
+  }
+  std::string url() const {
+    return STR("http://127.0.0.1:" << port << "/file");
+  }
+
+private:
+  void serve(int c) {
+    std::string req;
+    char buf[1024];
+    while (req.find("\r\n\r\n") == std::string::npos) {
+      auto res = ::recv(c, buf, sizeof(buf), 0);
+      if (res <= 0)
+        return;
+      req.append(buf, res);
+    }
+    numRequests++;
+    bool head = req.compare(0, 5, "HEAD ") == 0;
+    uint64_t start = 0;
+    auto range = req.find("\r\nRange: bytes=");
+    bool ranged = range != std::string::npos && !ignoreRange;
+    if (ranged)
+      start = ::strtoull(req.c_str() + range + 15, nullptr, 10);
+    if (start >= data.size()) {
+      (void)send(c, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+      return;
+    }
+    auto hdr = STR("HTTP/1.1 " << (ranged ? "206 Partial Content" : "200 OK") << "\r\n"
+                   << "Content-Length: " << data.size() - start << "\r\n"
+                   << (ranged ? STR("Content-Range: bytes " << start << "-" << data.size() - 1 << "/" << data.size() << "\r\n") : "")
+                   << "Last-Modified: Tue, 01 Jan 2019 00:00:00 GMT\r\n"
+                   << "Connection: close\r\n\r\n");
+    if (!send(c, hdr) || head)
+      return;
+    uint64_t end = data.size();
+    if (ranged && start == cutRangeFrom && !cut.exchange(true))
+      end = start + chunkSize/2;
+    for (uint64_t pos = start; pos < end;) {
+      auto res = ::send(c, data.data() + pos, std::min(end - pos, (uint64_t)0x10000), 0);
+      if (res <= 0)
+        return; // the client has closed it
+      pos += res;
+    }
+  }
+  static bool send(int c, const std::string &s) {
+    return ::send(c, s.data(), s.size(), 0) == (ssize_t)s.size();
+  }
+};
+
+static std::string hashOf(const uint8_t *data, size_t size) {
+  uint8_t h[32];
+  Util::sha256(data, size, h);
+  return Util::toHex(h, sizeof(h));
+}
+
+static bool exists(const std::string &path) {
+  struct stat sb;
+  return ::stat(path.c_str(), &sb) == 0;
+}
+
+class Case { // a fresh directory for the downloaded file, and the data received by the consumer
+public:
+  std::string          dir;
+  std::string          file;
+  std::vector<uint8_t> received;
+
+  Case(const std::string &name) {
+    auto *tmpDir = ::getenv("TMPDIR");
+    dir = STR((tmpDir != nullptr && *tmpDir != 0 ? tmpDir : "/tmp") << "/crate-check-" << name << ".XXXXXX");
+    if (::mkdtemp(&dir[0]) == nullptr)
+      ERR2("test", "failed to create a temporary directory: " << strerror(errno))
+    file = STR(dir << "/file");
+  }
+  ~Case() {
+    for (auto f : {file, STR(file << ".part"), STR(file << ".part.state")})
+      (void)::unlink(f.c_str());
+    (void)::rmdir(dir.c_str());
+  }
+  std::string run(Server &server, const std::string &sha256, Download::Stats &stats, size_t failAfter = 0) { // the consumer fails after failAfter bytes
+    received.clear();
+    return Download::toFile(server.url(), file, sha256, [this,failAfter](const uint8_t *data, size_t size) {
+      received.insert(received.end(), data, data + size);
+      if (failAfter != 0 && received.size() >= failAfter)
+        ERR2("test consumer", "interrupted after " << received.size() << " bytes")
+    }, []() { }, stats);
+  }
+  bool got(const std::vector<uint8_t> &data) const { // the consumer and the file both have the data
+    if (received != data || !exists(file))
+      return false;
+    MappedFile mf(file);
+    return mf.size == data.size() && ::memcmp(mf.data, data.data(), data.size()) == 0;
+  }
+};
+
+#define CHECK(cond) \
+  if (!(cond)) \
+    ERR2("check", "'" #cond "' is false");
+
+//
+// cases
+//
+
+static std::string checkResume(const std::vector<uint8_t> &data) {
+  Server server(data);
+  Case c("resume");
+  Download::Stats stats1, stats2;
+  try {
+    c.run(server, hashOf(data.data(), data.size()), stats1, chunkSize);
+    ERR2("check", "the interrupted download has succeeded")
+  } catch (const Exception &e) {
+    if (std::string(e.what()).find("interrupted after") == std::string::npos)
+      throw;
+  }
+  CHECK(!exists(c.file) && exists(STR(c.file << ".part")) && exists(STR(c.file << ".part.state")))
+
+  // the consumer has had chunk #0, so it is done; the other chunks are forgotten as if the interruption was earlier,
+  // and the record of chunk #2 is incomplete as if the interruption was in the middle of writing it
+  auto stateFile = STR(c.file << ".part.state");
+  std::vector<std::string> lines;
+  std::ifstream f(stateFile);
+  for (std::string line; std::getline(f, line);)
+    lines.push_back(line);
+  CHECK(lines.size() >= 4 && std::find(lines.begin() + 3, lines.end(), "done 0") != lines.end())
+  std::ofstream(stateFile, std::ios::trunc) << lines[0] << "\n" << lines[1] << "\n" << lines[2] << "\n" << "done 0\ndone 2";
+
+  auto hash = c.run(server, hashOf(data.data(), data.size()), stats2);
+  CHECK(hash == hashOf(data.data(), data.size()))
+  CHECK(c.got(data))
+  CHECK(stats2.numResumedBytes == chunkSize)
+  CHECK(stats2.numBytes == data.size() - chunkSize)
+  CHECK(!exists(STR(c.file << ".part")) && !exists(STR(c.file << ".part.state")))
+  return STR(stats2.numResumedBytes << " bytes resumed, " << stats2.numBytes << " downloaded");
+}
+
+static std::string checkNoRange(const std::vector<uint8_t> &data) {
+  Server server(data);
+  server.ignoreRange = true;
+  Case c("no-range");
+  Download::Stats stats;
+  c.run(server, hashOf(data.data(), data.size()), stats);
+  CHECK(c.got(data))
+  CHECK(stats.numConnections == 1 && stats.numRetries == 0)
+  CHECK(!exists(STR(c.file << ".part.state")))
+  return STR(stats.numBytes << " bytes over " << stats.numConnections << " connection");
+}
+
+static std::string checkRetry(const std::vector<uint8_t> &data) {
+  Server server(data);
+  server.cutRangeFrom = 2*chunkSize; // not chunkSize, where the range support is probed
+  Case c("retry");
+  Download::Stats stats;
+  c.run(server, hashOf(data.data(), data.size()), stats);
+  CHECK(c.got(data))
+  CHECK(stats.numRetries == 1)
+  CHECK(stats.numBytes == data.size()) // the cut range isn't downloaded again from its start
+  return STR(stats.numBytes << " bytes over " << stats.numConnections << " connections, " << stats.numRetries << " retry");
+}
+
+static std::string checkMismatch(const std::vector<uint8_t> &data) {
+  Server server(data);
+  Case c("mismatch");
+  Download::Stats stats;
+  try {
+    c.run(server, hashOf(data.data(), data.size() - 1), stats);
+    ERR2("check", "the download with the wrong SHA256 has succeeded")
+  } catch (const Exception &e) {
+    if (std::string(e.what()).find("instead of the published") == std::string::npos)
+      throw;
+  }
+  CHECK(!exists(c.file) && !exists(STR(c.file << ".part")) && !exists(STR(c.file << ".part.state")))
+  return "rejected, nothing is left behind";
+}
+
+int main(int argc, char **argv) {
+  ::signal(SIGPIPE, SIG_IGN); // the client closes connections early
+
+  // the same pseudo-random data every time
+  std::vector<uint8_t> data(fileSize);
+  uint32_t x = 2463534242;
+  for (auto &b : data) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    b = x;
+  }
+
+  std::map<std::string, std::function<std::string(const std::vector<uint8_t>&)>> cases = {
+    {"resume",   checkResume},
+    {"no-range", checkNoRange},
+    {"retry",    checkRetry},
+    {"mismatch", checkMismatch}
+  };
+  int res = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string name = argv[i];
+    try {
+      auto it = cases.find(name);
+      if (it == cases.end())
+        ERR2("check", "no such case")
+      auto details = it->second(data);
+      std::cout << name << ": ok (" << details << ")" << std::endl;
+    } catch (const Exception &e) {
+      std::cerr << name << ": FAILED: " << e.what() << std::endl;
+      res = 1;
+    }
+  }
+  return res;
+}
@@ -0,0 +1,77 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+//
+// checks Elf::Resolver against ldd(1) on the ELF files of this host: each argument is a file, or a directory whose ELF
+// files are all checked. The resolver has / as its root, so it sees the same libraries and ld-elf.so.hints as ldd(1).
+// The paths that ldd(1) prints after '=>' were the dependencies before the resolver, the resolver also returns
+// the files that they are symlinks to.
+//
+
+#include "elf.h"
+#include "util.h"
+#include "err.h"
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <string>
+#include <set>
+
+static bool runLdd(const std::string &file, std::set<std::string> &paths) { // returns false when ldd(1) fails on the file
+  auto f = ::popen(STR("ldd '" << file << "' 2>/dev/null").c_str(), "r");
+  if (f == nullptr)
+    ERR2("check", "failed to run ldd")
+  char line[1024];
+  while (::fgets(line, sizeof(line), f) != nullptr) {
+    std::string s = line;
+    auto arrow = s.find(" => ");
+    if (arrow == std::string::npos)
+      continue;
+    auto path = s.substr(arrow + 4, s.find(' ', arrow + 4) - arrow - 4);
+    if (path != "not") // not found
+      paths.insert(Util::stripTrailingSpace(path));
+  }
+  auto status = ::pclose(f);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+  Elf::Resolver resolver("/");
+  unsigned numFiles = 0, numSkipped = 0, numDiffer = 0;
+  for (int i = 1; i < argc; i++) {
+    std::set<std::string> files;
+    if (Util::Fs::dirExists(argv[i]))
+      files = Util::Fs::findElfFiles(argv[i]);
+    else
+      files.insert(argv[i]);
+    for (auto &file : files) {
+      MappedFile mf(file);
+      Elf::Dynamic dynamic;
+      std::set<std::string> lddPaths;
+      if (!Elf::readDynamic(mf.data, mf.size, dynamic) || !runLdd(file, lddPaths)) {
+        numSkipped++; // static, or not for this host
+        continue;
+      }
+      numFiles++;
+
+      auto expected = lddPaths;
+      for (auto &p : lddPaths)
+        expected.insert(resolver.realPath(p));
+      auto got = resolver.dependencies(file);
+      if (got != expected) {
+        numDiffer++;
+        std::cerr << file << ": FAILED" << std::endl;
+        for (auto &p : expected)
+          if (got.find(p) == got.end())
+            std::cerr << "  - " << p << " (only ldd)" << std::endl;
+        for (auto &p : got)
+          if (expected.find(p) == expected.end())
+            std::cerr << "  + " << p << " (only the resolver)" << std::endl;
+      }
+    }
+  }
+  std::cout << "ldd: " << (numDiffer == 0 ? "ok" : "FAILED") << " (" << numFiles << " files, " << numDiffer << " differ, "
+            << numSkipped << " skipped as static or not for this host)" << std::endl;
+  return numDiffer == 0 ? 0 : 1;
+}
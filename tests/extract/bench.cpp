@@ -0,0 +1,147 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+//
+// compares the extraction of a legacy crate (a multi-block xz-compressed tar) by the 'xz | tar' pipeline with the
+// in-process extraction of 'crate run -x', on a synthetic tree: bench [<size of the tree in MB>]
+//
+
+#include "extract.h"
+#include "cmd.h"
+#include "util.h"
+#include "err.h"
+
+#include <lzma.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+
+static const unsigned numRepeats = 3;
+
+class Rng { // xorshift, so that the tree is the same every time
+  uint32_t x = 2463534242;
+public:
+  uint32_t operator()() {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+  }
+  uint32_t operator()(uint32_t lo, uint32_t hi) {
+    return lo + (*this)()%(hi - lo + 1);
+  }
+};
+
+static void writeFile(const std::string &file, const std::string &data) {
+  auto *f = ::fopen(file.c_str(), "w");
+  if (f == nullptr || ::fwrite(data.data(), 1, data.size(), f) != data.size() || ::fclose(f) != 0)
+    ERR2("bench", "failed to write the file '" << file << "'")
+}
+
+static uint64_t makeTree(const std::string &dir, uint64_t size, unsigned &numFiles) { // files like those of a package tree
+  static const char *words[] = {"the", "crate", "jail", "lib", "usr", "local", "share", "config", "error", "value", "return",
+                                "static", "const", "struct", "function", "include", "define", "string", "buffer", "size"};
+  Rng rng;
+  uint64_t total = 0;
+  numFiles = 0;
+  Util::Fs::mkdir(dir, 0755);
+  while (total < size) {
+    auto sub = STR(dir << "/d" << numFiles/64);
+    if (numFiles%64 == 0)
+      Util::Fs::mkdir(sub, 0755);
+    std::string data;
+    auto kind = rng(0, 99);
+    if (kind < 70) { // text: sources, configs, docs
+      auto len = rng(512, 16384);
+      while (data.size() < len)
+        data += STR(words[rng()%(sizeof(words)/sizeof(words[0]))] << (rng(0, 9) == 0 ? "\n" : " "));
+    } else { // binaries: runs of repeated and random bytes
+      data.resize(kind < 97 ? rng(16384, 1 << 20) : rng(1 << 20, 16 << 20));
+      for (size_t off = 0; off < data.size();) {
+        auto len = std::min((size_t)rng(16, 4096), data.size() - off);
+        auto repeated = rng(0, 2) != 0;
+        auto byte = (char)rng();
+        for (size_t i = 0; i < len; i++)
+          data[off + i] = repeated ? byte : (char)rng();
+        off += len;
+      }
+    }
+    writeFile(STR(sub << "/f" << numFiles), data);
+    total += data.size();
+    numFiles++;
+  }
+  return total;
+}
+
+static std::vector<double> measure(const std::string &outDir, const std::function<void()> &fn) {
+  std::vector<double> seconds;
+  for (unsigned r = 0; r < numRepeats; r++) {
+    if (Util::Fs::dirExists(outDir))
+      Util::Fs::rmdirHier(outDir);
+    Util::Fs::mkdir(outDir, 0755);
+    auto tmStart = std::chrono::steady_clock::now();
+    fn();
+    seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count());
+  }
+  std::sort(seconds.begin(), seconds.end());
+  return seconds;
+}
+
+int main(int argc, char **argv) {
+  try {
+    uint64_t size = (argc > 1 ? ::strtoull(argv[1], nullptr, 10) : 256) << 20;
+    auto *tmpDir = ::getenv("TMPDIR");
+    auto dir = STR((tmpDir != nullptr && *tmpDir != 0 ? tmpDir : "/tmp") << "/crate-bench.XXXXXX");
+    if (::mkdtemp(&dir[0]) == nullptr)
+      ERR2("bench", "failed to create a temporary directory: " << strerror(errno))
+    RunAtEnd removeDir([&dir]() {
+      Util::Fs::rmdirHier(dir);
+    });
+
+    // the tree, and the crate as older versions of 'crate create' wrote it: xz with threads makes independent blocks
+    unsigned numFiles;
+    auto treeSize = makeTree(STR(dir << "/tree"), size, numFiles);
+    auto crate = STR(dir << "/tree.crate");
+    Util::runCommand(STR("tar cf - -C " << dir << "/tree . | " << Cmd::xz << " --block-size=8MiB > " << crate), "create the crate");
+    struct stat sb;
+    if (::stat(crate.c_str(), &sb) == -1)
+      ERR2("bench", "no crate file")
+    std::cout << std::fixed << std::setprecision(1)
+              << "tree: " << numFiles << " files, " << treeSize/1e6 << " MB; crate: " << sb.st_size/1e6 << " MB in "
+              << Util::runCommandGetOutput(STR("xz --robot --list " << crate << " | awk '/^totals/ {printf \"%s\", $3}'"), "count blocks")
+              << " blocks; best and median of " << numRepeats << " runs" << std::endl;
+    std::cout << "xz: " << Util::runCommandGetOutput("xz --version | head -1 | tr -d '\\n'", "get the version of xz")
+              << ", liblzma: " << ::lzma_version_string() << " (the decoder of either is only comparable to the same version)" << std::endl;
+
+    auto outDir = STR(dir << "/out");
+    auto report = [treeSize](const std::string &name, const std::vector<double> &seconds) {
+      std::cout << std::left << std::setw(40) << name << std::right << std::setprecision(2)
+                << std::setw(8) << seconds.front() << " s " << std::setw(8) << seconds[seconds.size()/2] << " s "
+                << std::setprecision(1) << std::setw(8) << treeSize/1e6/seconds.front() << " MB/s" << std::endl;
+    };
+    report("xz --decompress | tar xf -", measure(outDir, [&]() {
+      Util::runCommand(STR(Cmd::xz << " --decompress < " << crate << " | tar xf - -C " << outDir), "extract the crate");
+    }));
+    report("xz --decompress --threads=1 | tar xf -", measure(outDir, [&]() {
+      Util::runCommand(STR("xz --decompress --threads=1 < " << crate << " | tar xf - -C " << outDir), "extract the crate");
+    }));
+    Extract::Stats stats;
+    report("crate run -x (in-process)", measure(outDir, [&]() {
+      stats = Extract::crateFile(crate, outDir);
+    }));
+    if (stats.numBytes != treeSize)
+      ERR2("bench", "the in-process extraction has written " << stats.numBytes << " bytes instead of " << treeSize)
+  } catch (const Exception &e) {
+    std::cerr << "bench: FAILED: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
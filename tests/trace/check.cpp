@@ -0,0 +1,41 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+//
+// checks Trace::parse() and Trace::keepSet() on the sample traces: <name>.txt should give the paths of <name>.expected
+//
+
+#include "trace.h"
+#include "util.h"
+#include "err.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <set>
+
+int main(int argc, char **argv) {
+  int res = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string name = argv[i];
+    try {
+      unsigned numIgnored;
+      auto kept = Trace::keepSet(Trace::load(STR(name << ".txt")), numIgnored);
+      std::set<std::string> expected;
+      std::ifstream f(STR(name << ".expected"));
+      for (std::string line; std::getline(f, line);)
+        expected.insert(line);
+      if (kept != expected) {
+        std::cerr << name << ": FAILED, the keep set is:" << std::endl;
+        for (auto &p : kept)
+          std::cerr << "  " << p << std::endl;
+        res = 1;
+      } else {
+        std::cout << name << ": ok (" << kept.size() << " paths, " << numIgnored << " ignored)" << std::endl;
+      }
+    } catch (const Exception &e) {
+      std::cerr << name << ": FAILED: " << e.what() << std::endl;
+      res = 1;
+    }
+  }
+  return res;
+}
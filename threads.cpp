@@ -0,0 +1,113 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "threads.h"
+#include "util.h"
+
+ThreadPool::ThreadPool(unsigned numThreads) {
+  if (numThreads == 0)
+    numThreads = Util::getSysctlInt("hw.ncpu");
+  for (unsigned i = 0; i < numThreads; i++)
+    threads.push_back(std::thread([this]() {worker();}));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cvIdle.wait(lock, [this]() {return tasks.empty() && numBusy == 0;}); // tasks might reference the caller's state: let them finish
+    stop = true;
+  }
+  cvTask.notify_all();
+  for (auto &t : threads)
+    t.join();
+}
+
+unsigned ThreadPool::size() const {
+  return threads.size();
+}
+
+void ThreadPool::add(const std::function<void()> &task) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    tasks.push_back(task);
+  }
+  cvTask.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cvIdle.wait(lock, [this]() {return tasks.empty() && numBusy == 0;});
+  if (exception) {
+    auto e = exception;
+    exception = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+void ThreadPool::worker() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cvTask.wait(lock, [this]() {return stop || !tasks.empty();});
+    if (tasks.empty()) // stop
+      return;
+    auto task = std::move(tasks.front());
+    tasks.pop_front();
+    numBusy++;
+    lock.unlock();
+    try {
+      task();
+    } catch (...) {
+      std::unique_lock<std::mutex> lockEx(mutex);
+      if (!exception)
+        exception = std::current_exception();
+    }
+    lock.lock();
+    numBusy--;
+    if (tasks.empty() && numBusy == 0)
+      cvIdle.notify_all();
+  }
+}
+
+void runOrdered(unsigned numItems, const FnItem &fnProduce, const FnItem &fnConsume) {
+  class Slot {
+  public:
+    std::vector<uint8_t> item;
+    bool                 done = false;
+  };
+  std::vector<Slot> slots(numItems);
+  std::mutex mutex;
+  std::condition_variable cvDone;
+  bool failed = false;
+
+  ThreadPool pool;
+  unsigned window = 2*pool.size();
+  unsigned numQueued = 0;
+  auto queue = [&](unsigned i) {
+    pool.add([&,i]() {
+      try {
+        fnProduce(i, slots[i].item);
+      } catch (...) {
+        std::unique_lock<std::mutex> lock(mutex);
+        failed = true;
+        cvDone.notify_all();
+        throw;
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      slots[i].done = true;
+      cvDone.notify_all();
+    });
+  };
+
+  for (unsigned i = 0; i < numItems; i++) {
+    while (numQueued < numItems && numQueued < i + window)
+      queue(numQueued++);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cvDone.wait(lock, [&]() {return slots[i].done || failed;});
+      if (failed)
+        break;
+    }
+    fnConsume(i, slots[i].item);
+    std::vector<uint8_t>().swap(slots[i].item); // release memory
+  }
+  pool.wait(); // rethrows the producer's error, if any
+}
@@ -0,0 +1,48 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// ThreadPool: runs tasks on a fixed set of worker threads, wait() rethrows the first exception thrown by any task
+//
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include <stdint.h>
+
+class ThreadPool {
+  std::vector<std::thread>          threads;
+  std::deque<std::function<void()>> tasks;
+  std::mutex                        mutex;
+  std::condition_variable           cvTask;      // wakes up workers: a new task is available, or the pool is stopping
+  std::condition_variable           cvIdle;      // wakes up waiters: all tasks have finished
+  unsigned                          numBusy = 0;
+  bool                              stop = false;
+  std::exception_ptr                exception;   // the first exception thrown by a task
+
+public:
+  ThreadPool(unsigned numThreads = 0); // 0 means hw.ncpu threads
+  ~ThreadPool();
+
+  unsigned size() const;
+  void add(const std::function<void()> &task);
+  void wait(); // wait until all tasks have finished, rethrow the first task exception
+
+private:
+  void worker();
+};
+
+//
+// runOrdered: produces items in parallel on a thread pool, and consumes them in order on the calling thread,
+// only a limited number of produced items is kept in memory at any time
+//
+
+typedef std::function<void(unsigned idx, std::vector<uint8_t> &item)> FnItem;
+
+void runOrdered(unsigned numItems, const FnItem &fnProduce, const FnItem &fnConsume);
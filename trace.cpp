@@ -0,0 +1,179 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#include "trace.h"
+#include "util.h"
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <sstream>
+
+#define ERR(msg...) ERR2("access trace", msg)
+
+// system calls whose first string argument is a path, as truss(1) and strace(1) print them
+static const std::set<std::string> pathSyscalls = {
+  "open", "openat", "access", "eaccess", "faccessat", "stat", "lstat", "fstatat", "newfstatat", "statx", "statfs",
+  "execve", "readlink", "readlinkat", "chdir", "pathconf", "lpathconf", "__realpathat", "truncate"
+};
+
+//
+// helpers
+//
+
+static std::string trim(const std::string &line) {
+  auto b = line.find_first_not_of(" \t\r");
+  if (b == std::string::npos)
+    return "";
+  return line.substr(b, line.find_last_not_of(" \t\r") - b + 1);
+}
+
+static bool quoted(const std::string &line, size_t pos, std::string &out) { // the string that begins with the quote at pos
+  if (pos >= line.size() || line[pos] != '"')
+    return false;
+  out.clear();
+  for (pos++; pos < line.size(); pos++)
+    if (line[pos] == '\\' && pos + 1 < line.size())
+      out += line[++pos];
+    else if (line[pos] == '"')
+      return true;
+    else
+      out += line[pos];
+  return false; // truncated
+}
+
+static bool parseKdump(const std::string &line, std::string &path) { // "  1234 prog      NAMI  "/etc/libmap.conf""
+  auto nami = line.find(" NAMI ");
+  if (nami == std::string::npos)
+    return false;
+  auto quote = line.find_first_not_of(' ', nami + 6);
+  return quoted(line, quote, path);
+}
+
+static bool parseSyscall(const std::string &line, std::string &path) { // "openat(AT_FDCWD,"/etc/libmap.conf",O_RDONLY) = 3"
+  auto paren = line.find('(');
+  if (paren == std::string::npos)
+    return false;
+  auto nameBegin = paren;
+  while (nameBegin > 0 && (::isalnum(line[nameBegin - 1]) || line[nameBegin - 1] == '_'))
+    nameBegin--;
+  if (pathSyscalls.find(line.substr(nameBegin, paren - nameBegin)) == pathSyscalls.end())
+    return false;
+  auto quote = line.find('"', paren);
+  return quote != std::string::npos && quoted(line, quote, path);
+}
+
+static std::string kdump(const std::string &file) { // runs kdump(1) directly, the file name never reaches a shell
+  int fds[2];
+  if (::pipe(fds) == -1)
+    ERR("failed to create a pipe: " << strerror(errno))
+  auto pid = ::fork();
+  if (pid == -1) {
+    auto err = STR("failed to fork: " << strerror(errno));
+    (void)::close(fds[0]);
+    (void)::close(fds[1]);
+    ERR(err)
+  }
+  if (pid == 0) { // child
+    (void)::close(fds[0]);
+    if (::dup2(fds[1], STDOUT_FILENO) == -1)
+      ::_exit(127);
+    ::execl("/usr/bin/kdump", "kdump", "-f", file.c_str(), (char*)nullptr);
+    ::_exit(127);
+  }
+
+  // parent: the whole output, then the exit status
+  (void)::close(fds[1]);
+  std::string output;
+  char buf[0x10000];
+  ssize_t res;
+  while ((res = ::read(fds[0], buf, sizeof(buf))) != 0)
+    if (res > 0)
+      output.append(buf, res);
+    else if (errno != EINTR)
+      break;
+  (void)::close(fds[0]);
+  int status;
+  while (::waitpid(pid, &status, 0) == -1)
+    if (errno != EINTR)
+      ERR("failed to wait for kdump: " << strerror(errno))
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    ERR("kdump has failed to convert the ktrace file '" << file << "'")
+  return output;
+}
+
+//
+// interface
+//
+
+namespace Trace {
+
+std::vector<std::string> parse(std::istream &is) {
+  std::vector<std::string> paths;
+  std::string line, path;
+  while (std::getline(is, line)) {
+    auto trimmed = trim(line);
+    if (trimmed.empty() || trimmed[0] == '#')
+      continue;
+    if (trimmed[0] == '/')
+      paths.push_back(trimmed);
+    else if (parseKdump(line, path) || parseSyscall(line, path))
+      paths.push_back(path);
+  }
+  return paths;
+}
+
+std::vector<std::string> load(const std::string &file) {
+  std::ifstream f(file, std::ios::binary);
+  if (!f)
+    ERR("failed to open the trace file '" << file << "'")
+
+  // binary ktrace.out?
+  char head[512];
+  f.read(head, sizeof(head));
+  if (::memchr(head, 0, f.gcount()) != nullptr) {
+    std::istringstream converted(kdump(file));
+    return parse(converted);
+  }
+
+  f.clear();
+  f.seekg(0);
+  return parse(f);
+}
+
+std::set<std::string> keepSet(const std::vector<std::string> &paths, unsigned &numIgnored) {
+  std::set<std::string> res;
+  numIgnored = 0;
+  for (auto &path : paths) {
+    if (path.empty() || path[0] != '/') {
+      numIgnored++;
+      continue;
+    }
+    // lexically normalized
+    std::vector<std::string> components;
+    for (auto &c : Util::splitString(path, "/"))
+      if (c == "..") {
+        if (!components.empty())
+          components.pop_back();
+      } else if (c != ".") {
+        components.push_back(c);
+      }
+    if (components.empty())
+      continue; // the root itself
+    std::string normalized;
+    for (auto &c : components)
+      normalized.append("/").append(c);
+    res.insert(normalized);
+  }
+  return res;
+}
+
+}
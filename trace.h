@@ -0,0 +1,29 @@
+// Copyright (C) 2019 by Yuri Victorovich. All rights reserved.
+
+#pragma once
+
+//
+// Trace: the paths that the programs of a crate have accessed, imported from the output of a tracer, from which
+// 'create' derives what the crate keeps
+//
+// The format is recognized line by line, so that outputs of different tracers can be concatenated:
+//  * kdump(1) output: the NAMI records carry the paths that were looked up
+//  * truss(1) and strace(1) output: the first string argument of the system calls that take paths
+//  * plain lists: lines that are absolute paths, '#' begins a comment
+// Binary ktrace.out files, which the dbg-ktrace option saves, are converted by kdump(1) first.
+//
+
+#include <string>
+#include <vector>
+#include <set>
+#include <istream>
+
+namespace Trace {
+
+std::vector<std::string> parse(std::istream &is); // the paths in the order of their appearance, duplicates included
+std::vector<std::string> load(const std::string &file);
+
+// the normalized absolute paths to keep, the relative ones can't be located and are counted in numIgnored
+std::set<std::string> keepSet(const std::vector<std::string> &paths, unsigned &numIgnored);
+
+}
@@ -2,6 +2,8 @@
 
 #include "util.h"
 #include "err.h"
+#include "threads.h"
+#include "pathset.h"
 
 #include <string>
 #include <vector>
@@ -11,6 +13,8 @@
 #include <iomanip>
 #include <sstream>
 #include <functional>
+#include <mutex>
+#include <atomic>
 #include <filesystem>
 #include <algorithm>
 #include <cctype>
@@ -21,6 +25,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -29,7 +34,9 @@
 #include <sys/sysctl.h>
 #include <sys/param.h>
 #include <sys/linker.h>
+#include <sys/mman.h>
 #include <pwd.h>
+#include <sha256.h>
 
 
 #define SYSCALL(res, syscall, arg ...) Util::ckSyscallError(res, syscall, arg)
@@ -77,6 +84,37 @@ void RunAtEnd::doNow() {
   get()->doNow();
 }
 
+// MappedFile
+
+MappedFile::MappedFile(const std::string &file) {
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd == -1)
+    ERR2("map file", "failed to open the file '" << file << "': " << strerror(errno))
+  RunAtEnd closeFd([fd]() {
+    (void)::close(fd);
+  });
+  map(fd, file);
+}
+
+MappedFile::MappedFile(int fd, const std::string &file) {
+  map(fd, file);
+}
+
+MappedFile::~MappedFile() {
+  if (data != nullptr)
+    (void)::munmap((void*)data, size);
+}
+
+void MappedFile::map(int fd, const std::string &file) {
+  size = Util::Fs::getFileSize(fd);
+  if (size > 0) {
+    auto p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      ERR2("map file", "failed to mmap the file '" << file << "': " << strerror(errno))
+    data = (const uint8_t*)p;
+  }
+}
+
 
 namespace Util {
 
@@ -110,6 +148,28 @@ std::string runCommandGetOutput(const std::string &cmd, const std::string &what)
   return ss.str();
 }
 
+void runCommandStreamOutput(const std::string &cmd, const std::string &what, const std::function<void(const uint8_t *data, size_t size)> &fnData) {
+  // start the command
+  FILE *f = ::popen(cmd.c_str(), "r");
+  if (f == nullptr)
+    ERR2("run external command", "popen failed for (" << cmd << ")")
+  // pass command's output to the consumer
+  uint8_t buf[0x10000];
+  size_t nbytes;
+  try {
+    while ((nbytes = ::fread(buf, 1, sizeof(buf), f)) > 0)
+      fnData(buf, nbytes);
+  } catch (...) {
+    (void)::pclose(f);
+    throw;
+  }
+  // cleanup
+  auto res = ::pclose(f);
+  SYSCALL(res, "pclose", what.c_str());
+  if (res != 0)
+    ERR2("run external command", "the command '" << what << "' failed with the exit status " << res)
+}
+
 void ckSyscallError(int res, const char *syscall, const char *arg, const std::function<bool(int)> whiteWash) {
   if (res == -1 && !whiteWash(errno))
     ERR2("system call", "'" << syscall << "' failed, arg=" << arg << ": " << strerror(errno))
@@ -244,6 +304,24 @@ std::vector<std::string> reverseVector(const std::vector<std::string> &v) {
   return vc;
 }
 
+void sha256(const uint8_t *data, size_t size, uint8_t hash[32]) {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, data, size);
+  SHA256_Final(hash, &ctx);
+}
+
+std::string toHex(const uint8_t *data, size_t size) {
+  static const char *digits = "0123456789abcdef";
+  std::string s;
+  s.reserve(2*size);
+  for (size_t i = 0; i < size; i++) {
+    s += digits[data[i] >> 4];
+    s += digits[data[i] & 0xf];
+  }
+  return s;
+}
+
 namespace Fs {
 
 namespace fs = std::filesystem;
@@ -358,46 +436,140 @@ void rmdirFlat(const std::string &dir) {
   rmdir(dir);
 }
 
-void rmdirHier(const std::string &dir) {
-  for (const auto &entry : fs::directory_iterator(dir)) {
-    if (entry.is_symlink())
-      unlink(entry.path());
-    else if (entry.is_directory())
-      rmdirHier(entry.path());
-    else
-      unlink(entry.path());
+void unlinkAt(int dirFd, const char *name, int flags, const std::string &dirPath) {
+  auto res = ::unlinkat(dirFd, name, flags);
+  if (res == -1 && errno == EPERM && ::chflagsat(dirFd, name, 0/*flags*/, AT_SYMLINK_NOFOLLOW) == 0)
+    res = ::unlinkat(dirFd, name, flags); // repeat the unlinkat call
+  if (res == -1) // the path is only built for the error
+    ERR2("remove files", "failed to remove '" << (dirPath.empty() ? std::string(name) : STR(dirPath << "/" << name)) << "': " << strerror(errno))
+}
+
+static bool isDotOrDotDot(const char *name) {
+  return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
+static unsigned char entryType(int dirFd, const struct dirent *de, const std::string &dirPath) { // symlinks aren't followed
+  if (de->d_type != DT_UNKNOWN)
+    return de->d_type;
+  struct stat sb;
+  SYSCALL(::fstatat(dirFd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW), "fstatat", CSTR(dirPath << "/" << de->d_name));
+  return S_ISDIR(sb.st_mode) ? DT_DIR : DT_REG;
+}
+
+// TreeRemover: every directory is a task on the thread pool that removes its files relative to its fd, and queues
+// its subdirectories as new tasks. A directory is removed when the last of its subdirectories is gone, unless
+// something under it is in the except set. Directories that have no node in the except set have nothing kept
+// under them, so their entries aren't looked up.
+class TreeRemover {
+  class Dir {
+  public:
+    std::string           path;
+    PathSet::Node         node = PathSet::None; // in except
+    std::shared_ptr<Dir>  parent;
+    std::atomic<unsigned> pending{1};           // its own listing, and its subdirectories that aren't finished yet
+    std::atomic<bool>     kept{false};          // something under it is kept, so it stays
+  };
+
+  const PathSet *except; // paths relative to the top directory that are kept, nullptr when everything is removed
+  ThreadPool     pool;
+
+public:
+  TreeRemover(const PathSet *newExcept) : except(newExcept) { }
+
+  bool remove(const std::string &path, PathSet::Node node) { // returns whether something was kept
+    auto top = std::make_shared<Dir>();
+    top->path = path;
+    top->node = node;
+    pool.add([this,top]() {
+      removeDir(top);
+    });
+    pool.wait();
+    return top->kept;
   }
-  rmdir(dir);
+
+private:
+  void removeDir(const std::shared_ptr<Dir> &dir) {
+    {
+      int fd = ::open(dir->path.c_str(), O_RDONLY|O_DIRECTORY);
+      SYSCALL(fd, "open", dir->path.c_str());
+      auto d = ::fdopendir(fd);
+      if (d == nullptr) {
+        (void)::close(fd);
+        SYSCALL(-1, "fdopendir", dir->path.c_str());
+      }
+      RunAtEnd closeDir([d]() {
+        (void)::closedir(d);
+      });
+      while (auto de = ::readdir(d)) {
+        if (isDotOrDotDot(de->d_name))
+          continue;
+        auto node = except != nullptr ? except->child(dir->node, de->d_name) : PathSet::None;
+        if (except != nullptr && except->isMember(node)) {
+          dir->kept = true;
+          continue;
+        }
+        if (entryType(fd, de, dir->path) == DT_DIR) {
+          auto sub = std::make_shared<Dir>();
+          sub->path = dir->path + "/" + de->d_name;
+          sub->node = node;
+          sub->parent = dir;
+          dir->pending++;
+          pool.add([this,sub]() {
+            removeDir(sub);
+          });
+        } else {
+          unlinkAt(fd, de->d_name, 0, dir->path);
+        }
+      }
+    }
+    finished(dir);
+  }
+
+  static void finished(std::shared_ptr<Dir> dir) { // removes the directories that have nothing left to wait for, bottom up
+    while (dir && --dir->pending == 0) {
+      if (!dir->kept)
+        unlinkAt(AT_FDCWD, dir->path.c_str(), AT_REMOVEDIR, "");
+      else if (dir->parent)
+        dir->parent->kept = true;
+      dir = dir->parent;
+    }
+  }
+};
+
+void rmdirHier(const std::string &dir) {
+  (void)TreeRemover(nullptr).remove(dir, PathSet::None);
 }
 
-bool rmdirFlatExcept(const std::string &dir, const std::set<std::string> &except) {
+bool rmdirFlatExcept(const std::string &root, const std::string &dir, const PathSet &except) {
+  auto path = root + dir;
+  auto dirNode = except.find(dir);
+  int fd = ::open(path.c_str(), O_RDONLY|O_DIRECTORY);
+  SYSCALL(fd, "open", path.c_str());
+  auto d = ::fdopendir(fd);
+  if (d == nullptr) {
+    (void)::close(fd);
+    SYSCALL(-1, "fdopendir", path.c_str());
+  }
+  RunAtEnd closeDir([d]() {
+    (void)::closedir(d);
+  });
   bool someSkipped = false;
-  for (const auto &entry : fs::directory_iterator(dir))
-    if (except.find(entry.path()) == except.end())
-      unlink(entry.path());
+  while (auto de = ::readdir(d))
+    if (isDotOrDotDot(de->d_name))
+      continue;
+    else if (!except.isMember(except.child(dirNode, de->d_name)))
+      unlinkAt(fd, de->d_name, 0, path);
     else
       someSkipped = true;
+  closeDir.doNow();
   if (!someSkipped)
-    rmdir(dir);
+    rmdir(path);
   return someSkipped;
 }
 
-bool rmdirHierExcept(const std::string &dir, const std::set<std::string> &except) {
-  unsigned cntSkip = 0;
-  for (const auto &entry : fs::directory_iterator(dir))
-    if (except.find(entry.path()) == except.end()) {
-      if (entry.is_symlink())
-        unlink(entry.path());
-      else if (entry.is_directory())
-        cntSkip += rmdirHierExcept(entry.path(), except);
-      else
-        unlink(entry.path());
-    } else {
-      cntSkip++;
-    }
-  if (cntSkip == 0)
-    rmdir(dir);
-  return cntSkip > 0;
+bool rmdirHierExcept(const std::string &root, const std::string &dir, const PathSet &except) {
+  auto node = except.find(dir);
+  return TreeRemover(except.hasChildren(node) ? &except : nullptr).remove(root + dir, node);
 }
 
 bool isXzArchive(const char *file) {
@@ -427,63 +599,95 @@ bool isXzArchive(const char *file) {
   }
 }
 
-char isElfFileOrDir(const std::string &file) { // find if the file is a regular file, has the exec bit set, and is a dynamic ELF file
-  int res;
-
-  struct stat sb;
-  res = ::stat(file.c_str(), &sb);
-  if (res == -1) {
-    WARN("isElfFile: failed to stat the file '" << file << "': " << strerror(errno))
-    return 'N'; // ? what else to do after the above
+char isElfFileOrDirAt(int dirFd, const char *name, unsigned char type) {
+  // d_type tells directories and regular files apart without a stat, symlinks and other types are followed
+  if (type != DT_DIR && type != DT_REG) {
+    struct stat sb;
+    if (::fstatat(dirFd, name, &sb, 0) == -1) {
+      WARN("isElfFile: failed to stat the file '" << name << "': " << strerror(errno))
+      return 'N'; // ? what else to do after the above
+    }
+    type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
   }
 
   // directory?
-  if (sb.st_mode & S_IFDIR)
+  if (type == DT_DIR)
     return 'D';
+  if (type != DT_REG)
+    return 'N';
 
   // object files aren't dynamic ELFs
-  if (file.size() > 2 && file[file.size()-1] == 'o' && file[file.size()-2] == '.')
+  auto len = ::strlen(name);
+  if (len > 2 && name[len-1] == 'o' && name[len-2] == '.')
     return 'N';
 
-  if (sb.st_mode & S_IFREG /*&& sb.st_mode & S_IXUSR*/ && sb.st_size > 0x80) { // this reference claims that ELF can be as small as 142 bytes: http://timelessname.com/elfbin/
-    // x-bit is disabled above: some .so files have no exec bit, particularly /usr/lib/pam_*.so
-    uint8_t signature[4];
-    // read the signature
-    int fd = ::open(file.c_str(), O_RDONLY);
-    if (fd == -1) {
-      WARN("isElfFile: failed to open the file '" << file << "': " << strerror(errno))
-      return 'N'; // ? what else to do after the above
-    }
-    auto res = ::read(fd, signature, sizeof(signature));
-    if (res == -1)
-      WARN("isElfFile: failed to read signature from '" << file << "': " << strerror(errno))
-    if (::close(fd) == -1)
-      WARN("isElfFile: failed to close the file '" << file << "': " << strerror(errno))
-    // decide
-    return res == 4 && signature[0]==0x7f && signature[1]==0x45 && signature[2]==0x4c && signature[3]==0x46 ? 'E' : 'N';
-  } else {
-    return 'N';
+  // x-bit isn't checked: some .so files have no exec bit, particularly /usr/lib/pam_*.so
+  // the size is checked by reading past 0x80 bytes instead of a stat: this reference claims that ELF can be as small
+  // as 142 bytes: http://timelessname.com/elfbin/
+  uint8_t signature[0x81];
+  int fd = ::openat(dirFd, name, O_RDONLY);
+  if (fd == -1) {
+    WARN("isElfFile: failed to open the file '" << name << "': " << strerror(errno))
+    return 'N'; // ? what else to do after the above
   }
+  auto res = ::read(fd, signature, sizeof(signature));
+  if (res == -1)
+    WARN("isElfFile: failed to read signature from '" << name << "': " << strerror(errno))
+  if (::close(fd) == -1)
+    WARN("isElfFile: failed to close the file '" << name << "': " << strerror(errno))
+  // decide
+  return res == sizeof(signature) && signature[0]==0x7f && signature[1]==0x45 && signature[2]==0x4c && signature[3]==0x46 ? 'E' : 'N';
+}
+
+char isElfFileOrDir(const std::string &file) { // find if the file is a regular file and is an ELF file
+  return isElfFileOrDirAt(AT_FDCWD, file.c_str(), DT_UNKNOWN);
 }
 
 std::set<std::string> findElfFiles(const std::string &dir) {
+  // every directory is a task on the pool, and the subdirectories that it finds are queued as new tasks,
+  // so that idle threads pick up subtrees wherever they are, however unbalanced the tree is
   std::set<std::string> s;
+  std::mutex mutex;
+  ThreadPool pool;
   std::function<void(const std::string&)> addElfFilesToSet;
-  addElfFilesToSet = [&s,&addElfFilesToSet](const std::string &dir) {
-    for (const auto &entry : fs::directory_iterator(dir))
-      switch (isElfFileOrDir(entry.path())) {
+  addElfFilesToSet = [&s,&mutex,&pool,&addElfFilesToSet](const std::string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (fd == -1)
+      ERR2("find ELF files", "failed to open the directory '" << dir << "': " << strerror(errno))
+    auto d = ::fdopendir(fd);
+    if (d == nullptr) {
+      auto err = STR("failed to read the directory '" << dir << "': " << strerror(errno));
+      (void)::close(fd);
+      ERR2("find ELF files", err)
+    }
+    RunAtEnd closeDir([d]() {
+      (void)::closedir(d);
+    });
+    std::vector<std::string> elfFiles; // all signatures of the directory are read before the lock is taken once
+    while (auto de = ::readdir(d)) {
+      if (de->d_name[0] == '.' && (de->d_name[1] == 0 || (de->d_name[1] == '.' && de->d_name[2] == 0)))
+        continue;
+      switch (isElfFileOrDirAt(fd, de->d_name, de->d_type)) {
       case 'E':
-        s.insert(entry.path());
+        elfFiles.push_back(dir + "/" + de->d_name);
         break;
       case 'D':
-        addElfFilesToSet(entry.path());
+        pool.add([subdir = dir + "/" + de->d_name, &addElfFilesToSet]() {
+          addElfFilesToSet(subdir);
+        });
         break;
       default:
         ; // do nothing
       }
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    s.insert(elfFiles.begin(), elfFiles.end());
   };
 
-  addElfFilesToSet(dir);
+  pool.add([&dir,&addElfFilesToSet]() {
+    addElfFilesToSet(dir);
+  });
+  pool.wait();
 
   return s;
 }
@@ -493,6 +697,33 @@ bool hasExtension(const char *file, const char *extension) {
   return ext != nullptr && ::strcmp(ext, extension) == 0;
 }
 
+std::vector<std::pair<uint64_t, uint64_t>> getDataSegments(int fd, const struct stat &sb) {
+  uint64_t size = sb.st_size;
+  if ((uint64_t)sb.st_blocks*512 >= size) // fully allocated, no need to look for holes
+    return {{0, size}};
+
+  std::vector<std::pair<uint64_t, uint64_t>> segs;
+  uint64_t pos = 0;
+  while (pos < size) {
+    auto data = ::lseek(fd, pos, SEEK_DATA);
+    if (data == -1 && errno == ENXIO)
+      break; // a hole till the end
+    if (data == -1 && errno == EINVAL)
+      return {{0, size}}; // the file system can't tell
+    if (data == -1)
+      ERR2("find data segments", "lseek(SEEK_DATA) failed: " << strerror(errno))
+    auto hole = ::lseek(fd, data, SEEK_HOLE);
+    if (hole == -1)
+      ERR2("find data segments", "lseek(SEEK_HOLE) failed: " << strerror(errno))
+    hole = std::min((uint64_t)hole, size);
+    if ((uint64_t)data >= size)
+      break;
+    segs.push_back({data, hole - data});
+    pos = hole;
+  }
+  return segs;
+}
+
 void copyFile(const std::string &srcFile, const std::string &dstFile) {
   try {
     fs::copy_file(srcFile, dstFile);
@@ -9,8 +9,10 @@
 #include <sstream>
 #include <memory>
 #include <functional>
+#include <utility>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -76,6 +78,21 @@ public:
   void doNow();
 };
 
+class PathSet;
+
+class MappedFile {
+public:
+  const uint8_t *data = nullptr;
+  size_t         size = 0;
+
+  MappedFile(const std::string &file); // read-only mapping of the whole file
+  MappedFile(int fd, const std::string &file); // the same for the file that is already open, fd stays open, file is for errors
+  ~MappedFile();
+
+private:
+  void map(int fd, const std::string &file);
+};
+
 //
 // utility functions
 //
@@ -84,6 +101,7 @@ namespace Util {
 
 void runCommand(const std::string &cmd, const std::string &what);
 std::string runCommandGetOutput(const std::string &cmd, const std::string &what);
+void runCommandStreamOutput(const std::string &cmd, const std::string &what, const std::function<void(const uint8_t *data, size_t size)> &fnData);
 void ckSyscallError(int res, const char *syscall, const char *arg, const std::function<bool(int)> whiteWash = [](int err) {return false;});
 std::string tmSecMs();
 std::string filePathToBareName(const std::string &path);
@@ -99,6 +117,8 @@ unsigned toUInt(const std::string &str);
 std::string pathSubstituteVarsInPath(const std::string &path);
 std::string pathSubstituteVarsInString(const std::string &str);
 std::vector<std::string> reverseVector(const std::vector<std::string> &v);
+void sha256(const uint8_t *data, size_t size, uint8_t hash[32]);
+std::string toHex(const uint8_t *data, size_t size);
 
 namespace Fs {
 
@@ -114,15 +134,18 @@ void chown(const std::string &path, uid_t owner, gid_t group);
 void link(const std::string &name1, const std::string &name2);
 void unlink(const std::string &file);
 void mkdir(const std::string &dir, mode_t mode);
+void unlinkAt(int dirFd, const char *name, int flags, const std::string &dirPath); // clears the schg flag on EPERM like unlink() and rmdir(), dirPath is for errors
 void rmdir(const std::string &dir);
 void rmdirFlat(const std::string &dir);
 void rmdirHier(const std::string &dir);
-bool rmdirFlatExcept(const std::string &dir, const std::set<std::string> &except);
-bool rmdirHierExcept(const std::string &dir, const std::set<std::string> &except);
+bool rmdirFlatExcept(const std::string &root, const std::string &dir, const PathSet &except); // dir and the paths in except are relative to root
+bool rmdirHierExcept(const std::string &root, const std::string &dir, const PathSet &except); // --"--
 bool isXzArchive(const char *file);
 char isElfFileOrDir(const std::string &file); // returns 'E'LF, 'D'ir, or 'N'o
+char isElfFileOrDirAt(int dirFd, const char *name, unsigned char type); // the same relative to dirFd, type is d_type or DT_UNKNOWN
 std::set<std::string> findElfFiles(const std::string &dir);
 bool hasExtension(const char *file, const char *extension);
+std::vector<std::pair<uint64_t, uint64_t>> getDataSegments(int fd, const struct stat &sb); // (offset, size) of the data between holes, one segment when there are no holes
 void copyFile(const std::string &srcFile, const std::string &dstFile);
 std::vector<std::string> expandWildcards(const std::string &wildcardPath, const std::string &cmdPrefix = "");
 